@@ -0,0 +1,631 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+#endif
+#include "leptjson.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * leptjson_bench [--min-time SEC] [--filter STR] [--save FILE]
+ *                [--baseline FILE] [--threshold PCT]
+ *
+ * Runs parse (plain, with error reporting, with strict UTF-8, traced,
+ * projected down to a few ids, with packed number arrays, into a tape and on
+ * 2, 4 and 8 threads), validate, stringify (plain, into a preallocated
+ * buffer and sorted), copy, equal, diff, find and hash over generated
+ * corpora and prints one tab-separated line per case. --save writes the same lines to a file;
+ * --baseline compares against such a file and exits non-zero when a case is
+ * slower than the threshold allows or allocates more than before.
+ */
+
+#define BENCH_MAX_RESULTS 256
+#define BENCH_NAME_SIZE 64
+#define BENCH_ROUNDS 5
+
+typedef struct {
+    const char* name;
+    char* json;
+    size_t len;
+    lept_value v, copy;
+    char* out; /* room for v stringified */
+    size_t out_size;
+} bench_corpus;
+
+typedef struct {
+    char name[BENCH_NAME_SIZE];
+    unsigned long bytes, iterations;
+    double ns_per_op, mb_per_s, allocs_per_op;
+} bench_result;
+
+typedef struct {
+    char* s;
+    size_t len, cap;
+} bench_buffer;
+
+static volatile size_t bench_sink;
+static unsigned long bench_seed = 1;
+
+static lept_alloc_stats bench_stats;
+
+#if defined(__unix__) || defined(__APPLE__)
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#else
+static double bench_now(void) {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+#endif
+
+static unsigned long bench_rand(void) {
+    bench_seed = bench_seed * 1103515245UL + 12345UL;
+    return (bench_seed >> 16) & 0x7FFF;
+}
+
+static void bench_puts(bench_buffer* b, const char* s) {
+    size_t len = strlen(s);
+    if (b->len + len + 1 > b->cap) {
+        while (b->len + len + 1 > b->cap)
+            b->cap = b->cap ? b->cap + (b->cap >> 1) : 4096;
+        b->s = (char*)realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->len, s, len + 1);
+    b->len += len;
+}
+
+static void bench_putn(bench_buffer* b, const char* format, double n) {
+    char buffer[512]; /* formats carry literal text around the number */
+    sprintf(buffer, format, n);
+    bench_puts(b, buffer);
+}
+
+/* Corpora shaped like the usual JSON benchmark files */
+
+static void bench_gen_canada(bench_buffer* b) {
+    int i, j;
+    bench_puts(b, "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\",\"properties\":{\"name\":\"Canada\"},"
+        "\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[");
+    for (i = 0; i < 160; i++) {
+        bench_puts(b, i ? ",[" : "[");
+        for (j = 0; j < 250; j++) {
+            bench_putn(b, j ? ",[%.15g" : "[%.15g", -141.0 + bench_rand() / 327.67 + bench_rand() * 1e-12);
+            bench_putn(b, ",%.15g]", 41.0 + bench_rand() / 800.0 + bench_rand() * 1e-12);
+        }
+        bench_puts(b, "]");
+    }
+    bench_puts(b, "]}}]}");
+}
+
+static void bench_gen_twitter(bench_buffer* b) {
+    static const char* texts[] = {
+        "@aym0566x \\n\\u540d\\u524d:\\u524d\\u7530\\u3042\\u3086\\u307f\\n\\u7b2c\\u4e00\\u5370\\u8c61:\\u306a\\u3093\\u304b\\u6016\\u3063\\uff01",
+        "RT @KATANA77: \xe3\x81\x88\xe3\x81\xa3\xe3\x81\xa8\xe2\x80\xa6 \xe3\x81\x8a\xe5\x89\x8d\xe3\x82\x89\xe2\x80\xa6 http://t.co/PkCJAcSuYK",
+        "\\\"Quoted\\\" text with a tab\\t and a plain ASCII tail that goes on for a while to look like a real status update"
+    };
+    int i;
+    bench_puts(b, "{\"statuses\":[");
+    for (i = 0; i < 400; i++) {
+        if (i)
+            bench_puts(b, ",");
+        bench_puts(b, "{\"metadata\":{\"result_type\":\"recent\",\"iso_language_code\":\"ja\"},\"created_at\":\"Sun Aug 31 00:29:15 +0000 2014\"");
+        bench_putn(b, ",\"id\":%.0f", 505874924095815681.0 + i);
+        bench_putn(b, ",\"id_str\":\"%.0f\",\"text\":\"", 505874924095815681.0 + i);
+        bench_puts(b, texts[i % 3]);
+        bench_puts(b, "\",\"source\":\"<a href=\\\"http://twitter.com/download/iphone\\\" rel=\\\"nofollow\\\">Twitter for iPhone</a>\","
+            "\"truncated\":false,\"in_reply_to_status_id\":null,\"in_reply_to_screen_name\":\"aym0566x\",\"user\":{");
+        bench_putn(b, "\"id\":%.0f,\"name\":\"\xe3\x82\x81\xe3\x81\x84\xe3\x81\xbf\xe2\x99\xaa\",\"screen_name\":\"walkpurple\","
+            "\"location\":\"\xe5\xa4\xa7\xe5\x88\x86\",\"description\":\"\xe7\xa7\x81\xe3\x81\xaf\xe7\xa7\x81\",\"url\":null,", 1186275104.0 + bench_rand());
+        bench_putn(b, "\"followers_count\":%.0f,\"friends_count\":185,\"verified\":false,\"lang\":\"ja\","
+            "\"profile_image_url\":\"http://pbs.twimg.com/profile_images/497760886795153410/LDjAwR_y_normal.jpeg\"},", (double)bench_rand());
+        bench_puts(b, "\"geo\":null,\"coordinates\":null,\"place\":null,\"retweet_count\":0,\"favorite_count\":0,"
+            "\"entities\":{\"hashtags\":[],\"symbols\":[],\"urls\":[],\"user_mentions\":[{\"screen_name\":\"aym0566x\","
+            "\"name\":\"\xe5\x89\x8d\xe7\x94\xb0\",\"id\":866260188,\"id_str\":\"866260188\",\"indices\":[0,9]}]},"
+            "\"favorited\":false,\"retweeted\":false,\"lang\":\"ja\"}");
+    }
+    bench_puts(b, "],\"search_metadata\":{\"completed_in\":0.087,\"max_id\":505874924095815681,\"query\":\"%E4%B8%80\",\"count\":100}}");
+}
+
+static void bench_gen_citm(bench_buffer* b) {
+    int i, j;
+    bench_puts(b, "{\"areaNames\":{");
+    for (i = 0; i < 200; i++) {
+        bench_putn(b, i ? ",\"%.0f\":\"Arri\xc3\xa8re-sc\xc3\xa8ne central\"" : "\"%.0f\":\"Arri\xc3\xa8re-sc\xc3\xa8ne central\"", 205705993.0 + i);
+    }
+    bench_puts(b, "},\"events\":{");
+    for (i = 0; i < 600; i++) {
+        bench_putn(b, i ? ",\"%.0f\":{" : "\"%.0f\":{", 138586341.0 + i);
+        bench_putn(b, "\"description\":null,\"id\":%.0f,\"logo\":\"/images/UE0AAAAACEKo6QAAAAZDSVRN\","
+            "\"name\":\"30th Anniversary Tour\",\"subTopicIds\":[337184269,337184283],\"subjectCode\":null,"
+            "\"subtitle\":null,\"topicIds\":[324846099,107888604]}", 138586341.0 + i);
+    }
+    bench_puts(b, "},\"performances\":[");
+    for (i = 0; i < 800; i++) {
+        bench_putn(b, i ? ",{\"eventId\":%.0f" : "{\"eventId\":%.0f", 138586341.0 + i % 600);
+        bench_putn(b, ",\"id\":%.0f,\"logo\":null,\"name\":null,\"prices\":[", 339887544.0 + i);
+        for (j = 0; j < 3; j++)
+            bench_putn(b, j ? ",{\"amount\":%.0f,\"audienceSubCategoryId\":337100890,\"seatCategoryId\":338937295}"
+                : "{\"amount\":%.0f,\"audienceSubCategoryId\":337100890,\"seatCategoryId\":338937295}", 90250.0 + bench_rand());
+        bench_puts(b, "],\"seatCategories\":[{\"areas\":[{\"areaId\":205705999,\"blockIds\":[]},{\"areaId\":205705998,\"blockIds\":[]}],"
+            "\"seatCategoryId\":338937295}],\"seatMapImage\":null,\"start\":1372701600000,\"venueCode\":\"PLEYEL_PLEYEL\"}");
+    }
+    bench_puts(b, "]}");
+}
+
+static void bench_gen_deep(bench_buffer* b) {
+    int i, depth = 500;
+    for (i = 0; i < depth; i++)
+        bench_puts(b, i % 2 ? "{\"k\":[1,\"s\"," : "[true,");
+    bench_puts(b, "null");
+    for (i = depth - 1; i >= 0; i--)
+        bench_puts(b, i % 2 ? "]}" : "]");
+}
+
+static void bench_gen_wide(bench_buffer* b) {
+    int i;
+    bench_puts(b, "{");
+    for (i = 0; i < 3000; i++)
+        bench_putn(b, i ? ",\"key%.0f\":[1,2]" : "\"key%.0f\":[1,2]", (double)i);
+    bench_puts(b, "}");
+}
+
+static void bench_gen_numbers(bench_buffer* b) {
+    int i;
+    bench_puts(b, "[");
+    for (i = 0; i < 60000; i++) {
+        if (i)
+            bench_puts(b, ",");
+        switch (i % 4) {
+            case 0: bench_putn(b, "%.0f", (double)bench_rand() * bench_rand()); break;
+            case 1: bench_putn(b, "%.17g", bench_rand() / 3.0); break;
+            case 2: bench_putn(b, "%.6e", -bench_rand() * 1e-7); break;
+            default: bench_putn(b, "%.3f", bench_rand() / 7.0); break;
+        }
+    }
+    bench_puts(b, "]");
+}
+
+/* Long text fields: mostly plain prose with the odd newline, quote or
+ * non-ASCII character, like article bodies or log messages */
+static void bench_gen_text(bench_buffer* b) {
+    static const char* words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit",
+        "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna"
+    };
+    int i, j;
+    bench_puts(b, "[");
+    for (i = 0; i < 200; i++) {
+        bench_puts(b, i ? ",{\"id\":" : "{\"id\":");
+        bench_putn(b, "%.0f,\"body\":\"", (double)i);
+        for (j = 0; j < 400; j++) {
+            unsigned r = (unsigned)bench_rand();
+            bench_puts(b, words[r % 18]);
+            switch (r % 97) {
+                case 0: bench_puts(b, ".\\n\\n"); break;
+                case 1: bench_puts(b, " \\\"quoted\\\" "); break;
+                case 2: bench_puts(b, " caf\xc3\xa9 "); break;
+                default: bench_puts(b, " "); break;
+            }
+        }
+        bench_puts(b, "\"}");
+    }
+    bench_puts(b, "]");
+}
+
+/* One big array of small records, like an export or a snapshot dump: the
+ * shape the threaded parse splits up */
+static void bench_gen_records(bench_buffer* b) {
+    int i;
+    bench_puts(b, "[");
+    for (i = 0; i < 40000; i++) {
+        bench_putn(b, i ? ",\n{\"id\":%.0f," : "{\"id\":%.0f,", (double)i);
+        bench_putn(b, "\"name\":\"user %.0f\",\"email\":\"user@example.com\",\"active\":true,", (double)bench_rand());
+        bench_putn(b, "\"score\":%.3f,\"tags\":[\"a\",\"b\",\"c\"],\"address\":{\"street\":\"1 Main St\",", bench_rand() / 7.0);
+        bench_putn(b, "\"city\":\"Springfield\",\"zip\":\"%05.0f\"},\"note\":\"line one\\nline \\\"two\\\"\"}", (double)bench_rand());
+    }
+    bench_puts(b, "]");
+}
+
+/* Operations, each run over one corpus */
+
+static void bench_parse(bench_corpus* c) {
+    lept_value v;
+    lept_init(&v);
+    if (lept_parse(&v, c->json) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+/* Same as parse but asks for error details, which must not slow success. */
+static void bench_parse_diag(bench_corpus* c) {
+    lept_parse_options opt;
+    lept_parse_error e;
+    lept_value v;
+    lept_parse_options_init(&opt);
+    opt.error = &e;
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: parse failed at %lu:%lu\n", c->name, (unsigned long)e.line, (unsigned long)e.column);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static void bench_parse_strict(bench_corpus* c) {
+    lept_parse_options opt;
+    lept_value v;
+    lept_parse_options_init(&opt);
+    opt.flags = LEPT_PARSE_STRICT_UTF8;
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: strict parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static unsigned long bench_trace_clock(void* ud) {
+    (void)ud;
+    return (unsigned long)(bench_now() * 1e9);
+}
+
+/* counters and phase timers; the same as parse unless built with LEPT_TRACE */
+static void bench_parse_trace(bench_corpus* c) {
+    lept_parse_options opt;
+    lept_trace trace;
+    lept_value v;
+    memset(&trace, 0, sizeof(trace));
+    trace.clock = bench_trace_clock;
+    lept_parse_options_init(&opt);
+    opt.trace = &trace;
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: traced parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v) + trace.max_depth;
+    lept_free(&v);
+}
+
+/* a handful of ids out of each corpus, everything else is skipped */
+static void bench_parse_project(bench_corpus* c) {
+    static const char* const keep[] = {
+        "/statuses/*/id", "/statuses/*/user/screen_name", "/performances/*/id", "/*/id"
+    };
+    lept_parse_options opt;
+    lept_value v;
+    lept_parse_options_init(&opt);
+    opt.keep = keep;
+    opt.nkeep = sizeof(keep) / sizeof(keep[0]);
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: projected parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static void bench_parse_packed(bench_corpus* c) {
+    lept_parse_options opt;
+    lept_value v;
+    lept_parse_options_init(&opt);
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: packed parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static void bench_parse_tape(bench_corpus* c) {
+    lept_tape t;
+    if (lept_parse_tape(&t, c->json, NULL) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: tape parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += t.nwords;
+    lept_tape_free(&t);
+}
+
+static void bench_parse_threads(bench_corpus* c, unsigned threads) {
+    lept_parse_options opt;
+    lept_value v;
+    lept_parse_options_init(&opt);
+    opt.threads = threads;
+    lept_init(&v);
+    if (lept_parse_ex(&v, c->json, &opt) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: threaded parse failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static void bench_parse_mt2(bench_corpus* c) {
+    bench_parse_threads(c, 2);
+}
+
+static void bench_parse_mt4(bench_corpus* c) {
+    bench_parse_threads(c, 4);
+}
+
+static void bench_parse_mt8(bench_corpus* c) {
+    bench_parse_threads(c, 8);
+}
+
+static void bench_validate(bench_corpus* c) {
+    if (lept_validate(c->json, c->len, NULL) != LEPT_PARSE_OK) {
+        fprintf(stderr, "%s: validate failed\n", c->name);
+        exit(2);
+    }
+}
+
+static void bench_stringify(bench_corpus* c) {
+    size_t length;
+    char* json = lept_stringify(&c->v, &length);
+    bench_sink += length;
+    free(json);
+}
+
+static void bench_stringify_to(bench_corpus* c) {
+    size_t length;
+    if (lept_stringify_to(&c->v, c->out, c->out_size, &length, 0) != LEPT_STRINGIFY_OK) {
+        fprintf(stderr, "%s: stringify_to failed\n", c->name);
+        exit(2);
+    }
+    bench_sink += length;
+}
+
+static void bench_stringify_sorted(bench_corpus* c) {
+    size_t length;
+    char* json = lept_stringify_ex(&c->v, &length, LEPT_STRINGIFY_SORT_KEYS);
+    bench_sink += length;
+    free(json);
+}
+
+static void bench_copy(bench_corpus* c) {
+    lept_value v;
+    lept_init(&v);
+    lept_copy(&v, &c->v);
+    bench_sink += lept_get_type(&v);
+    lept_free(&v);
+}
+
+static void bench_equal(bench_corpus* c) {
+    bench_sink += lept_is_equal(&c->v, &c->copy);
+}
+
+static void bench_unhash(lept_value* v) {
+    size_t i;
+    if (lept_get_type(v) == LEPT_OBJECT) {
+        for (i = 0; i < lept_get_object_size(v); i++)
+            bench_unhash(lept_get_object_value(v, i));
+    }
+    else if (lept_get_type(v) == LEPT_ARRAY) {
+        for (i = 0; i < lept_get_array_size(v); i++)
+            bench_unhash((lept_value*)lept_get_array_element(v, i));
+    }
+    lept_invalidate_hash(v);
+}
+
+/* lept_diff() hashes both sides: drop the caches again, as bench_hash does */
+static void bench_diff(bench_corpus* c) {
+    bench_sink += lept_diff(&c->v, &c->copy, NULL, 0);
+    bench_unhash(&c->v);
+    bench_unhash(&c->copy);
+}
+
+static size_t bench_find_walk(const lept_value* v) {
+    size_t i, n = 0;
+    if (lept_get_type(v) == LEPT_OBJECT) {
+        for (i = 0; i < lept_get_object_size(v); i++) {
+            n += lept_find_object_value(v, lept_get_object_key(v, i), lept_get_object_key_length(v, i)) != NULL;
+            n += bench_find_walk(lept_get_object_value(v, i));
+        }
+    }
+    else if (lept_get_type(v) == LEPT_ARRAY) {
+        for (i = 0; i < lept_get_array_size(v); i++)
+            n += bench_find_walk(lept_get_array_element(v, i));
+    }
+    return n;
+}
+
+static void bench_find(bench_corpus* c) {
+    bench_sink += bench_find_walk(&c->v);
+}
+
+/* Cold hash: caches are dropped afterwards so the other cases never see them */
+static void bench_hash(bench_corpus* c) {
+    bench_sink += lept_hash(&c->v);
+    bench_unhash(&c->v);
+}
+
+typedef struct {
+    const char* name;
+    void (*generate)(bench_buffer*);
+} bench_corpus_def;
+
+typedef struct {
+    const char* name;
+    void (*run)(bench_corpus*);
+} bench_op_def;
+
+static const bench_corpus_def bench_corpora[] = {
+    { "canada", bench_gen_canada },
+    { "twitter", bench_gen_twitter },
+    { "citm_catalog", bench_gen_citm },
+    { "deep", bench_gen_deep },
+    { "wide", bench_gen_wide },
+    { "numbers", bench_gen_numbers },
+    { "text", bench_gen_text },
+    { "records", bench_gen_records }
+};
+
+static const bench_op_def bench_ops[] = {
+    { "parse", bench_parse },
+    { "parse_diag", bench_parse_diag },
+    { "parse_strict", bench_parse_strict },
+    { "parse_trace", bench_parse_trace },
+    { "parse_project", bench_parse_project },
+    { "parse_packed", bench_parse_packed },
+    { "parse_tape", bench_parse_tape },
+    { "parse_mt2", bench_parse_mt2 },
+    { "parse_mt4", bench_parse_mt4 },
+    { "parse_mt8", bench_parse_mt8 },
+    { "validate", bench_validate },
+    { "stringify", bench_stringify },
+    { "stringify_to", bench_stringify_to },
+    { "stringify_sorted", bench_stringify_sorted },
+    { "copy", bench_copy },
+    { "equal", bench_equal },
+    { "diff", bench_diff },
+    { "find", bench_find },
+    { "hash", bench_hash }
+};
+
+static bench_result bench_results[BENCH_MAX_RESULTS];
+static int bench_result_count = 0;
+
+static void bench_run(bench_corpus* c, const bench_op_def* op, double min_time) {
+    bench_result* r = &bench_results[bench_result_count++];
+    unsigned long n, iterations = 0, allocs;
+    double start, elapsed, best = 0.0;
+    int round;
+    op->run(c); /* warm up */
+    allocs = bench_stats.allocs + bench_stats.reallocs;
+    /* report the fastest of several rounds, the others mostly measure noise */
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        n = 0;
+        start = bench_now();
+        do {
+            op->run(c);
+            n++;
+        } while ((elapsed = bench_now() - start) < min_time / BENCH_ROUNDS);
+        if (round == 0 || elapsed / n < best)
+            best = elapsed / n;
+        iterations += n;
+    }
+    sprintf(r->name, "%s/%s", c->name, op->name);
+    r->bytes = (unsigned long)c->len;
+    r->iterations = iterations;
+    r->ns_per_op = best * 1e9;
+    r->mb_per_s = c->len / best / 1e6;
+    r->allocs_per_op = (double)(bench_stats.allocs + bench_stats.reallocs - allocs) / iterations;
+}
+
+static void bench_print(FILE* f) {
+    int i;
+    fprintf(f, "# name\tbytes\titerations\tns_per_op\tmb_per_s\tallocs_per_op\n");
+    for (i = 0; i < bench_result_count; i++) {
+        const bench_result* r = &bench_results[i];
+        fprintf(f, "%s\t%lu\t%lu\t%.1f\t%.2f\t%.1f\n", r->name, r->bytes, r->iterations, r->ns_per_op, r->mb_per_s, r->allocs_per_op);
+    }
+}
+
+static int bench_compare(const char* path, double threshold) {
+    FILE* f = fopen(path, "r");
+    char line[256];
+    int i, regressions = 0;
+    if (!f) {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        return 2;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        bench_result base;
+        if (line[0] == '#' || sscanf(line, "%63s %lu %lu %lf %lf %lf", base.name, &base.bytes, &base.iterations,
+            &base.ns_per_op, &base.mb_per_s, &base.allocs_per_op) != 6)
+            continue;
+        for (i = 0; i < bench_result_count; i++) {
+            const bench_result* r = &bench_results[i];
+            if (strcmp(r->name, base.name) != 0)
+                continue;
+            if (r->ns_per_op > base.ns_per_op * (1.0 + threshold / 100.0)) {
+                fprintf(stderr, "REGRESSION %s: %.1f -> %.1f ns/op (%+.1f%%)\n", r->name,
+                    base.ns_per_op, r->ns_per_op, (r->ns_per_op / base.ns_per_op - 1.0) * 100.0);
+                regressions++;
+            }
+            if (r->allocs_per_op > base.allocs_per_op + 0.5) {
+                fprintf(stderr, "REGRESSION %s: %.1f -> %.1f allocs/op\n", r->name, base.allocs_per_op, r->allocs_per_op);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    fprintf(stderr, "%d regression(s) against %s (threshold %.0f%%)\n", regressions, path, threshold);
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    const char* filter = NULL, * save = NULL, * baseline = NULL;
+    double min_time = 0.2, threshold = 15.0;
+    lept_allocator counting = *lept_get_allocator();
+    size_t i, j;
+    int a;
+    counting.stats = &bench_stats;
+    lept_set_allocator(&counting);
+    for (a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc)
+            min_time = atof(argv[++a]);
+        else if (strcmp(argv[a], "--filter") == 0 && a + 1 < argc)
+            filter = argv[++a];
+        else if (strcmp(argv[a], "--save") == 0 && a + 1 < argc)
+            save = argv[++a];
+        else if (strcmp(argv[a], "--baseline") == 0 && a + 1 < argc)
+            baseline = argv[++a];
+        else if (strcmp(argv[a], "--threshold") == 0 && a + 1 < argc)
+            threshold = atof(argv[++a]);
+        else {
+            fprintf(stderr, "usage: %s [--min-time SEC] [--filter STR] [--save FILE] [--baseline FILE] [--threshold PCT]\n", argv[0]);
+            return 2;
+        }
+    }
+    for (i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); i++) {
+        bench_corpus c;
+        bench_buffer b = { NULL, 0, 0 };
+        bench_corpora[i].generate(&b);
+        c.name = bench_corpora[i].name;
+        c.json = b.s;
+        c.len = b.len;
+        lept_init(&c.v);
+        lept_init(&c.copy);
+        if (lept_parse(&c.v, c.json) != LEPT_PARSE_OK) {
+            fprintf(stderr, "%s: parse failed\n", c.name);
+            return 2;
+        }
+        lept_copy(&c.copy, &c.v);
+        c.out_size = lept_stringify_length(&c.v, 0) + 1;
+        c.out = (char*)malloc(c.out_size);
+        for (j = 0; j < sizeof(bench_ops) / sizeof(bench_ops[0]); j++) {
+            char name[BENCH_NAME_SIZE];
+            sprintf(name, "%s/%s", c.name, bench_ops[j].name);
+            if (!filter || strstr(name, filter))
+                bench_run(&c, &bench_ops[j], min_time);
+        }
+        lept_free(&c.v);
+        lept_free(&c.copy);
+        free(c.json);
+        free(c.out);
+    }
+    bench_print(stdout);
+    if (save) {
+        FILE* f = fopen(save, "w");
+        if (!f) {
+            fprintf(stderr, "cannot write %s\n", save);
+            return 2;
+        }
+        bench_print(f);
+        fclose(f);
+    }
+    return baseline ? bench_compare(baseline, threshold) : 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * leptjson_bench_cpp [--min-time SEC]
+ *
+ * Walks the same parsed document through the C accessors and through
+ * leptjson.hpp (lookups by key, element and member iteration, string
+ * lengths) and prints one tab-separated line per case, in the format of
+ * leptjson_bench, so the two can be compared directly.
+ */
+#include "leptjson.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace lept::literals;
+
+static volatile double bench_sink;
+
+static std::string bench_gen_users(int n) {
+    std::string s = "[";
+    char buffer[256];
+    for (int i = 0; i < n; i++) {
+        std::snprintf(buffer, sizeof(buffer),
+            "%s{\"id\":%d,\"name\":\"user %d\",\"active\":%s,\"score\":%d.25,\"tags\":[\"a\",\"bc\",\"def\"],\"address\":{\"city\":\"c%d\",\"zip\":\"%05d\"}}",
+            i ? "," : "", i, i, i % 3 ? "true" : "false", i % 1000, i % 50, i);
+        s += buffer;
+    }
+    return s + "]";
+}
+
+static double bench_walk_c(const lept_value* root) {
+    double sum = 0.0;
+    std::size_t i, j, n = lept_get_array_size(root);
+    for (i = 0; i < n; i++) {
+        const lept_value* u = lept_get_array_element(root, i);
+        const lept_value* tags = lept_find_object_value(u, "tags", 4);
+        sum += lept_get_number(lept_find_object_value(u, "id", 2));
+        sum += lept_get_number(lept_find_object_value(u, "score", 5));
+        sum += lept_get_string_length(lept_find_object_value(u, "name", 4));
+        sum += lept_get_type(lept_find_object_value(u, "active", 6)) == LEPT_TRUE;
+        for (j = 0; j < lept_get_array_size(tags); j++)
+            sum += lept_get_string_length(lept_get_array_element(tags, j));
+        sum += lept_get_string_length(lept_find_object_value(lept_find_object_value(u, "address", 7), "zip", 3));
+    }
+    return sum;
+}
+
+static double bench_walk_cpp(lept::view root) {
+    double sum = 0.0;
+    for (lept::view u : root.elements()) {
+        sum += u["id"_key].number();
+        sum += u["score"_key].number();
+        sum += u["name"_key].string().size();
+        sum += u["active"_key].boolean();
+        for (lept::view t : u["tags"_key].elements())
+            sum += t.string().size();
+        sum += u["address"_key]["zip"_key].string().size();
+    }
+    return sum;
+}
+
+static double bench_members_c(const lept_value* root) {
+    double sum = 0.0;
+    std::size_t i, j, n = lept_get_array_size(root);
+    for (i = 0; i < n; i++) {
+        const lept_value* u = lept_get_array_element(root, i);
+        for (j = 0; j < lept_get_object_size(u); j++)
+            sum += lept_get_object_key_length(u, j) + lept_get_type(lept_get_object_value(u, j));
+    }
+    return sum;
+}
+
+static double bench_members_cpp(lept::view root) {
+    double sum = 0.0;
+    for (lept::view u : root.elements())
+        for (lept::member m : u.members())
+            sum += m.key().size() + m.value().type();
+    return sum;
+}
+
+template <class F>
+static void bench_run(const char* name, std::size_t bytes, double min_time, F f) {
+    using clock = std::chrono::steady_clock;
+    double best = 0.0;
+    unsigned long iterations = 0;
+    f(); /* warm up */
+    /* the fastest of several rounds, as leptjson_bench reports */
+    for (int round = 0; round < 5; round++) {
+        unsigned long n = 0;
+        double elapsed;
+        clock::time_point start = clock::now();
+        do {
+            bench_sink = bench_sink + f();
+            n++;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while (elapsed < min_time / 5);
+        if (round == 0 || elapsed / n < best)
+            best = elapsed / n;
+        iterations += n;
+    }
+    std::printf("%s\t%lu\t%lu\t%.1f\t%.2f\t%.1f\n", name, (unsigned long)bytes, iterations, best * 1e9, bytes / best / 1e6, 0.0);
+}
+
+int main(int argc, char* argv[]) {
+    double min_time = 0.5;
+    for (int a = 1; a < argc; a++) {
+        if (std::strcmp(argv[a], "--min-time") == 0 && a + 1 < argc)
+            min_time = std::atof(argv[++a]);
+        else {
+            std::fprintf(stderr, "usage: %s [--min-time SEC]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::string json = bench_gen_users(20000);
+    lept::value v;
+    if (v.parse(json) != LEPT_PARSE_OK) {
+        std::fprintf(stderr, "users: parse failed\n");
+        return 2;
+    }
+    if (bench_walk_c(v.get()) != bench_walk_cpp(v) || bench_members_c(v.get()) != bench_members_cpp(v)) {
+        std::fprintf(stderr, "users: the C and C++ walks disagree\n");
+        return 2;
+    }
+    std::printf("# name\tbytes\titerations\tns_per_op\tmb_per_s\tallocs_per_op\n");
+    bench_run("users/walk_c", json.size(), min_time, [&] { return bench_walk_c(v.get()); });
+    bench_run("users/walk_cpp", json.size(), min_time, [&] { return bench_walk_cpp(v); });
+    bench_run("users/members_c", json.size(), min_time, [&] { return bench_members_c(v.get()); });
+    bench_run("users/members_cpp", json.size(), min_time, [&] { return bench_members_cpp(v); });
+    return 0;
+}
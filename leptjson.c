@@ -1,11 +1,39 @@
+#if defined(LEPT_HAVE_IO_URING) && defined(__linux__)
+#define LEPT_IO_URING
+#define _DEFAULT_SOURCE /* syscall(), MAP_POPULATE under -ansi */
+#endif
+#ifdef LEPT_HAVE_PTHREAD
+#define _POSIX_C_SOURCE 200112L /* pthreads under -ansi */
+#include <pthread.h>
+#endif
 #include "leptjson.h"
 #include <assert.h>
 #include <stdlib.h> /* NULL, strtod(), malloc(), realloc(), free() */
 #include <errno.h> /* errno, ERANGE */
 #include <math.h> /* HUGE_VAL */
+#include <limits.h> /* INT_MIN, INT_MAX */
 #include <string.h> /* memcpy() */
 #include <stdio.h>
 
+#if !defined(LEPT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define LEPT_SSE2
+#include <emmintrin.h> /* _mm_loadu_si128(), _mm_movemask_epi8() */
+#endif
+
+#if defined(LEPT_TRACE) && defined(LEPT_USDT)
+#include <sys/sdt.h> /* DTRACE_PROBE1() */
+#endif
+
+#ifdef LEPT_IO_URING
+#include <linux/io_uring.h> /* struct io_uring_params, io_uring_sqe, io_uring_cqe */
+#include <sys/syscall.h> /* __NR_io_uring_setup, __NR_io_uring_enter */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/uio.h> /* struct iovec */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* syscall(), close() */
+#endif
+
 
 #define EXPECT(c, ch) do { assert(*c->json == (ch) ); c->json++; } while(0) 
 #define ISDIGIT(ch) (ch >= '0' && ch <= '9')
@@ -22,23 +50,277 @@
 #define PUTC(c, ch) do { *(char*)lept_context_push(c, sizeof(char)) = (ch); } while(0)
 #define PUTS(c, s, len) memcpy(lept_context_push(c, len), s, len)
 
-#define STRING_ERROR(ret) do { c->top = head; return ret; } while(0)
+#define STRING_ERROR(ret) do { c->top = head; c->json = p - 1; return ret; } while(0)
+
+#ifndef LEPT_VALIDATE_MAX_DEPTH
+#define LEPT_VALIDATE_MAX_DEPTH 4096
+#endif
+
+#ifndef LEPT_INTERN_INIT_CAPACITY
+#define LEPT_INTERN_INIT_CAPACITY 64
+#endif
 
 typedef struct {
 	const char * json;
 	char * stack;
 	size_t size, top;
+	lept_intern * keys;
+	const lept_allocator * alloc;
+	unsigned flags; /* LEPT_STRINGIFY_* or LEPT_PARSE_* */
+	size_t depth;
+	lept_parse_error * error; /* path is built in error->path while unwinding */
+	size_t path_head;
+	int path_cut;
+	const char * const * keep; /* projection paths */
+	size_t nkeep;
+	char * scratch, * scratch_end; /* lept_stringify_to(): buffer past the text */
+#ifdef LEPT_TRACE
+	lept_trace * trace;        /* counters of a traced parse, or NULL */
+	unsigned long trace_start; /* clock at the start of the current phase */
+	size_t trace_depth;
+#endif
 } lept_context;
 
+static void (*lept_trace_hook)(void * ud, unsigned event, size_t arg);
+static void * lept_trace_hook_ud;
+
+void lept_set_trace_hook(void (*hook)(void * ud, unsigned event, size_t arg), void * ud) {
+	lept_trace_hook = hook;
+	lept_trace_hook_ud = ud;
+}
+
+/* Instrumentation points; all of them compile to nothing without LEPT_TRACE.
+ * Phases do not nest, so one start time per context is enough. */
+#ifdef LEPT_TRACE
+#ifdef LEPT_USDT
+#define LEPT_PROBE(name, arg) DTRACE_PROBE1(leptjson, name, arg)
+#else
+#define LEPT_PROBE(name, arg) ((void)0)
+#endif
+#define LEPT_TRACE_EVENT(event, name, arg) do { LEPT_PROBE(name, arg); if (lept_trace_hook) lept_trace_hook(lept_trace_hook_ud, event, (size_t)(arg)); } while(0)
+#define LEPT_TRACE_INIT(c, t) do { (c)->trace = (t); (c)->trace_depth = 0; } while(0)
+#define LEPT_PHASE_BEGIN(c) do { if ((c)->trace && (c)->trace->clock) (c)->trace_start = (c)->trace->clock((c)->trace->ud); } while(0)
+#define LEPT_PHASE_END(c, phase) do { if ((c)->trace && (c)->trace->clock) (c)->trace->ticks[phase] += (c)->trace->clock((c)->trace->ud) - (c)->trace_start; } while(0)
+#define LEPT_TRACE_ENTER(c) do { if ((c)->trace && ++(c)->trace_depth > (c)->trace->max_depth) (c)->trace->max_depth = (c)->trace_depth; } while(0)
+#define LEPT_TRACE_LEAVE(c) do { if ((c)->trace) (c)->trace_depth--; } while(0)
+#define LEPT_TRACE_STACK(c, top) do { if ((c)->trace && (top) > (c)->trace->stack_peak) (c)->trace->stack_peak = (top); } while(0)
+/* a string has just been popped off the stack */
+#define LEPT_TRACE_STRING(c, len) do { if ((c)->trace) { (c)->trace->unescaped += (len); LEPT_TRACE_STACK(c, (c)->top + (len)); } } while(0)
+#define LEPT_TRACE_VALUE(c, v, ret) do { if ((c)->trace && (ret) == LEPT_PARSE_OK) { (c)->trace->nodes[(v)->type]++; if ((v)->type == LEPT_STRING) LEPT_TRACE_STRING(c, (v)->u.s.len); } } while(0)
+#else
+#define LEPT_TRACE_EVENT(event, name, arg) ((void)0)
+#define LEPT_TRACE_INIT(c, t) ((void)0)
+#define LEPT_PHASE_BEGIN(c) ((void)0)
+#define LEPT_PHASE_END(c, phase) ((void)0)
+#define LEPT_TRACE_ENTER(c) ((void)0)
+#define LEPT_TRACE_LEAVE(c) ((void)0)
+#define LEPT_TRACE_STACK(c, top) ((void)0)
+#define LEPT_TRACE_STRING(c, len) ((void)0)
+#define LEPT_TRACE_VALUE(c, v, ret) ((void)0)
+#endif
+
+struct lept_intern_slot {
+	char * k;
+	size_t klen, hash;
+};
+
+static void * lept_std_malloc(void * ud, size_t size) {
+	(void)ud;
+	return malloc(size);
+}
+
+static void * lept_std_realloc(void * ud, void * p, size_t old_size, size_t size) {
+	(void)ud; (void)old_size;
+	return realloc(p, size);
+}
+
+static void lept_std_free(void * ud, void * p) {
+	(void)ud;
+	free(p);
+}
+
+static const lept_allocator lept_std_allocator = { lept_std_malloc, lept_std_realloc, lept_std_free, NULL, NULL };
+static lept_allocator lept_global_allocator = { lept_std_malloc, lept_std_realloc, lept_std_free, NULL, NULL };
+
+void lept_set_allocator(const lept_allocator * a) {
+	lept_global_allocator = a ? *a : lept_std_allocator;
+}
+
+const lept_allocator * lept_get_allocator(void) {
+	return &lept_global_allocator;
+}
+
+static void * lept_malloc(const lept_allocator * a, size_t size) {
+	lept_alloc_stats * s = a->stats;
+	if (s) {
+		s->allocs++;
+		s->bytes += size;
+		if ((s->live += size) > s->peak)
+			s->peak = s->live;
+	}
+	return a->malloc(a->ud, size);
+}
+
+static void * lept_realloc(const lept_allocator * a, void * p, size_t old_size, size_t size) {
+	lept_alloc_stats * s = a->stats;
+	if (s) {
+		s->reallocs++;
+		s->bytes += size;
+		if ((s->live += size - old_size) > s->peak)
+			s->peak = s->live;
+	}
+	return a->realloc(a->ud, p, old_size, size);
+}
+
+/* size is only used by the counters */
+static void lept_mfree(const lept_allocator * a, void * p, size_t size) {
+	if (!p)
+		return;
+	if (a->stats) {
+		a->stats->frees++;
+		a->stats->live -= size;
+	}
+	a->free(a->ud, p);
+}
+
+/* Cached lept_hash() results, in a side table keyed by the container's
+ * element block (u.a.e or u.o.m), so that lept_value stays two words and a
+ * tag and the blocks stay plain allocations. LEPT_FLAG_HASHED says that the
+ * table has an entry; only non-empty containers have a block to key it by.
+ * The table is bookkeeping shared by every allocator, so it uses malloc()
+ * directly; it keeps its size once grown, since trees are hashed and freed
+ * over and over. Linear probing, with entries shifted back on removal. */
+typedef struct {
+	const void * block;
+	size_t hash;
+} lept_hash_entry;
+
+static lept_hash_entry * lept_hash_table;
+static size_t lept_hash_mask, lept_hash_count; /* mask is capacity - 1 */
+#ifdef LEPT_HAVE_PTHREAD
+static pthread_mutex_t lept_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LEPT_HASH_LOCK() pthread_mutex_lock(&lept_hash_lock)
+#define LEPT_HASH_UNLOCK() pthread_mutex_unlock(&lept_hash_lock)
+#else
+#define LEPT_HASH_LOCK() ((void)0)
+#define LEPT_HASH_UNLOCK() ((void)0)
+#endif
+
+static const void * lept_hash_block(const lept_value * v) {
+	return v->type == LEPT_ARRAY ? (const void *)v->u.a.e : (const void *)v->u.o.m;
+}
+
+/* Blocks are malloc()ed, so aligned, and those of one tree mostly come one
+ * after another: neighbours in memory stay neighbours in the table. */
+static size_t lept_hash_home(const void * block) {
+	return ((size_t)block >> 4) & lept_hash_mask;
+}
+
+/* lept_hash_lock held; the entry's index, or one past the mask when absent */
+static size_t lept_hash_find(const void * block) {
+	size_t i;
+	if (!lept_hash_table)
+		return lept_hash_mask + 1;
+	for (i = lept_hash_home(block); lept_hash_table[i].block; i = (i + 1) & lept_hash_mask)
+		if (lept_hash_table[i].block == block)
+			return i;
+	return lept_hash_mask + 1;
+}
+
+/* lept_hash_lock held; 0 when the table could not grow */
+static int lept_hash_insert(const void * block, size_t hash) {
+	lept_hash_entry * old = lept_hash_table;
+	size_t i, n = lept_hash_table ? lept_hash_mask + 1 : 0;
+	if ((lept_hash_count + 1) * 4 > n * 3) {
+		size_t grown = n ? n * 2 : 64;
+		if (!(lept_hash_table = (lept_hash_entry *)calloc(grown, sizeof(lept_hash_entry)))) {
+			lept_hash_table = old;
+			return 0;
+		}
+		lept_hash_mask = grown - 1;
+		lept_hash_count = 0;
+		for (i = 0; i < n; i++)
+			if (old[i].block)
+				lept_hash_insert(old[i].block, old[i].hash);
+		free(old);
+	}
+	for (i = lept_hash_home(block); lept_hash_table[i].block && lept_hash_table[i].block != block; i = (i + 1) & lept_hash_mask)
+		;
+	if (!lept_hash_table[i].block)
+		lept_hash_count++;
+	lept_hash_table[i].block = block;
+	lept_hash_table[i].hash = hash;
+	return 1;
+}
+
+/* lept_hash_lock held */
+static void lept_hash_remove(const void * block) {
+	size_t i = lept_hash_find(block), j, home;
+	if (i > lept_hash_mask)
+		return;
+	lept_hash_count--;
+	/* pull later entries of the probe run back over the hole */
+	for (j = (i + 1) & lept_hash_mask; lept_hash_table[j].block; j = (j + 1) & lept_hash_mask) {
+		home = lept_hash_home(lept_hash_table[j].block);
+		if (((j - home) & lept_hash_mask) >= ((j - i) & lept_hash_mask)) {
+			lept_hash_table[i] = lept_hash_table[j];
+			i = j;
+		}
+	}
+	lept_hash_table[i].block = NULL;
+}
+
+/* Only for an array or object with LEPT_FLAG_HASHED */
+static size_t lept_cached_hash(const lept_value * v) {
+	size_t i, h;
+	LEPT_HASH_LOCK();
+	i = lept_hash_find(lept_hash_block(v));
+	assert(i <= lept_hash_mask);
+	h = lept_hash_table[i].hash;
+	LEPT_HASH_UNLOCK();
+	return h;
+}
+
+/* Sets LEPT_FLAG_HASHED when the hash could be stored. */
+static void lept_cache_hash(lept_value * v, size_t h) {
+	int stored;
+	if (!(v->type == LEPT_ARRAY ? v->u.a.size : v->u.o.size))
+		return; /* no block to key it by, and nothing to save */
+	LEPT_HASH_LOCK();
+	stored = lept_hash_insert(lept_hash_block(v), h);
+	LEPT_HASH_UNLOCK();
+	if (stored)
+		v->flags |= LEPT_FLAG_HASHED;
+}
+
+/* Drops the cached hash of v, if it has one. */
+static void lept_uncache_hash(lept_value * v) {
+	if (!(v->flags & LEPT_FLAG_HASHED))
+		return;
+	LEPT_HASH_LOCK();
+	lept_hash_remove(lept_hash_block(v));
+	LEPT_HASH_UNLOCK();
+	v->flags &= ~LEPT_FLAG_HASHED;
+}
+
+/* the buffer now belongs to the caller */
+static void lept_alloc_handoff(const lept_allocator * a, size_t size) {
+	if (a->stats)
+		a->stats->live -= size;
+}
+
 static void* lept_context_push(lept_context * c, int size) {
 	void * ret;
 	assert(size>0);
 	if (size + c->top >= c->size) {
+		size_t old_size = c->size;
 		if (c->size == 0) 
 			c->size = LEPT_PARSE_STACK_INIT_SIZE;
 		while(size + c->top >= c->size)
 			c->size += c->size >> 1;
-		c->stack = (char*)realloc(c->stack, c->size);
+		c->stack = (char*)lept_realloc(c->alloc, c->stack, old_size, c->size);
+		if (c->alloc->stats && old_size)
+			c->alloc->stats->stack_grows++;
 	}
 	ret = c->stack + c->top; /*注意这里为什么ret写在前面，c->top写在后面。*/
 	c->top += size;
@@ -52,17 +334,21 @@ static void* lept_context_pop(lept_context * c, size_t size) {
 
 static void lept_parse_whitespace(lept_context * c){
 	const char * p = c->json;
+	LEPT_PHASE_BEGIN(c);
 	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
 		p++;
 	c->json = p;
+	LEPT_PHASE_END(c, LEPT_PHASE_WHITESPACE);
 }
 
 static int lept_parse_literal(lept_value * v, lept_context * c, const char * literal, lept_type type) {
 	size_t i;
 	EXPECT(c, literal[0]);
 	for(i=0; literal[i+1]; i++) {
-		if (c->json[i] != literal[i+1])
+		if (c->json[i] != literal[i+1]) {
+			c->json += i;
 			return LEPT_PARSE_INVALID_VALUE;
+		}
 	}
 	c->json += i;
 	v->type = type;
@@ -133,9 +419,57 @@ static void lept_encode_utf8(lept_context * c, unsigned u) {
     }	
 }
 
+/* Word-at-a-time helpers: b repeated in every byte of a size_t, and a test
+ * that is non-zero when some byte of w is below n (n <= 0x80) */
+#define LEPT_BYTES(b) ((size_t)-1 / 0xFF * (b))
+#define LEPT_HIGH_BITS LEPT_BYTES(0x80)
+#define LEPT_HAS_LESS(w, n) (((w) - LEPT_BYTES(n)) & ~(w) & LEPT_HIGH_BITS)
+
+/* Returns the first byte of [s, end) that does not start a well-formed UTF-8
+ * sequence, or NULL. Runs of ASCII are skipped 16 (SSE2) or sizeof(size_t)
+ * bytes at a time, so only non-ASCII text pays for decoding. */
+static const char * lept_utf8_invalid(const char * s, const char * end) {
+	const unsigned char * p = (const unsigned char *)s, * e = (const unsigned char *)end;
+	unsigned char lo, hi;
+	size_t n, i, w;
+	while (p < e) {
+#ifdef LEPT_SSE2
+		while (e - p >= 16 && _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0)
+			p += 16;
+#endif
+		while ((size_t)(e - p) >= sizeof(size_t)) {
+			memcpy(&w, p, sizeof(size_t));
+			if (w & LEPT_HIGH_BITS)
+				break;
+			p += sizeof(size_t);
+		}
+		for (; p < e && *p < 0x80; p++);
+		if (p == e)
+			break;
+		/* lead byte: continuation count and the range allowed for the second byte */
+		lo = 0x80; hi = 0xBF;
+		if (*p >= 0xC2 && *p <= 0xDF) n = 1;
+		else if (*p == 0xE0) { n = 2; lo = 0xA0; }
+		else if (*p == 0xED) { n = 2; hi = 0x9F; }
+		else if (*p >= 0xE1 && *p <= 0xEF) n = 2;
+		else if (*p == 0xF0) { n = 3; lo = 0x90; }
+		else if (*p >= 0xF1 && *p <= 0xF3) n = 3;
+		else if (*p == 0xF4) { n = 3; hi = 0x8F; }
+		else
+			return (const char *)p;
+		if ((size_t)(e - p) <= n || p[1] < lo || p[1] > hi)
+			return (const char *)p;
+		for (i = 2; i <= n; i++)
+			if ((p[i] & 0xC0) != 0x80)
+				return (const char *)p;
+		p += n + 1;
+	}
+	return NULL;
+}
+
 static int lept_parse_string_raw(lept_context * c, char ** str, size_t * len) {
 	size_t head = c->top;
-	const char * p;
+	const char * p, * q;
 	unsigned u, u2;
 	EXPECT(c, '\"');
 	p = c->json;
@@ -143,6 +477,10 @@ static int lept_parse_string_raw(lept_context * c, char ** str, size_t * len) {
 		char ch = *p++;
 		switch(ch){
 			case '\"':
+				if ((c->flags & LEPT_PARSE_STRICT_UTF8) && (q = lept_utf8_invalid(c->json, p - 1)) != NULL) {
+					p = q + 1;
+					STRING_ERROR(LEPT_PARSE_INVALID_UTF8);
+				}
 				*len = c->top - head;
 				c->json = p;
 				*str = (char *)lept_context_pop(c, *len);
@@ -160,21 +498,25 @@ static int lept_parse_string_raw(lept_context * c, char ** str, size_t * len) {
 					case 'r': PUTC(c, '\r'); break;
 					case 't': PUTC(c, '\t'); break;
 					case 'u':
-						if (!(p=lept_parse_hex4(p, &u))) {
+						if (!(q = lept_parse_hex4(p++, &u))) {
 							STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_HEX);
 						}
+						p = q;
 						if (u >= 0xD800 && u<=0xDBFF) {
 							if (*p++ != '\\')
                                 STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_SURROGATE);
                             if (*p++ != 'u') {
                                 STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_SURROGATE);
 							}
-                            if (!(p = lept_parse_hex4(p, &u2)))
+                            if (!(q = lept_parse_hex4(p++, &u2)))
                                 STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_HEX);
+                            p = q;
                             if (u2 < 0xDC00 || u2 > 0xDFFF)
                                 STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_SURROGATE);
 							u = (((u-0xD800) << 10) | (u2 - 0xDC00)) + 0x10000;
 						}
+						else if (u >= 0xDC00 && u <= 0xDFFF && (c->flags & LEPT_PARSE_STRICT_UTF8))
+							STRING_ERROR(LEPT_PARSE_INVALID_UNICODE_SURROGATE); /* low half with no high one */
 						lept_encode_utf8(c, u);
 						break;
 					default:
@@ -190,18 +532,112 @@ static int lept_parse_string_raw(lept_context * c, char ** str, size_t * len) {
 	}
 }
 
+
 static int lept_parse_string (lept_value * v, lept_context * c) {
 	int ret;
 	char * str;
 	size_t len;
 	if ((ret = lept_parse_string_raw(c, &str, &len)) != LEPT_PARSE_OK)
 		return ret;
-	lept_set_string(v, str, len);
+	lept_set_string_with(v, str, len, c->alloc);
 	return LEPT_PARSE_OK;
 }
 
 static int lept_parse_value(lept_value * v, lept_context * c);
 
+/* Error paths are assembled back to front: each container that sees a child
+ * fail puts its own step in front of what is already there. */
+static char * lept_error_path_reserve(lept_context * c, size_t len) {
+	/* keep 3 bytes in front for the "$" or "..." prefix */
+	if (c->path_cut || len + 3 > c->path_head) {
+		c->path_cut = 1;
+		return NULL;
+	}
+	return c->error->path + (c->path_head -= len);
+}
+
+static void lept_error_path_index(lept_context * c, size_t index) {
+	char buffer[32], * p;
+	int len = sprintf(buffer, "[%lu]", (unsigned long)index);
+	if ((p = lept_error_path_reserve(c, (size_t)len)) != NULL)
+		memcpy(p, buffer, (size_t)len);
+}
+
+static void lept_error_path_key(lept_context * c, const char * k, size_t klen) {
+	size_t i;
+	int plain = klen > 0 && !ISDIGIT(k[0]);
+	char * p;
+	for (i = 0; plain && i < klen; i++)
+		plain = ISDIGIT(k[i]) || (k[i] >= 'a' && k[i] <= 'z') || (k[i] >= 'A' && k[i] <= 'Z') || k[i] == '_';
+	if (plain) {
+		if ((p = lept_error_path_reserve(c, klen + 1)) != NULL) {
+			*p = '.';
+			memcpy(p + 1, k, klen);
+		}
+	}
+	else if ((p = lept_error_path_reserve(c, klen + 4)) != NULL) {
+		memcpy(p, "[\"", 2);
+		memcpy(p + 2, k, klen);
+		memcpy(p + 2 + klen, "\"]", 2);
+	}
+}
+
+/* Fills in everything but code once the parse has failed at offset. */
+static void lept_error_locate(lept_context * c, const char * json, size_t offset) {
+	lept_parse_error * e = c->error;
+	const char * line = json, * p, * begin, * end;
+	const char * prefix = c->path_cut ? "..." : "$";
+	size_t plen = strlen(prefix), i;
+
+	e->path[LEPT_ERROR_PATH_SIZE - 1] = '\0';
+	memmove(e->path + plen, e->path + c->path_head, LEPT_ERROR_PATH_SIZE - c->path_head);
+	memcpy(e->path, prefix, plen);
+
+	e->offset = offset;
+	e->line = 1;
+	for (p = json; p < json + offset; p++)
+		if (*p == '\n') {
+			e->line++;
+			line = p + 1;
+		}
+	e->column = (size_t)(json + offset - line) + 1;
+
+	/* excerpt: up to half the buffer before offset, the rest after, on one line */
+	begin = json + offset - line > (LEPT_ERROR_EXCERPT_SIZE - 1) / 2 ? json + offset - (LEPT_ERROR_EXCERPT_SIZE - 1) / 2 : line;
+	for (end = json + offset; end < begin + LEPT_ERROR_EXCERPT_SIZE - 1 && *end != '\0' && *end != '\n'; end++);
+	for (i = 0; begin + i < end; i++)
+		e->excerpt[i] = (unsigned char)begin[i] < 0x20 ? ' ' : begin[i];
+	e->excerpt[i] = '\0';
+	e->excerpt_offset = (size_t)(json + offset - begin);
+}
+
+/* Moves the size elements on top of the stack into v. With
+ * LEPT_PARSE_PACK_NUMBERS an array of numbers only keeps their values. */
+static void lept_parse_array_close(lept_value * v, lept_context * c, size_t size) {
+	lept_value * e;
+	double * n;
+	size_t i;
+	LEPT_PHASE_BEGIN(c);
+	LEPT_TRACE_STACK(c, c->top);
+	e = (lept_value *)lept_context_pop(c, size * sizeof(lept_value));
+	v->type = LEPT_ARRAY;
+	v->u.a.size = size;
+	if (c->flags & LEPT_PARSE_PACK_NUMBERS) {
+		for (i = 0; i < size && e[i].type == LEPT_NUMBER; i++);
+		if (i == size) {
+			n = (double *)lept_malloc(c->alloc, size * sizeof(double));
+			for (i = 0; i < size; i++)
+				n[i] = e[i].u.n;
+			v->u.a.e = (lept_value *)n;
+			v->flags |= LEPT_FLAG_PACKED;
+			LEPT_PHASE_END(c, LEPT_PHASE_CONTAINER);
+			return;
+		}
+	}
+	memcpy(v->u.a.e = (lept_value *)lept_malloc(c->alloc, size * sizeof(lept_value)), e, size * sizeof(lept_value));
+	LEPT_PHASE_END(c, LEPT_PHASE_CONTAINER);
+}
+
 static int lept_parse_array(lept_value * v, lept_context * c) {
 	int ret;
 	size_t size = 0, i = 0;
@@ -218,8 +654,11 @@ static int lept_parse_array(lept_value * v, lept_context * c) {
 		lept_value e;
 		lept_init(&e);
 		lept_parse_whitespace(c);
-		if ((ret = lept_parse_value(&e, c)) != LEPT_PARSE_OK)
+		if ((ret = lept_parse_value(&e, c)) != LEPT_PARSE_OK) {
+			if (c->error)
+				lept_error_path_index(c, size);
 			break;
+		}
 		memcpy(lept_context_push(c, sizeof(lept_value)), &e, sizeof(lept_value));
 		size++;
 		lept_parse_whitespace(c);
@@ -227,10 +666,7 @@ static int lept_parse_array(lept_value * v, lept_context * c) {
 			c->json++;
 		} else if (*c->json == ']') {
 			c->json++;
-			v->type = LEPT_ARRAY;
-			v->u.a.size = size;
-			size *= sizeof(lept_value);
-			memcpy(v->u.a.e = (lept_value *)malloc(size), lept_context_pop(c, size), size);
+			lept_parse_array_close(v, c, size);
 			return LEPT_PARSE_OK;
 		} else {
 			ret = LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
@@ -238,7 +674,7 @@ static int lept_parse_array(lept_value * v, lept_context * c) {
 		}
 	}
 	for (i=0; i < size; i++) {
-		lept_free((lept_value *)lept_context_pop(c, sizeof(lept_value)));
+		lept_free_with((lept_value *)lept_context_pop(c, sizeof(lept_value)), c->alloc);
 	}
 	return ret;
 }
@@ -254,6 +690,7 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
     if (*c->json == '}') {
         c->json++;
         v->type = LEPT_OBJECT;
+        v->flags = 0;
         v->u.o.m = NULL;
         v->u.o.size = 0;
         return LEPT_PARSE_OK;
@@ -266,10 +703,19 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
             ret = LEPT_PARSE_MISS_KEY;
             break;
         }
+        LEPT_PHASE_BEGIN(c);
         if ((ret = lept_parse_string_raw(c, &str, &m.klen)) != LEPT_PARSE_OK)
             break;
-        memcpy(m.k = (char*)malloc(m.klen + 1), str, m.klen);
-        m.k[m.klen] = '\0';
+        LEPT_TRACE_STRING(c, m.klen);
+        if (c->keys)
+            m.k = (char*)lept_intern_key(c->keys, str, m.klen);
+        else {
+            m.k = (char*)lept_malloc(c->alloc, m.klen + 1);
+            if (m.klen) /* str is NULL for a leading "" key */
+                memcpy(m.k, str, m.klen);
+            m.k[m.klen] = '\0';
+        }
+        LEPT_PHASE_END(c, LEPT_PHASE_STRING);
         /* parse ws colon ws */
         lept_parse_whitespace(c);
         if (*c->json != ':') {
@@ -279,8 +725,11 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
         c->json++;
         lept_parse_whitespace(c);
         /* parse value */
-        if ((ret = lept_parse_value(&m.v, c)) != LEPT_PARSE_OK)
+        if ((ret = lept_parse_value(&m.v, c)) != LEPT_PARSE_OK) {
+            if (c->error)
+                lept_error_path_key(c, m.k, m.klen);
             break;
+        }
         memcpy(lept_context_push(c, sizeof(lept_member)), &m, sizeof(lept_member));
         size++;
         m.k = NULL; /* ownership is transferred to member on stack */
@@ -294,8 +743,12 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
             v->u.o.size = size;
             c->json++;
             v->type = LEPT_OBJECT;
+            v->flags = c->keys ? LEPT_FLAG_SHARED_KEYS : 0;
             size *= sizeof(lept_member);
-            memcpy(v->u.o.m = (lept_member*)malloc(size), lept_context_pop(c, size), size);
+            LEPT_PHASE_BEGIN(c);
+            LEPT_TRACE_STACK(c, c->top);
+            memcpy(v->u.o.m = (lept_member*)lept_malloc(c->alloc, size), lept_context_pop(c, size), size);
+            LEPT_PHASE_END(c, LEPT_PHASE_CONTAINER);
             return LEPT_PARSE_OK;
         }
         else {
@@ -304,11 +757,13 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
         }
     }
     /* Pop and free members on the stack */
-    free(m.k);
+    if (!c->keys && m.k)
+        lept_mfree(c->alloc, m.k, m.klen + 1);
     for (i = 0; i < size; i++) {
         lept_member* m = (lept_member*)lept_context_pop(c, sizeof(lept_member));
-        free(m->k);
-        lept_free(&m->v);
+        if (!c->keys)
+            lept_mfree(c->alloc, m->k, m->klen + 1);
+        lept_free_with(&m->v, c->alloc);
     }
     v->type = LEPT_NULL;
     return ret;
@@ -316,228 +771,2726 @@ static int lept_parse_object(lept_value * v, lept_context * c) {
 
 
 static int lept_parse_value(lept_value * v, lept_context * c) {
+	int ret;
 	switch (*c->json) {
 		case 'n':
-			return lept_parse_literal(v, c, "null", LEPT_NULL);
+			ret = lept_parse_literal(v, c, "null", LEPT_NULL);
+			break;
 		case 't':
-			return lept_parse_literal(v, c, "true", LEPT_TRUE);
+			ret = lept_parse_literal(v, c, "true", LEPT_TRUE);
+			break;
 		case 'f':
-			return lept_parse_literal(v, c, "false", LEPT_FALSE);
+			ret = lept_parse_literal(v, c, "false", LEPT_FALSE);
+			break;
 		case '\"':
-			return lept_parse_string(v, c);
+			LEPT_PHASE_BEGIN(c);
+			ret = lept_parse_string(v, c);
+			LEPT_PHASE_END(c, LEPT_PHASE_STRING);
+			break;
 		case '[':
-			return lept_parse_array(v, c);
+			LEPT_TRACE_ENTER(c);
+			ret = lept_parse_array(v, c);
+			LEPT_TRACE_LEAVE(c);
+			break;
 		case '{':
-			return lept_parse_object(v, c);
+			LEPT_TRACE_ENTER(c);
+			ret = lept_parse_object(v, c);
+			LEPT_TRACE_LEAVE(c);
+			break;
 		default:
-			return lept_parse_number(v, c);	
+			LEPT_PHASE_BEGIN(c);
+			ret = lept_parse_number(v, c);
+			LEPT_PHASE_END(c, LEPT_PHASE_NUMBER);
+			break;
 		case '\0':
 			return LEPT_PARSE_ALL_BLANK;
 	}
+	LEPT_TRACE_VALUE(c, v, ret);
+	return ret;
 }
 
-int lept_parse(lept_value * v, const char * json) {
-	lept_context c;
-	int ret;
-	assert(v != NULL);
-	c.json = json;
-	c.top = c.size = 0;
-	c.stack = NULL;
-	lept_init(v);
-	lept_parse_whitespace(&c);
-	if ((ret = lept_parse_value(v, &c)) == LEPT_PARSE_OK) {
-		lept_parse_whitespace(&c);
-		if (*c.json != '\0') {
-			v->type = LEPT_NULL;
-			ret = LEPT_PARSE_NOT_SINGLE;
+/* Steps over one value without decoding it. Strings are followed to their
+ * closing quote, escapes skipped rather than checked, and containers to
+ * their matching bracket; scalars run up to the next delimiter. */
+static int lept_scan_value(lept_context * c) {
+	unsigned char objects[LEPT_VALIDATE_MAX_DEPTH / 8];
+	const char * p = c->json;
+	size_t depth = 0;
+	unsigned char ch;
+	if (*p != '"' && *p != '[' && *p != '{') {
+		while (*p && *p != ',' && *p != ']' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+			p++;
+		if (p == c->json)
+			return *p ? LEPT_PARSE_INVALID_VALUE : LEPT_PARSE_ALL_BLANK;
+		c->json = p;
+		return LEPT_PARSE_OK;
+	}
+	do {
+		switch (ch = (unsigned char)*p++) {
+			case '"':
+				for (;;) {
+					ch = (unsigned char)*p++;
+					if (ch == '"')
+						break;
+					if (ch == '\\' && *p)
+						p++;
+					else if (ch < 0x20) {
+						c->json = p - 1;
+						return ch ? LEPT_PARSE_INVALID_STRING_CHAR : LEPT_PARSE_MISS_QUOTATION_MARK;
+					}
+				}
+				break;
+			case '[':
+			case '{':
+				if (depth == LEPT_VALIDATE_MAX_DEPTH) {
+					c->json = p - 1;
+					return LEPT_PARSE_TOO_DEEP;
+				}
+				if (ch == '{')
+					objects[depth / 8] |= (unsigned char)(1u << (depth % 8));
+				else
+					objects[depth / 8] &= (unsigned char)~(1u << (depth % 8));
+				depth++;
+				break;
+			case ']':
+			case '}':
+			case '\0':
+				if (ch == '\0' || ((objects[(depth - 1) / 8] >> ((depth - 1) % 8)) & 1) != (ch == '}')) {
+					c->json = p - 1;
+					return (objects[(depth - 1) / 8] >> ((depth - 1) % 8)) & 1 ? LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET : LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+				}
+				depth--;
+				break;
+			default:
+				break;
+		}
+	} while (depth > 0);
+	c->json = p;
+	return LEPT_PARSE_OK;
+}
+
+/* Matches reference token number depth of a keep path against a key: 0 for
+ * no match, 1 when the path goes on below it, 2 when it ends there. */
+static int lept_keep_match(const char * path, size_t depth, const char * key, size_t klen) {
+	const char * p = path;
+	size_t i;
+	char ch;
+	for (; depth > 0; depth--) {
+		if (*p++ != '/')
+			return 0;
+		while (*p && *p != '/')
+			p++;
+	}
+	if (*p++ != '/')
+		return 0;
+	if (p[0] == '*' && (p[1] == '\0' || p[1] == '/'))
+		p++;
+	else {
+		for (i = 0; *p && *p != '/'; i++) {
+			if ((ch = *p++) == '~') {
+				if (*p != '0' && *p != '1')
+					return 0;
+				ch = *p++ == '0' ? '~' : '/';
+			}
+			if (i >= klen || key[i] != ch)
+				return 0;
 		}
+		if (i != klen)
+			return 0;
 	}
-	assert(c.top == 0);
-	free(c.stack);
-	return ret;
+	return *p == '/' ? 1 : 2;
 }
 
-lept_type lept_get_type(const lept_value * v) {
-	assert(v != NULL);
-	return v->type;
+/* Narrows the active keep paths to those matching key at depth: *next gets
+ * the ones going deeper; returns non-zero when one ends here. */
+static int lept_keep_step(lept_context * c, unsigned long active, size_t depth, const char * key, size_t klen, unsigned long * next) {
+	size_t i;
+	int whole = 0, m;
+	*next = 0;
+	for (i = 0; i < c->nkeep; i++) {
+		if (active & (1ul << i)) {
+			if ((m = lept_keep_match(c->keep[i], depth, key, klen)) == 2)
+				whole = 1;
+			else if (m == 1)
+				*next |= 1ul << i;
+		}
+	}
+	return whole;
 }
 
-double lept_get_number(const lept_value * v) {
-	assert( v!=NULL && v->type == LEPT_NUMBER);
-	return v->u.n;
+static int lept_project_value(lept_value * v, lept_context * c, unsigned long active, size_t depth);
+
+/* Decodes the member or element at the current position when the keep
+ * paths want it, and skips it otherwise; *kept tells which happened. */
+static int lept_project_child(lept_value * v, lept_context * c, unsigned long active, size_t depth, const char * key, size_t klen, int * kept) {
+	unsigned long next;
+	*kept = 1;
+	if (lept_keep_step(c, active, depth, key, klen, &next))
+		return lept_parse_value(v, c);
+	if (next && (*c->json == '[' || *c->json == '{'))
+		return lept_project_value(v, c, next, depth + 1);
+	*kept = 0;
+	return lept_scan_value(c);
 }
 
-void lept_free(lept_value * v) {
-	assert(v!=NULL);
-	size_t i = 0;
-	if (v->type == LEPT_STRING) {
-		free(v->u.s.s);
+static int lept_project_array(lept_value * v, lept_context * c, unsigned long active, size_t depth) {
+	size_t i, index = 0, size = 0;
+	char key[32];
+	int ret, kept;
+	EXPECT(c, '[');
+	lept_parse_whitespace(c);
+	if (*c->json == ']') {
+		c->json++;
+		v->type = LEPT_ARRAY;
+		v->u.a.size = 0;
+		v->u.a.e = NULL;
+		return LEPT_PARSE_OK;
+	}
+	for (;;) {
+		lept_value e;
+		lept_init(&e);
+		lept_parse_whitespace(c);
+		if ((ret = lept_project_child(&e, c, active, depth, key, (size_t)sprintf(key, "%lu", (unsigned long)index), &kept)) != LEPT_PARSE_OK) {
+			if (c->error)
+				lept_error_path_index(c, index);
+			break;
+		}
+		if (kept) {
+			memcpy(lept_context_push(c, sizeof(lept_value)), &e, sizeof(lept_value));
+			size++;
+		}
+		index++;
+		lept_parse_whitespace(c);
+		if (*c->json == ',')
+			c->json++;
+		else if (*c->json == ']') {
+			c->json++;
+			v->type = LEPT_ARRAY;
+			v->u.a.size = 0;
+			v->u.a.e = NULL;
+			if (size)
+				lept_parse_array_close(v, c, size);
+			return LEPT_PARSE_OK;
+		}
+		else {
+			ret = LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+			break;
+		}
+	}
+	for (i = 0; i < size; i++)
+		lept_free_with((lept_value *)lept_context_pop(c, sizeof(lept_value)), c->alloc);
+	return ret;
+}
+
+static int lept_project_object(lept_value * v, lept_context * c, unsigned long active, size_t depth) {
+	size_t i, size = 0;
+	lept_member m;
+	char * str;
+	int ret, kept;
+	m.k = NULL;
+	m.klen = 0;
+	EXPECT(c, '{');
+	lept_parse_whitespace(c);
+	if (*c->json == '}') {
+		c->json++;
+		v->type = LEPT_OBJECT;
+		v->flags = 0;
+		v->u.o.m = NULL;
+		v->u.o.size = 0;
+		return LEPT_PARSE_OK;
 	}
-	if (v->type == LEPT_ARRAY) {
-		for (i=0; i < v->u.a.size; i++){
-			lept_free(v->u.a.e + i);
+	for (;;) {
+		lept_init(&m.v);
+		if (*c->json != '\"') {
+			ret = LEPT_PARSE_MISS_KEY;
+			break;
+		}
+		if ((ret = lept_parse_string_raw(c, &str, &m.klen)) != LEPT_PARSE_OK)
+			break;
+		/* the key is copied before anything else is pushed over it */
+		if (c->keys)
+			m.k = (char *)lept_intern_key(c->keys, str, m.klen);
+		else {
+			m.k = (char *)lept_malloc(c->alloc, m.klen + 1);
+			if (m.klen) /* str is NULL for a leading "" key */
+				memcpy(m.k, str, m.klen);
+			m.k[m.klen] = '\0';
+		}
+		lept_parse_whitespace(c);
+		if (*c->json != ':') {
+			ret = LEPT_PARSE_MISS_COLON;
+			break;
+		}
+		c->json++;
+		lept_parse_whitespace(c);
+		if ((ret = lept_project_child(&m.v, c, active, depth, m.k, m.klen, &kept)) != LEPT_PARSE_OK) {
+			if (c->error)
+				lept_error_path_key(c, m.k, m.klen);
+			break;
+		}
+		if (kept) {
+			memcpy(lept_context_push(c, sizeof(lept_member)), &m, sizeof(lept_member));
+			size++;
+		}
+		else if (!c->keys)
+			lept_mfree(c->alloc, m.k, m.klen + 1);
+		m.k = NULL;
+		lept_parse_whitespace(c);
+		if (*c->json == ',') {
+			c->json++;
+			lept_parse_whitespace(c);
+		}
+		else if (*c->json == '}') {
+			c->json++;
+			v->type = LEPT_OBJECT;
+			v->flags = c->keys ? LEPT_FLAG_SHARED_KEYS : 0;
+			v->u.o.size = size;
+			v->u.o.m = NULL;
+			if (size) {
+				size *= sizeof(lept_member);
+				memcpy(v->u.o.m = (lept_member *)lept_malloc(c->alloc, size), lept_context_pop(c, size), size);
+			}
+			return LEPT_PARSE_OK;
+		}
+		else {
+			ret = LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+			break;
 		}
-		free(v->u.a.e);
+	}
+	if (!c->keys && m.k)
+		lept_mfree(c->alloc, m.k, m.klen + 1);
+	for (i = 0; i < size; i++) {
+		lept_member * p = (lept_member *)lept_context_pop(c, sizeof(lept_member));
+		if (!c->keys)
+			lept_mfree(c->alloc, p->k, p->klen + 1);
+		lept_free_with(&p->v, c->alloc);
 	}
 	v->type = LEPT_NULL;
+	return ret;
 }
 
-void lept_set_string(lept_value * v, const char * s, size_t len) {
-	assert(v!=NULL && (s!=NULL || len == 0));
-	lept_free(v);
-	v->u.s.s  = (char*)malloc(len+1);
-	memcpy(v->u.s.s, s, len);
-	v->u.s.s[len] = '\0';
-	v->u.s.len = len;
-	v->type = LEPT_STRING;
+static int lept_project_value(lept_value * v, lept_context * c, unsigned long active, size_t depth) {
+	if (*c->json == '[')
+		return lept_project_array(v, c, active, depth);
+	return lept_project_object(v, c, active, depth);
 }
 
-const char* lept_get_string(const lept_value * v) {
-	assert(v!=NULL && v->type == LEPT_STRING);
-	return v->u.s.s;
+/* Non-zero when the document has to be projected, i.e. no keep path is "" */
+static int lept_keep_root(const lept_context * c) {
+	size_t i;
+	for (i = 0; i < c->nkeep; i++)
+		if (c->keep[i][0] == '\0')
+			return 0;
+	return 1;
 }
 
-size_t lept_get_string_length(const lept_value * v) {
-	assert(v!=NULL && v->type == LEPT_STRING);
-	return v->u.s.len;
+/* Parallel parse of a large top-level array, in two stages. Stage one
+ * splits the text into chunks and scans them on separate threads: a first
+ * pass counts each chunk's unescaped quotes and its bracket balance for
+ * either string state at its start, a serial prefix pass turns those into
+ * the real state and depth at every chunk start, and a second pass collects
+ * the positions of the commas separating top-level elements. Stage two
+ * hands runs of elements to threads, which build them with the usual
+ * recursive parser straight into the final array. */
+
+#ifndef LEPT_PARALLEL_MIN_CHUNK
+#define LEPT_PARALLEL_MIN_CHUNK (64 * 1024)
+#endif
+
+#ifndef LEPT_PARALLEL_MAX_THREADS
+#define LEPT_PARALLEL_MAX_THREADS 64
+#endif
+
+/* Calls job(arg + i * stride) for each i < n, on n - 1 new threads and the
+ * calling one. A thread that cannot be started has its job run here. */
+static void lept_run_jobs(void * (*job)(void *), char * arg, size_t stride, unsigned n) {
+	unsigned i;
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_t threads[LEPT_PARALLEL_MAX_THREADS];
+	int started[LEPT_PARALLEL_MAX_THREADS];
+	for (i = 1; i < n; i++)
+		started[i] = pthread_create(&threads[i], NULL, job, arg + i * stride) == 0;
+	job(arg);
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			job(arg + i * stride);
+	}
+#else
+	for (i = 0; i < n; i++)
+		job(arg + i * stride);
+#endif
 }
 
-void lept_set_boolean(lept_value * v, int b) {
-	assert(v!=NULL);
-	lept_free(v);
-	v->type = b ? LEPT_TRUE : LEPT_FALSE;
+/* Each thread counts on its own copy of the allocator, added up afterwards. */
+typedef struct {
+	lept_allocator alloc;
+	lept_alloc_stats stats;
+} lept_thread_alloc;
+
+static void lept_thread_alloc_init(lept_thread_alloc * t, const lept_allocator * a) {
+	t->alloc = *a;
+	memset(&t->stats, 0, sizeof(lept_alloc_stats));
+	if (a->stats)
+		t->alloc.stats = &t->stats;
 }
 
-size_t lept_get_array_size(const lept_value * v) {
-	assert(v!=NULL && v->type == LEPT_ARRAY);
-	return v->u.a.size;
+static void lept_thread_alloc_merge(const lept_allocator * a, const lept_thread_alloc * t) {
+	lept_alloc_stats * s = a->stats;
+	if (!s)
+		return;
+	s->allocs += t->stats.allocs;
+	s->reallocs += t->stats.reallocs;
+	s->frees += t->stats.frees;
+	s->stack_grows += t->stats.stack_grows;
+	s->bytes += t->stats.bytes;
+	if (s->live + t->stats.peak > s->peak)
+		s->peak = s->live + t->stats.peak;
+	s->live += t->stats.live;
 }
 
-const lept_value * lept_get_array_element(const lept_value * v, size_t index) {
+typedef struct {
+	const char * begin, * end;
+	int quotes;     /* odd number of unescaped quotes */
+	long depth[2];  /* bracket balance if the chunk starts outside [0] or inside [1] a string */
+	int in_string;  /* the actual state at begin, from the prefix pass */
+	long start_depth;
+	lept_context splits; /* positions of top-level ',' and the closing ']' */
+	lept_thread_alloc alloc;
+} lept_index_chunk;
+
+/* Bit i set for each p[i] (i < 16, p + i < end) that stage one may act on.
+ * Folding in 0x20 maps '[' and ']' onto '{' and '}', so five compares cover
+ * all seven; the few other bytes this lets through are ignored later, just
+ * like all of them are on the plain path. */
+static unsigned lept_index_mask(const char * p, const char * end) {
+#ifdef LEPT_SSE2
+	if (end - p >= 16) {
+		const __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8(0x20));
+		return (unsigned)_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\"')), _mm_cmpeq_epi8(x, _mm_set1_epi8(','))),
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('{')), _mm_cmpeq_epi8(x, _mm_set1_epi8('}'))),
+				_mm_cmpeq_epi8(x, _mm_set1_epi8('\\' | 0x20)))));
+	}
+#endif
+	return end - p >= 16 ? 0xFFFFu : (1u << (end - p)) - 1;
+}
+
+/* Pass one (collect == 0) counts the chunk's quotes and its bracket balance
+ * for either state at its start. Pass two follows the real state found by
+ * the prefix pass and collects the top-level commas and the closing bracket
+ * of the root. Chunks never start right after a backslash, so an escape
+ * never straddles two of them. */
+static void lept_index_pass(lept_index_chunk * k, int collect) {
+	const char * block, * p, * skip = k->begin;
+	long depth[2] = { 0, 0 }, d = k->start_depth;
+	int in = collect ? k->in_string : 0;
+	unsigned mask;
+	for (block = k->begin; block < k->end; block += 16) {
+		for (p = block, mask = lept_index_mask(block, k->end); mask; p++, mask >>= 1) {
+			if (!(mask & 1) || p < skip)
+				continue;
+			switch (*p) {
+				case '\\':
+					skip = p + 2;
+					break;
+				case '\"':
+					in ^= 1;
+					break;
+				case '[': case '{':
+					if (!collect)
+						depth[in]++;
+					else if (!in)
+						d++;
+					break;
+				case ']': case '}':
+					if (!collect)
+						depth[in]--;
+					else if (!in && --d == 0)
+						*(const char **)lept_context_push(&k->splits, sizeof(const char *)) = p;
+					break;
+				case ',':
+					if (collect && !in && d == 1)
+						*(const char **)lept_context_push(&k->splits, sizeof(const char *)) = p;
+					break;
+			}
+		}
+	}
+	if (!collect) {
+		k->quotes = in;
+		k->depth[0] = depth[0];
+		k->depth[1] = depth[1];
+	}
+}
+
+static void * lept_index_count(void * arg) {
+	lept_index_pass((lept_index_chunk*)arg, 0);
+	return NULL;
+}
+
+static void * lept_index_splits(void * arg) {
+	lept_index_pass((lept_index_chunk*)arg, 1);
+	return NULL;
+}
+
+typedef struct {
+	const char * const * splits; /* element i ends at splits[i] */
+	const char * first;          /* start of the first element */
+	size_t index, count;
+	lept_value * e;
+	unsigned flags;
+	int ret;
+	lept_thread_alloc alloc;
+} lept_build_group;
+
+static void * lept_build_elements(void * arg) {
+	lept_build_group * g = (lept_build_group*)arg;
+	lept_context c;
+	size_t i;
+	memset(&c, 0, sizeof(lept_context));
+	c.alloc = &g->alloc.alloc;
+	c.flags = g->flags;
+	g->ret = LEPT_PARSE_OK;
+	for (i = g->index; i < g->index + g->count; i++) {
+		c.json = i == g->index ? g->first : g->splits[i - 1] + 1;
+		lept_parse_whitespace(&c);
+		if ((g->ret = lept_parse_value(&g->e[i], &c)) != LEPT_PARSE_OK)
+			break;
+		lept_parse_whitespace(&c);
+		if (c.json != g->splits[i]) { /* stage one was misled by invalid text */
+			g->ret = LEPT_PARSE_INVALID_VALUE;
+			break;
+		}
+	}
+	lept_mfree(c.alloc, c.stack, c.size);
+	return NULL;
+}
+
+/* Returns 0, leaving v null, when json is not a large enough array or is
+ * not valid: the caller then parses it serially, which also reports the
+ * error exactly as usual. */
+static int lept_parse_parallel(lept_value * v, const char * json, const lept_parse_options * opt) {
+	lept_index_chunk chunks[LEPT_PARALLEL_MAX_THREADS];
+	lept_build_group groups[LEPT_PARALLEL_MAX_THREADS];
+	const lept_allocator * a = opt->alloc ? opt->alloc : &lept_global_allocator;
+	const char * p = json, * end, ** splits = NULL;
+	size_t len, i, j, m = 0, target;
+	unsigned n = opt->threads < LEPT_PARALLEL_MAX_THREADS ? opt->threads : LEPT_PARALLEL_MAX_THREADS, ngroups;
+	long depth = 0;
+	int in = 0, ok = 1;
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	if (*p != '[')
+		return 0;
+	len = strlen(p);
+	if (len / LEPT_PARALLEL_MIN_CHUNK < n)
+		n = (unsigned)(len / LEPT_PARALLEL_MIN_CHUNK);
+	if (n < 2)
+		return 0;
+	end = p + len;
+
+	/* stage one */
+	for (i = 0; i < n; i++) {
+		lept_index_chunk * k = &chunks[i];
+		k->begin = i ? chunks[i - 1].end : p;
+		k->end = i + 1 < n ? p + len / n * (i + 1) : end;
+		if (k->end < k->begin)
+			k->end = k->begin;
+		while (k->end < end && k->end > p && k->end[-1] == '\\')
+			k->end++;
+		lept_thread_alloc_init(&k->alloc, a);
+		memset(&k->splits, 0, sizeof(lept_context));
+		k->splits.alloc = &k->alloc.alloc;
+	}
+	lept_run_jobs(lept_index_count, (char*)chunks, sizeof(lept_index_chunk), n);
+	for (i = 0; i < n; i++) {
+		chunks[i].in_string = in;
+		chunks[i].start_depth = depth;
+		depth += chunks[i].depth[in];
+		in ^= chunks[i].quotes;
+	}
+	if (in || depth != 0)
+		ok = 0;
+	else {
+		lept_run_jobs(lept_index_splits, (char*)chunks, sizeof(lept_index_chunk), n);
+		for (i = 0; i < n; i++)
+			m += chunks[i].splits.top / sizeof(const char *);
+		splits = (const char **)lept_malloc(a, m * sizeof(const char *));
+		for (i = 0, j = 0; i < n; i++) {
+			if (chunks[i].splits.top)
+				memcpy(splits + j, chunks[i].splits.stack, chunks[i].splits.top);
+			j += chunks[i].splits.top / sizeof(const char *);
+		}
+		/* only the last split closes the root, and only blanks follow it */
+		ok = m > 0 && *splits[m - 1] == ']';
+		for (i = 0; ok && i + 1 < m; i++)
+			ok = *splits[i] == ',';
+		for (p = ok ? splits[m - 1] + 1 : end; p < end; p++)
+			if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+				ok = 0;
+	}
+	for (i = 0; i < n; i++) {
+		lept_mfree(chunks[i].splits.alloc, chunks[i].splits.stack, chunks[i].splits.size);
+		lept_thread_alloc_merge(a, &chunks[i].alloc);
+	}
+
+	/* stage two: runs of elements of about the same length */
+	if (ok) {
+		lept_init(v);
+		v->u.a.size = m;
+		v->u.a.e = (lept_value*)lept_malloc(a, m * sizeof(lept_value));
+		for (i = 0; i < m; i++)
+			lept_init(&v->u.a.e[i]);
+		ngroups = m < n ? (unsigned)m : n;
+		target = (size_t)(splits[m - 1] - splits[0]) / ngroups;
+		for (i = 0, j = 0; i < ngroups; i++) {
+			lept_build_group * g = &groups[i];
+			g->splits = splits;
+			g->first = j ? splits[j - 1] + 1 : chunks[0].begin + 1;
+			g->index = j;
+			g->e = v->u.a.e;
+			g->flags = opt->flags;
+			lept_thread_alloc_init(&g->alloc, a);
+			if (i + 1 == ngroups)
+				j = m;
+			else /* at least one element each, and leave one for every later group */
+				for (j++; j < m - (ngroups - i - 1) && splits[j - 1] < g->first + target; j++);
+			g->count = j - g->index;
+		}
+		lept_run_jobs(lept_build_elements, (char*)groups, sizeof(lept_build_group), ngroups);
+		for (i = 0; i < ngroups; i++) {
+			lept_thread_alloc_merge(a, &groups[i].alloc);
+			ok = ok && groups[i].ret == LEPT_PARSE_OK;
+		}
+		if (ok) {
+			v->type = LEPT_ARRAY;
+			if (opt->flags & LEPT_PARSE_PACK_NUMBERS)
+				lept_pack_array_with(v, a);
+		}
+		else {
+			for (i = 0; i < m; i++)
+				lept_free_with(&v->u.a.e[i], a);
+			lept_mfree(a, v->u.a.e, m * sizeof(lept_value));
+			lept_init(v);
+		}
+	}
+	lept_mfree(a, splits, m * sizeof(const char *));
+	return ok;
+}
+
+int lept_parse(lept_value * v, const char * json) {
+	return lept_parse_ex(v, json, NULL);
+}
+
+int lept_parse_ex(lept_value * v, const char * json, const lept_parse_options * opt) {
+	lept_context c;
+	int ret;
+	assert(v != NULL);
+	LEPT_TRACE_EVENT(LEPT_TRACE_PARSE_BEGIN, parse__begin, 0);
+	if (opt && opt->threads > 1 && !opt->keys && !opt->keep && !opt->trace && lept_parse_parallel(v, json, opt)) {
+		if (opt->error)
+			opt->error->code = LEPT_PARSE_OK;
+		LEPT_TRACE_EVENT(LEPT_TRACE_PARSE_END, parse__end, LEPT_PARSE_OK);
+		return LEPT_PARSE_OK;
+	}
+	c.json = json;
+	c.top = c.size = 0;
+	c.stack = NULL;
+	c.keys = opt ? opt->keys : NULL;
+	c.alloc = opt && opt->alloc ? opt->alloc : &lept_global_allocator;
+	c.error = opt ? opt->error : NULL;
+	c.flags = opt ? opt->flags : 0;
+	c.path_head = LEPT_ERROR_PATH_SIZE - 1;
+	c.path_cut = 0;
+	c.keep = opt ? opt->keep : NULL;
+	c.nkeep = opt && opt->keep ? opt->nkeep : 0;
+	assert(c.nkeep <= LEPT_PARSE_MAX_KEEP);
+	LEPT_TRACE_INIT(&c, opt ? opt->trace : NULL);
+	lept_init(v);
+	lept_parse_whitespace(&c);
+	if (c.keep && lept_keep_root(&c))
+		ret = *c.json == '[' || *c.json == '{' ? lept_project_value(v, &c, ~0ul, 0) : lept_scan_value(&c);
+	else
+		ret = lept_parse_value(v, &c);
+	if (ret == LEPT_PARSE_OK) {
+		lept_parse_whitespace(&c);
+		if (*c.json != '\0') {
+			lept_free_with(v, c.alloc);
+			ret = LEPT_PARSE_NOT_SINGLE;
+		}
+	}
+	if (c.error) {
+		c.error->code = ret;
+		if (ret != LEPT_PARSE_OK)
+			lept_error_locate(&c, json, (size_t)(c.json - json));
+	}
+	assert(c.top == 0);
+	lept_mfree(c.alloc, c.stack, c.size);
+	LEPT_TRACE_EVENT(LEPT_TRACE_PARSE_END, parse__end, ret);
+	return ret;
+}
+
+/* Batch loading: workers share a cursor into the list of paths, and each
+ * keeps its read buffers for all of its files and counts on its own copy of
+ * the allocator. */
+typedef struct {
+	lept_load_result * results;
+	const char * const * paths;
+	size_t n, next;
+	lept_parse_options opt;
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} lept_load_batch;
+
+typedef struct {
+	lept_load_batch * batch;
+	lept_thread_alloc alloc;
+	lept_parse_options opt;
+	char * buffer;
+	size_t size;
+	size_t failed;
+} lept_load_worker;
+
+/* The index of the next file to load, or the batch size when none is left */
+static size_t lept_load_next(lept_load_batch * b) {
+	size_t i;
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_lock(&b->lock);
+#endif
+	i = b->next < b->n ? b->next++ : b->n;
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_unlock(&b->lock);
+#endif
+	return i;
+}
+
+/* Reads the whole file into w->buffer, NUL-terminated; errno on failure */
+static int lept_load_read(lept_load_worker * w, const char * path) {
+	FILE * f;
+	size_t len = 0, got;
+	int err = 0;
+	errno = 0;
+	if ((f = fopen(path, "rb")) == NULL)
+		return errno ? errno : EIO;
+	do {
+		if (len + 1 >= w->size) {
+			size_t size = w->size ? w->size * 2 : 4096;
+			w->buffer = (char*)lept_realloc(&w->alloc.alloc, w->buffer, w->size, size);
+			w->size = size;
+		}
+		got = fread(w->buffer + len, 1, w->size - 1 - len, f);
+		len += got;
+	} while (got > 0);
+	if (ferror(f))
+		err = errno ? errno : EIO;
+	fclose(f);
+	w->buffer[len] = '\0';
+	return err;
+}
+
+/* Parses file i, read whole into json, or records why it could not be read. */
+static void lept_load_done(lept_load_worker * w, size_t i, const char * json, int err) {
+	lept_load_result * r = &w->batch->results[i];
+	lept_init(&r->v);
+	memset(&r->error, 0, sizeof(lept_parse_error));
+	if ((r->sys_errno = err) != 0)
+		r->error.code = LEPT_PARSE_READ_ERROR;
+	else {
+		w->opt.error = &r->error;
+		lept_parse_ex(&r->v, json, &w->opt);
+	}
+	if (r->error.code != LEPT_PARSE_OK)
+		w->failed++;
+}
+
+#ifdef LEPT_IO_URING
+/* io_uring through the raw system calls, with no liburing: each worker sets
+ * up a ring of its own and keeps up to LEPT_LOAD_QUEUE_DEPTH reads in it,
+ * parsing every file as its read completes while the kernel carries on with
+ * the next ones. A worker that cannot set a ring up (no io_uring in the
+ * kernel, a seccomp filter, locked memory limits) loads its files like the
+ * other platforms do. */
+#ifndef LEPT_LOAD_QUEUE_DEPTH
+#define LEPT_LOAD_QUEUE_DEPTH 32
+#endif
+
+typedef struct {
+	int fd;
+	void * sq_ring, * cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned * sq_tail, * sq_mask, * sq_array;
+	unsigned * cq_head, * cq_tail, * cq_mask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	unsigned sq_entries, queued; /* queued: filled in, not yet submitted */
+} lept_ring;
+
+/* A file being read: fd is -1 while the slot is free. */
+typedef struct {
+	size_t index;
+	int fd;
+	char * buffer;
+	size_t size, len, capacity; /* size from fstat(), capacity of buffer */
+	struct iovec iov;
+} lept_load_slot;
+
+static void lept_ring_exit(lept_ring * r) {
+	if (r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ring != MAP_FAILED)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/* 0 when the ring cannot be had, and the caller falls back */
+static int lept_ring_init(lept_ring * r, unsigned entries) {
+	struct io_uring_params p;
+	long fd;
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return 0;
+	r->fd = (int)fd;
+	r->sq_entries = p.sq_entries;
+	r->queued = 0;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		lept_ring_exit(r);
+		return 0;
+	}
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	return 1;
+}
+
+/* Queues a read of the rest of the slot's file; there is always room, since
+ * a slot has one read in flight at most and the ring has an entry per slot. */
+static void lept_ring_read(lept_ring * r, lept_load_slot * s, size_t tag) {
+	unsigned tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe * e = &r->sqes[i];
+	s->iov.iov_base = s->buffer + s->len;
+	s->iov.iov_len = s->size - s->len;
+	memset(e, 0, sizeof(*e));
+	e->opcode = IORING_OP_READV; /* READ needs Linux 5.6, READV came with io_uring */
+	e->fd = s->fd;
+	e->addr = (unsigned long)&s->iov;
+	e->len = 1;
+	e->off = s->len;
+	e->user_data = tag;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE); /* the entry before the tail */
+	r->queued++;
+}
+
+/* Opens file i and queues its read, or loads it on the spot when it is not a
+ * plain file whose size is known up front. */
+static void lept_load_start(lept_load_worker * w, lept_ring * r, lept_load_slot * s, size_t tag, size_t i) {
+	struct stat st;
+	const char * path = w->batch->paths[i];
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		lept_load_done(w, i, NULL, errno);
+		return;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		lept_load_done(w, i, w->buffer, lept_load_read(w, path));
+		return;
+	}
+	if ((size_t)st.st_size >= s->capacity) {
+		s->buffer = (char*)lept_realloc(&w->alloc.alloc, s->buffer, s->capacity, (size_t)st.st_size + 1);
+		s->capacity = (size_t)st.st_size + 1;
+	}
+	s->index = i;
+	s->fd = fd;
+	s->size = (size_t)st.st_size;
+	s->len = 0;
+	lept_ring_read(r, s, tag);
+}
+
+static void lept_load_finish(lept_load_worker * w, lept_load_slot * s, int err) {
+	s->buffer[s->len] = '\0';
+	lept_load_done(w, s->index, s->buffer, err);
+	close(s->fd);
+	s->fd = -1;
+}
+
+/* Loads files until the batch runs out, or until the ring fails; the files
+ * left then go to the fallback. */
+static void lept_load_ring(lept_load_worker * w) {
+	lept_load_slot slots[LEPT_LOAD_QUEUE_DEPTH];
+	lept_ring r;
+	lept_load_batch * b = w->batch;
+	struct io_uring_cqe * cqe;
+	unsigned head, tail, busy = 0, k;
+	size_t i = 0;
+	long ret;
+	if (!lept_ring_init(&r, LEPT_LOAD_QUEUE_DEPTH))
+		return;
+	for (k = 0; k < LEPT_LOAD_QUEUE_DEPTH; k++) {
+		slots[k].fd = -1;
+		slots[k].buffer = NULL;
+		slots[k].capacity = 0;
+	}
+	for (;;) {
+		for (k = 0; k < LEPT_LOAD_QUEUE_DEPTH && i != b->n; k++)
+			while (slots[k].fd < 0 && (i = lept_load_next(b)) != b->n)
+				lept_load_start(w, &r, &slots[k], k, i);
+		for (busy = 0, k = 0; k < LEPT_LOAD_QUEUE_DEPTH; k++)
+			busy += slots[k].fd >= 0;
+		if (!busy)
+			break;
+		/* submit what is queued and wait for at least one read to finish */
+		ret = syscall(__NR_io_uring_enter, r.fd, r.queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0)
+			r.queued -= (unsigned)ret;
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			for (k = 0; k < LEPT_LOAD_QUEUE_DEPTH; k++) /* read those again */
+				if (slots[k].fd >= 0) {
+					close(slots[k].fd);
+					lept_load_done(w, slots[k].index, w->buffer, lept_load_read(w, b->paths[slots[k].index]));
+				}
+			break;
+		}
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &r.cqes[head & *r.cq_mask];
+			k = (unsigned)cqe->user_data;
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+				lept_ring_read(&r, &slots[k], k);
+			else if (cqe->res < 0)
+				lept_load_finish(w, &slots[k], -cqe->res);
+			else if (cqe->res > 0 && (slots[k].len += (size_t)cqe->res) < slots[k].size)
+				lept_ring_read(&r, &slots[k], k); /* short read */
+			else /* whole, or cut short by a truncation */
+				lept_load_finish(w, &slots[k], 0);
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	for (k = 0; k < LEPT_LOAD_QUEUE_DEPTH; k++)
+		lept_mfree(&w->alloc.alloc, slots[k].buffer, slots[k].capacity);
+	lept_ring_exit(&r);
+}
+#endif
+
+static void * lept_load_work(void * arg) {
+	lept_load_worker * w = (lept_load_worker*)arg;
+	size_t i;
+#ifdef LEPT_IO_URING
+	lept_load_ring(w);
+#endif
+	while ((i = lept_load_next(w->batch)) != w->batch->n)
+		lept_load_done(w, i, w->buffer, lept_load_read(w, w->batch->paths[i]));
+	return NULL;
+}
+
+size_t lept_load_files(lept_load_result * results, const char * const * paths, size_t n, const lept_parse_options * opt) {
+	lept_load_batch b;
+	lept_load_worker workers[LEPT_PARALLEL_MAX_THREADS];
+	const lept_allocator * a = opt && opt->alloc ? opt->alloc : &lept_global_allocator;
+	unsigned nworkers = opt && opt->threads > 1 ? opt->threads : 1, i;
+	size_t failed = 0;
+	assert(results != NULL && (paths != NULL || n == 0));
+	if (opt)
+		b.opt = *opt;
+	else
+		lept_parse_options_init(&b.opt);
+	b.opt.threads = 1;
+	if (nworkers > LEPT_PARALLEL_MAX_THREADS)
+		nworkers = LEPT_PARALLEL_MAX_THREADS;
+	if (nworkers > n)
+		nworkers = n ? (unsigned)n : 1;
+	/* the intern table and the trace counters are not shared between threads */
+	if (b.opt.keys || b.opt.trace)
+		nworkers = 1;
+	b.results = results;
+	b.paths = paths;
+	b.n = n;
+	b.next = 0;
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_init(&b.lock, NULL);
+#endif
+	for (i = 0; i < nworkers; i++) {
+		workers[i].batch = &b;
+		lept_thread_alloc_init(&workers[i].alloc, a);
+		workers[i].opt = b.opt;
+		workers[i].opt.alloc = &workers[i].alloc.alloc;
+		workers[i].buffer = NULL;
+		workers[i].size = workers[i].failed = 0;
+	}
+	lept_run_jobs(lept_load_work, (char*)workers, sizeof(lept_load_worker), nworkers);
+	for (i = 0; i < nworkers; i++) {
+		lept_mfree(&workers[i].alloc.alloc, workers[i].buffer, workers[i].size);
+		lept_thread_alloc_merge(a, &workers[i].alloc);
+		failed += workers[i].failed;
+	}
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_destroy(&b.lock);
+#endif
+	return failed;
+}
+
+#define ISWHITESPACE(ch) ((ch) == ' ' || (ch) == '\t' || (ch) == '\n' || (ch) == '\r')
+
+/* Validation mirrors the parse functions above on a bounded buffer. Each
+ * helper advances *pp past what it checked, or to the offending byte. */
+
+static int lept_validate_hex4(const char ** pp, const char * end, unsigned * u) {
+	if (end - *pp < 4 || !lept_parse_hex4(*pp, u))
+		return LEPT_PARSE_INVALID_UNICODE_HEX;
+	*pp += 4;
+	return LEPT_PARSE_OK;
+}
+
+static int lept_validate_string(const char ** pp, const char * end) {
+	const char * p = *pp + 1;
+	unsigned u;
+	int ret = LEPT_PARSE_MISS_QUOTATION_MARK;
+	while (p < end) {
+		unsigned char ch = (unsigned char)*p;
+		if (ch == '\"') {
+			*pp = p + 1;
+			return LEPT_PARSE_OK;
+		}
+		if (ch == '\\') {
+			if (++p == end)
+				break;
+			switch (*p++) {
+				case '\"': case '/': case '\\': case 'b': case 'f': case 'n': case 'r': case 't':
+					break;
+				case 'u':
+					if ((ret = lept_validate_hex4(&p, end, &u)) != LEPT_PARSE_OK)
+						goto error;
+					if (u >= 0xD800 && u <= 0xDBFF) {
+						/* report the byte lept_parse_string_raw() stops on */
+						ret = LEPT_PARSE_INVALID_UNICODE_SURROGATE;
+						if (p == end || *p != '\\')
+							goto error;
+						if (++p == end || *p != 'u')
+							goto error;
+						p++;
+						if ((ret = lept_validate_hex4(&p, end, &u)) != LEPT_PARSE_OK)
+							goto error;
+						if (u < 0xDC00 || u > 0xDFFF) {
+							p--;
+							ret = LEPT_PARSE_INVALID_UNICODE_SURROGATE;
+							goto error;
+						}
+					}
+					break;
+				default:
+					p--;
+					ret = LEPT_PARSE_INVALID_STRING_ESCAPE;
+					goto error;
+			}
+		}
+		else if (ch < 0x20) {
+			ret = LEPT_PARSE_INVALID_STRING_CHAR;
+			goto error;
+		}
+		else
+			p++;
+	}
+	ret = LEPT_PARSE_MISS_QUOTATION_MARK;
+error:
+	*pp = p;
+	return ret;
+}
+
+static int lept_validate_number(const char ** pp, const char * end) {
+	const char * p = *pp, * first = NULL, * d;
+	long digits = 0, exp = 0;
+	int exp_negative = 0;
+	char buffer[48];
+	size_t n = 0;
+	if (p < end && *p == '-') p++;
+	if (p < end && *p == '0') p++;
+	else {
+		if (p == end || !ISDIGIT1TO9(*p)) return LEPT_PARSE_INVALID_VALUE;
+		for (first = p++; p < end && ISDIGIT(*p); p++);
+		digits = p - first;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		if (p == end || !ISDIGIT(*p)) return LEPT_PARSE_INVALID_VALUE;
+		if (!first) { /* leading zeros after the point lower the magnitude */
+			for (; p < end && *p == '0'; p++)
+				digits--;
+			if (p < end && ISDIGIT(*p))
+				first = p;
+		}
+		for (; p < end && ISDIGIT(*p); p++);
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) exp_negative = *p++ == '-';
+		if (p == end || !ISDIGIT(*p)) return LEPT_PARSE_INVALID_VALUE;
+		for (; p < end && ISDIGIT(*p); p++)
+			if (exp < 100000)
+				exp = exp * 10 + (*p - '0');
+	}
+	if (exp_negative)
+		exp = -exp;
+	/* the value is below 10^(digits + exp): only the top decade needs strtod() */
+	if (first && digits + exp > 309)
+		return LEPT_PARSE_NUMBER_TOO_BIG;
+	if (first && digits + exp == 309) {
+		buffer[n++] = '.';
+		for (d = first; d < p && n < 41 && (ISDIGIT(*d) || *d == '.'); d++)
+			if (*d != '.')
+				buffer[n++] = *d;
+		sprintf(buffer + n, "e309");
+		if (strtod(buffer, NULL) == HUGE_VAL)
+			return LEPT_PARSE_NUMBER_TOO_BIG;
+	}
+	*pp = p;
+	return LEPT_PARSE_OK;
+}
+
+static int lept_validate_literal(const char ** pp, const char * end, const char * literal) {
+	const char * p = *pp;
+	/* stop on the first mismatching byte, where lept_parse_literal() does */
+	for (; *literal; p++, literal++)
+		if (p == end || *p != *literal) {
+			*pp = p;
+			return LEPT_PARSE_INVALID_VALUE;
+		}
+	*pp = p;
+	return LEPT_PARSE_OK;
+}
+
+int lept_validate(const char * json, size_t len, size_t * offset) {
+	enum { LEPT_EXPECT_VALUE, LEPT_EXPECT_KEY, LEPT_EXPECT_NEXT } state = LEPT_EXPECT_VALUE;
+	unsigned char objects[LEPT_VALIDATE_MAX_DEPTH / 8]; /* one bit per open container */
+	const char * p = json, * end = json + len;
+	size_t depth = 0;
+	int ret = LEPT_PARSE_OK, in_object;
+	assert(json != NULL || len == 0);
+	for (;;) {
+		while (p < end && ISWHITESPACE(*p)) p++;
+		if (state == LEPT_EXPECT_VALUE) {
+			if (p == end) {
+				ret = LEPT_PARSE_ALL_BLANK;
+				break;
+			}
+			switch (*p) {
+				case 'n': ret = lept_validate_literal(&p, end, "null"); break;
+				case 't': ret = lept_validate_literal(&p, end, "true"); break;
+				case 'f': ret = lept_validate_literal(&p, end, "false"); break;
+				case '\"': ret = lept_validate_string(&p, end); break;
+				case '[':
+				case '{':
+					if (depth == LEPT_VALIDATE_MAX_DEPTH) {
+						ret = LEPT_PARSE_TOO_DEEP;
+						break;
+					}
+					in_object = *p++ == '{';
+					if (in_object)
+						objects[depth >> 3] |= (unsigned char)(1u << (depth & 7));
+					else
+						objects[depth >> 3] &= (unsigned char)~(1u << (depth & 7));
+					depth++;
+					while (p < end && ISWHITESPACE(*p)) p++;
+					if (p < end && *p == (in_object ? '}' : ']')) {
+						p++;
+						depth--;
+					}
+					else {
+						state = in_object ? LEPT_EXPECT_KEY : LEPT_EXPECT_VALUE;
+						continue;
+					}
+					break;
+				default: ret = lept_validate_number(&p, end); break;
+			}
+			if (ret != LEPT_PARSE_OK)
+				break;
+			state = LEPT_EXPECT_NEXT;
+		}
+		else if (state == LEPT_EXPECT_KEY) {
+			if (p == end || *p != '\"') {
+				ret = LEPT_PARSE_MISS_KEY;
+				break;
+			}
+			if ((ret = lept_validate_string(&p, end)) != LEPT_PARSE_OK)
+				break;
+			while (p < end && ISWHITESPACE(*p)) p++;
+			if (p == end || *p != ':') {
+				ret = LEPT_PARSE_MISS_COLON;
+				break;
+			}
+			p++;
+			state = LEPT_EXPECT_VALUE;
+		}
+		else {
+			if (depth == 0) {
+				if (p != end)
+					ret = LEPT_PARSE_NOT_SINGLE;
+				break;
+			}
+			in_object = objects[(depth - 1) >> 3] >> ((depth - 1) & 7) & 1;
+			if (p < end && *p == ',') {
+				p++;
+				state = in_object ? LEPT_EXPECT_KEY : LEPT_EXPECT_VALUE;
+			}
+			else if (p < end && *p == (in_object ? '}' : ']')) {
+				p++;
+				depth--;
+			}
+			else {
+				ret = in_object ? LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET : LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+				break;
+			}
+		}
+	}
+	if (ret != LEPT_PARSE_OK && offset)
+		*offset = p - json;
+	return ret;
+}
+
+lept_type lept_get_type(const lept_value * v) {
+	assert(v != NULL);
+	return v->type;
+}
+
+double lept_get_number(const lept_value * v) {
+	assert( v!=NULL && v->type == LEPT_NUMBER);
+	return v->u.n;
+}
+
+void lept_free(lept_value * v) {
+	lept_free_with(v, &lept_global_allocator);
+}
+
+/* Releases the memory v owns directly, not its elements. */
+static void lept_free_node(lept_value * v, const lept_allocator * a) {
+	lept_uncache_hash(v);
+	if (v->type == LEPT_STRING)
+		lept_mfree(a, v->u.s.s, v->u.s.len + 1);
+	else if (v->type == LEPT_ARRAY)
+		lept_mfree(a, v->u.a.e, v->u.a.size * ((v->flags & LEPT_FLAG_PACKED) ? sizeof(double) : sizeof(lept_value)));
+	else if (v->type == LEPT_OBJECT)
+		lept_mfree(a, v->u.o.m, v->u.o.size * sizeof(lept_member));
+}
+
+static int lept_has_children(const lept_value * v) {
+	return (v->type == LEPT_ARRAY && v->u.a.size && !(v->flags & LEPT_FLAG_PACKED)) || (v->type == LEPT_OBJECT && v->u.o.size);
+}
+
+static size_t lept_free_size(const lept_value * v) {
+	return v->type == LEPT_ARRAY ? v->u.a.size : v->u.o.size;
+}
+
+static lept_value * lept_free_slot(lept_value * v, size_t i) {
+	return v->type == LEPT_ARRAY ? &v->u.a.e[i] : &v->u.o.m[i].v;
+}
+
+/* Iterative, without extra memory: elements are freed last to first, and on
+ * the way down the slot of the container being entered, already emptied,
+ * keeps the way back up. The count of elements left in the container being
+ * left is needed on the way back: it is the last slot's index, or else the
+ * last slot, freed by then, holds it behind a LEPT_NUMBER tag (a slot on the
+ * way up is always an array, object or the LEPT_NULL at the top). */
+void lept_free_with(lept_value * v, const lept_allocator * a) {
+	lept_value cur, up, down, * slot, * last;
+	size_t left;
+	assert(v!=NULL && a!=NULL);
+	cur = *v;
+	lept_init(v);
+	lept_init(&up);
+	left = lept_has_children(&cur) ? lept_free_size(&cur) : 0;
+	for (;;) {
+		if (left) {
+			left--;
+			if (cur.type == LEPT_OBJECT && !(cur.flags & LEPT_FLAG_SHARED_KEYS))
+				lept_mfree(a, cur.u.o.m[left].k, cur.u.o.m[left].klen + 1);
+			slot = lept_free_slot(&cur, left);
+			if (!lept_has_children(slot)) {
+				lept_free_node(slot, a);
+				continue;
+			}
+			if (left + 1 < lept_free_size(&cur)) {
+				last = lept_free_slot(&cur, lept_free_size(&cur) - 1);
+				last->type = LEPT_NUMBER;
+				last->u.a.size = left;
+			}
+			down = *slot;
+			*slot = up;
+			up = cur;
+			cur = down;
+			left = lept_free_size(&cur);
+			continue;
+		}
+		lept_free_node(&cur, a);
+		if (up.type == LEPT_NULL)
+			break;
+		cur = up; /* back up */
+		last = lept_free_slot(&cur, lept_free_size(&cur) - 1);
+		left = last->type == LEPT_NUMBER ? last->u.a.size : lept_free_size(&cur) - 1;
+		up = *lept_free_slot(&cur, left);
+	}
+}
+
+/* Deferred frees: detached trees queue up for one reclaimer thread, started
+ * on first use. */
+#ifdef LEPT_HAVE_PTHREAD
+typedef struct lept_reclaim_item lept_reclaim_item;
+struct lept_reclaim_item {
+	lept_value v;
+	lept_allocator alloc;
+	lept_reclaim_item * next;
+};
+
+static pthread_mutex_t lept_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lept_reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lept_reclaim_done = PTHREAD_COND_INITIALIZER;
+static lept_reclaim_item * lept_reclaim_head, * lept_reclaim_tail;
+static int lept_reclaim_state; /* 0 not started, 1 running, -1 could not start */
+static int lept_reclaim_busy;
+
+static void * lept_reclaim(void * arg) {
+	lept_reclaim_item * item;
+	lept_allocator a;
+	(void)arg;
+	pthread_mutex_lock(&lept_reclaim_lock);
+	for (;;) {
+		while (!lept_reclaim_head)
+			pthread_cond_wait(&lept_reclaim_work, &lept_reclaim_lock);
+		item = lept_reclaim_head;
+		if (!(lept_reclaim_head = item->next))
+			lept_reclaim_tail = NULL;
+		lept_reclaim_busy = 1;
+		pthread_mutex_unlock(&lept_reclaim_lock);
+		a = item->alloc;
+		lept_free_with(&item->v, &a);
+		lept_mfree(&a, item, sizeof(lept_reclaim_item));
+		pthread_mutex_lock(&lept_reclaim_lock);
+		lept_reclaim_busy = 0;
+		if (!lept_reclaim_head)
+			pthread_cond_broadcast(&lept_reclaim_done);
+	}
+	return NULL;
+}
+#endif
+
+void lept_free_deferred(lept_value * v) {
+	lept_free_deferred_with(v, &lept_global_allocator);
+}
+
+void lept_free_deferred_with(lept_value * v, const lept_allocator * a) {
+#ifdef LEPT_HAVE_PTHREAD
+	lept_reclaim_item * item;
+	pthread_t thread;
+	assert(v!=NULL && a!=NULL);
+	/* counters are not thread-safe, and a leaf is as cheap to free here */
+	if (a->stats || !lept_has_children(v)) {
+		lept_free_with(v, a);
+		return;
+	}
+	item = (lept_reclaim_item *)lept_malloc(a, sizeof(lept_reclaim_item));
+	item->v = *v;
+	item->alloc = *a;
+	item->next = NULL;
+	lept_init(v);
+	pthread_mutex_lock(&lept_reclaim_lock);
+	if (lept_reclaim_state == 0) {
+		lept_reclaim_state = pthread_create(&thread, NULL, lept_reclaim, NULL) == 0 ? 1 : -1;
+		if (lept_reclaim_state == 1)
+			pthread_detach(thread);
+	}
+	if (lept_reclaim_state < 0) {
+		pthread_mutex_unlock(&lept_reclaim_lock);
+		lept_free_with(&item->v, a);
+		lept_mfree(a, item, sizeof(lept_reclaim_item));
+		return;
+	}
+	if (lept_reclaim_tail)
+		lept_reclaim_tail->next = item;
+	else
+		lept_reclaim_head = item;
+	lept_reclaim_tail = item;
+	pthread_cond_signal(&lept_reclaim_work);
+	pthread_mutex_unlock(&lept_reclaim_lock);
+#else
+	lept_free_with(v, a);
+#endif
+}
+
+void lept_free_wait(void) {
+#ifdef LEPT_HAVE_PTHREAD
+	pthread_mutex_lock(&lept_reclaim_lock);
+	while (lept_reclaim_head || lept_reclaim_busy)
+		pthread_cond_wait(&lept_reclaim_done, &lept_reclaim_lock);
+	pthread_mutex_unlock(&lept_reclaim_lock);
+#endif
+}
+
+void lept_set_string(lept_value * v, const char * s, size_t len) {
+	lept_set_string_with(v, s, len, &lept_global_allocator);
+}
+
+void lept_set_string_with(lept_value * v, const char * s, size_t len, const lept_allocator * a) {
+	assert(v!=NULL && (s!=NULL || len == 0) && a != NULL);
+	lept_free_with(v, a);
+	v->u.s.s  = (char*)lept_malloc(a, len+1);
+	if (len)
+		memcpy(v->u.s.s, s, len);
+	v->u.s.s[len] = '\0';
+	v->u.s.len = len;
+	v->type = LEPT_STRING;
+}
+
+const char* lept_get_string(const lept_value * v) {
+	assert(v!=NULL && v->type == LEPT_STRING);
+	return v->u.s.s;
+}
+
+size_t lept_get_string_length(const lept_value * v) {
+	assert(v!=NULL && v->type == LEPT_STRING);
+	return v->u.s.len;
+}
+
+void lept_set_boolean(lept_value * v, int b) {
+	assert(v!=NULL);
+	lept_free(v);
+	v->type = b ? LEPT_TRUE : LEPT_FALSE;
+}
+
+size_t lept_get_array_size(const lept_value * v) {
 	assert(v!=NULL && v->type == LEPT_ARRAY);
+	return v->u.a.size;
+}
+
+const lept_value * lept_get_array_element(const lept_value * v, size_t index) {
+	assert(v!=NULL && v->type == LEPT_ARRAY && !(v->flags & LEPT_FLAG_PACKED));
 	assert(index < v->u.a.size);
 	return v->u.a.e + index;
 }
 
-size_t lept_get_object_size(const lept_value* v) {
-    assert(v != NULL && v->type == LEPT_OBJECT);
-    return v->u.o.size;
+double * lept_get_array_numbers(const lept_value * v) {
+	assert(v!=NULL && v->type == LEPT_ARRAY);
+	return v->flags & LEPT_FLAG_PACKED ? (double *)v->u.a.e : NULL;
+}
+
+/* Element index of an array whether packed or not; a packed one is read
+ * into *tmp. */
+static const lept_value * lept_array_at(const lept_value * v, size_t index, lept_value * tmp) {
+	if (!(v->flags & LEPT_FLAG_PACKED))
+		return &v->u.a.e[index];
+	lept_init(tmp);
+	tmp->type = LEPT_NUMBER;
+	tmp->u.n = ((const double *)v->u.a.e)[index];
+	return tmp;
+}
+
+/* The content of v moves from one block to another, and its hash with it. */
+static void lept_move_hash(lept_value * v, const void * from, const void * to) {
+	size_t h;
+	if (!(v->flags & LEPT_FLAG_HASHED))
+		return;
+	LEPT_HASH_LOCK();
+	h = lept_hash_table[lept_hash_find(from)].hash;
+	lept_hash_remove(from);
+	if (!lept_hash_insert(to, h))
+		v->flags &= ~LEPT_FLAG_HASHED;
+	LEPT_HASH_UNLOCK();
+}
+
+int lept_pack_array_with(lept_value * v, const lept_allocator * a) {
+	double * n;
+	size_t i, size = v->u.a.size;
+	assert(v != NULL && v->type == LEPT_ARRAY && a != NULL);
+	if (v->flags & LEPT_FLAG_PACKED)
+		return 1;
+	for (i = 0; i < size; i++)
+		if (v->u.a.e[i].type != LEPT_NUMBER)
+			return 0;
+	n = (double *)lept_malloc(a, size * sizeof(double));
+	for (i = 0; i < size; i++)
+		n[i] = v->u.a.e[i].u.n;
+	lept_move_hash(v, v->u.a.e, n);
+	lept_mfree(a, v->u.a.e, size * sizeof(lept_value));
+	v->u.a.e = (lept_value *)n;
+	v->flags |= LEPT_FLAG_PACKED;
+	return 1;
+}
+
+int lept_pack_array(lept_value * v) {
+	assert(v != NULL && v->type == LEPT_ARRAY);
+	return lept_pack_array_with(v, &lept_global_allocator);
+}
+
+void lept_unpack_array(lept_value * v) {
+	lept_unpack_array_with(v, &lept_global_allocator);
+}
+
+void lept_unpack_array_with(lept_value * v, const lept_allocator * a) {
+	const double * n;
+	size_t i, size;
+	assert(v != NULL && v->type == LEPT_ARRAY && a != NULL);
+	if (!(v->flags & LEPT_FLAG_PACKED))
+		return;
+	n = (const double *)v->u.a.e;
+	size = v->u.a.size;
+	v->u.a.e = (lept_value *)lept_malloc(a, size * sizeof(lept_value));
+	for (i = 0; i < size; i++) {
+		lept_init(&v->u.a.e[i]);
+		v->u.a.e[i].type = LEPT_NUMBER;
+		v->u.a.e[i].u.n = n[i];
+	}
+	lept_move_hash(v, n, v->u.a.e);
+	lept_mfree(a, (void *)n, size * sizeof(double));
+	v->flags &= ~LEPT_FLAG_PACKED;
+}
+
+size_t lept_get_object_size(const lept_value* v) {
+    assert(v != NULL && v->type == LEPT_OBJECT);
+    return v->u.o.size;
+}
+
+const char* lept_get_object_key(const lept_value* v, size_t index) {
+    assert(v != NULL && v->type == LEPT_OBJECT);
+    assert(index < v->u.o.size);
+    return v->u.o.m[index].k;
+}
+
+size_t lept_get_object_key_length(const lept_value* v, size_t index) {
+    assert(v != NULL && v->type == LEPT_OBJECT);
+    assert(index < v->u.o.size);
+    return v->u.o.m[index].klen;
+}
+
+lept_value* lept_get_object_value(const lept_value* v, size_t index) {
+    assert(v != NULL && v->type == LEPT_OBJECT);
+    assert(index < v->u.o.size);
+    return &v->u.o.m[index].v;
+}
+
+#define LEPT_KEY_NOT_EXIST ((size_t) - 1)
+
+size_t lept_find_object_index(const lept_value * v, const char * key, size_t klen) {
+	size_t i;
+	assert(v!=NULL && v->type == LEPT_OBJECT);
+	/* interned keys let callers that hold the shared copy skip the memcmp() */
+	for (i=0; i<v->u.o.size; i++) {
+		if (klen == v->u.o.m[i].klen && (v->u.o.m[i].k == key || memcmp(v->u.o.m[i].k, key, klen) == 0))
+			return i;
+	}
+	return LEPT_KEY_NOT_EXIST;
+}
+
+lept_value * lept_find_object_value(const lept_value * v, const char * key, size_t klen) {
+	size_t index = lept_find_object_index(v, key, klen);
+	return index == LEPT_KEY_NOT_EXIST ? NULL : &v->u.o.m[index].v;
+}
+
+int lept_is_equal(const lept_value * v1, const lept_value * v2) {
+	size_t i;
+	lept_value * temp, t1, t2;
+	assert(v1 != NULL && v2 != NULL);
+	if (v1->type != v2->type)
+		return 0;
+	if ((v1->flags & v2->flags & LEPT_FLAG_HASHED) && lept_cached_hash(v1) != lept_cached_hash(v2))
+		return 0;
+	switch (v1->type) {
+		case LEPT_NUMBER:
+			return v1->u.n == v2->u.n;
+		case LEPT_STRING:
+			return v1->u.s.len == v2->u.s.len && memcmp(v1->u.s.s, v2->u.s.s, v1->u.s.len) == 0;
+		case LEPT_ARRAY:
+			if (v1->u.a.size != v2->u.a.size) return 0;
+			for (i=0; i<v1->u.a.size; i++) {
+				if (!lept_is_equal(lept_array_at(v1, i, &t1), lept_array_at(v2, i, &t2)))
+					return 0;
+			}
+			return 1;
+		case LEPT_OBJECT:
+			if (v1->u.o.size != v2->u.o.size) return 0;
+			for (i=0; i<v1->u.o.size; i++) {
+				temp = lept_find_object_value(v2, v1->u.o.m[i].k, v1->u.o.m[i].klen);
+				if (!temp || !lept_is_equal(&v1->u.o.m[i].v, temp))
+					return 0;
+			}
+			return 1;
+		default:
+			return 1;
+	}
+}
+
+void lept_copy(lept_value * dst, const lept_value * src) {
+	lept_copy_with(dst, src, &lept_global_allocator);
+}
+
+void lept_copy_with(lept_value * dst, const lept_value * src, const lept_allocator * a) {
+	size_t i, len;
+	assert(src != NULL && dst != NULL && src != dst && a != NULL);
+	lept_free_with(dst, a);
+	switch (src->type) {
+		case LEPT_NUMBER:
+			dst->u.n = src->u.n;
+			break;
+		case LEPT_STRING:
+			lept_set_string_with(dst, src->u.s.s, src->u.s.len, a);
+			break;
+		case LEPT_ARRAY:
+			dst->u.a.size = src->u.a.size;
+			dst->flags = src->flags & LEPT_FLAG_PACKED;
+			if (src->flags & LEPT_FLAG_PACKED) {
+				len = dst->u.a.size * sizeof(double);
+				memcpy(dst->u.a.e = (lept_value *)lept_malloc(a, len), src->u.a.e, len);
+			}
+			else
+				dst->u.a.e = (lept_value *)lept_malloc(a, dst->u.a.size * sizeof(lept_value));
+			if (src->flags & LEPT_FLAG_PACKED)
+				break;
+			for (i=0; i<dst->u.a.size; i++) {
+				lept_init(&dst->u.a.e[i]);
+				lept_copy_with(&dst->u.a.e[i], &src->u.a.e[i], a);
+			}
+			break;
+		case LEPT_OBJECT:
+			dst->flags = 0; /* the copy owns its keys */
+			dst->u.o.size = src->u.o.size;
+			dst->u.o.m = (lept_member *)lept_malloc(a, dst->u.o.size * sizeof(lept_member));
+			for (i=0; i<dst->u.o.size; i++) {
+				len = dst->u.o.m[i].klen = src->u.o.m[i].klen;
+				memcpy(dst->u.o.m[i].k = (char*)lept_malloc(a, len+1), src->u.o.m[i].k, len);
+				dst->u.o.m[i].k[len] = '\0';
+				lept_init(&dst->u.o.m[i].v);
+				lept_copy_with(&dst->u.o.m[i].v, &src->u.o.m[i].v, a);
+			}
+			break;
+		default:
+			break;
+	}
+	dst->type = src->type;
+	if ((src->type == LEPT_ARRAY || src->type == LEPT_OBJECT) && (src->flags & LEPT_FLAG_HASHED))
+		lept_cache_hash(dst, lept_cached_hash(src)); /* keyed by the new block */
+}
+
+void lept_move(lept_value * dst, lept_value * src) {
+	assert(dst != NULL && src != NULL);
+	lept_free(dst);
+	memcpy(dst, src, sizeof(lept_value));
+	lept_init(src);
+}
+
+void lept_swap(lept_value *v1, lept_value * v2) {
+	assert(v1 != NULL && v2 != NULL);
+	if (v1 != v2) {
+		lept_value temp;
+		memcpy(&temp, v1, sizeof(lept_value));
+		memcpy(v1, v2, sizeof(lept_value));
+		memcpy(v2, &temp, sizeof(lept_value));
+	}
+}
+
+static size_t lept_hash_bytes(const char * s, size_t len) {
+	/* FNV-1a */
+	size_t i, h = 2166136261u;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t lept_hash_combine(size_t h, size_t x) {
+	return h ^ (x + 0x9E3779B9u + (h << 6) + (h >> 2));
 }
 
-const char* lept_get_object_key(const lept_value* v, size_t index) {
-    assert(v != NULL && v->type == LEPT_OBJECT);
-    assert(index < v->u.o.size);
-    return v->u.o.m[index].k;
+size_t lept_hash(const lept_value * v) {
+	lept_value * c = (lept_value *)v, t; /* only the cache is written */
+	size_t i, h, sum = 0;
+	double n;
+	assert(v != NULL);
+	switch (v->type) {
+		case LEPT_NUMBER:
+			n = v->u.n == 0.0 ? 0.0 : v->u.n; /* -0.0 == 0.0 */
+			return lept_hash_combine(LEPT_NUMBER, lept_hash_bytes((const char *)&n, sizeof(n)));
+		case LEPT_STRING:
+			return lept_hash_combine(LEPT_STRING, lept_hash_bytes(v->u.s.s, v->u.s.len));
+		case LEPT_ARRAY:
+			if (v->flags & LEPT_FLAG_HASHED)
+				return lept_cached_hash(v);
+			h = lept_hash_combine(LEPT_ARRAY, v->u.a.size);
+			for (i = 0; i < v->u.a.size; i++)
+				h = lept_hash_combine(h, lept_hash(lept_array_at(v, i, &t)));
+			lept_cache_hash(c, h);
+			return h;
+		case LEPT_OBJECT:
+			if (v->flags & LEPT_FLAG_HASHED)
+				return lept_cached_hash(v);
+			/* a sum of member hashes does not depend on their order */
+			for (i = 0; i < v->u.o.size; i++)
+				sum += lept_hash_combine(lept_hash_bytes(v->u.o.m[i].k, v->u.o.m[i].klen), lept_hash(&v->u.o.m[i].v)) * 0x01000193u;
+			h = lept_hash_combine(lept_hash_combine(LEPT_OBJECT, v->u.o.size), sum);
+			lept_cache_hash(c, h);
+			return h;
+		default:
+			return lept_hash_combine(v->type, 0);
+	}
 }
 
-size_t lept_get_object_key_length(const lept_value* v, size_t index) {
-    assert(v != NULL && v->type == LEPT_OBJECT);
-    assert(index < v->u.o.size);
-    return v->u.o.m[index].klen;
+void lept_invalidate_hash(lept_value * v) {
+	assert(v != NULL);
+	lept_uncache_hash(v);
 }
 
-lept_value* lept_get_object_value(const lept_value* v, size_t index) {
-    assert(v != NULL && v->type == LEPT_OBJECT);
-    assert(index < v->u.o.size);
-    return &v->u.o.m[index].v;
+/* Container edits used by the patch functions. Arrays and objects carry no
+ * spare capacity, so each edit resizes the parent block; children are moved
+ * with it, never copied. */
+
+static lept_value * lept_array_insert(lept_value * v, size_t index, const lept_allocator * a) {
+	size_t size = v->u.a.size;
+	assert(v->type == LEPT_ARRAY && index <= size);
+	lept_unpack_array_with(v, a);
+	lept_uncache_hash(v);
+	v->u.a.e = (lept_value *)lept_realloc(a, v->u.a.e, size * sizeof(lept_value), (size + 1) * sizeof(lept_value));
+	memmove(&v->u.a.e[index + 1], &v->u.a.e[index], (size - index) * sizeof(lept_value));
+	v->u.a.size++;
+	lept_init(&v->u.a.e[index]);
+	return &v->u.a.e[index];
 }
 
-#define LEPT_KEY_NOT_EXIST ((size_t) - 1)
+static void lept_array_erase(lept_value * v, size_t index, const lept_allocator * a) {
+	size_t size = v->u.a.size;
+	assert(v->type == LEPT_ARRAY && index < size);
+	lept_unpack_array_with(v, a);
+	lept_uncache_hash(v);
+	lept_free_with(&v->u.a.e[index], a);
+	memmove(&v->u.a.e[index], &v->u.a.e[index + 1], (size - index - 1) * sizeof(lept_value));
+	if (--v->u.a.size == 0) {
+		lept_mfree(a, v->u.a.e, size * sizeof(lept_value));
+		v->u.a.e = NULL;
+	}
+	else
+		v->u.a.e = (lept_value *)lept_realloc(a, v->u.a.e, size * sizeof(lept_value), (size - 1) * sizeof(lept_value));
+}
 
-size_t lept_find_object_index(const lept_value * v, const char * key, size_t klen) {
+static void lept_object_init(lept_value * v, const lept_allocator * a) {
+	lept_free_with(v, a);
+	v->type = LEPT_OBJECT;
+	v->flags = 0;
+	v->u.o.m = NULL;
+	v->u.o.size = 0;
+}
+
+/* Returns the value stored under key, adding a null member when it is new. */
+static lept_value * lept_object_set(lept_value * v, const char * key, size_t klen, const lept_allocator * a) {
+	size_t i, size = v->u.o.size;
+	lept_member * m;
+	assert(v->type == LEPT_OBJECT);
+	lept_uncache_hash(v); /* the caller is about to change a member */
+	if ((i = lept_find_object_index(v, key, klen)) != LEPT_KEY_NOT_EXIST)
+		return &v->u.o.m[i].v;
+	if (v->flags & LEPT_FLAG_SHARED_KEYS) {
+		/* an object owns all of its keys or none: take copies before adding one */
+		for (i = 0; i < size; i++) {
+			const char * k = v->u.o.m[i].k;
+			memcpy(v->u.o.m[i].k = (char *)lept_malloc(a, v->u.o.m[i].klen + 1), k, v->u.o.m[i].klen + 1);
+		}
+		v->flags &= ~LEPT_FLAG_SHARED_KEYS;
+	}
+	v->u.o.m = (lept_member *)lept_realloc(a, v->u.o.m, size * sizeof(lept_member), (size + 1) * sizeof(lept_member));
+	m = &v->u.o.m[v->u.o.size++];
+	memcpy(m->k = (char *)lept_malloc(a, klen + 1), key, klen);
+	m->k[klen] = '\0';
+	m->klen = klen;
+	lept_init(&m->v);
+	return &m->v;
+}
+
+static void lept_object_remove(lept_value * v, size_t index, const lept_allocator * a) {
+	size_t size = v->u.o.size;
+	lept_member * m = &v->u.o.m[index];
+	assert(v->type == LEPT_OBJECT && index < size);
+	lept_uncache_hash(v);
+	if (!(v->flags & LEPT_FLAG_SHARED_KEYS))
+		lept_mfree(a, m->k, m->klen + 1);
+	lept_free_with(&m->v, a);
+	memmove(m, m + 1, (size - index - 1) * sizeof(lept_member));
+	if (--v->u.o.size == 0) {
+		lept_mfree(a, v->u.o.m, size * sizeof(lept_member));
+		v->u.o.m = NULL;
+	}
+	else
+		v->u.o.m = (lept_member *)lept_realloc(a, v->u.o.m, size * sizeof(lept_member), (size - 1) * sizeof(lept_member));
+}
+
+void lept_merge_patch(lept_value * target, lept_value * patch) {
+	lept_merge_patch_with(target, patch, &lept_global_allocator);
+}
+
+void lept_merge_patch_with(lept_value * target, lept_value * patch, const lept_allocator * a) {
+	size_t i, index;
+	assert(target != NULL && patch != NULL && target != patch && a != NULL);
+	if (patch->type != LEPT_OBJECT) {
+		lept_free_with(target, a);
+		lept_move(target, patch);
+		return;
+	}
+	if (target->type != LEPT_OBJECT)
+		lept_object_init(target, a);
+	lept_uncache_hash(target);
+	for (i = 0; i < patch->u.o.size; i++) {
+		lept_member * m = &patch->u.o.m[i];
+		if (m->v.type == LEPT_NULL) {
+			if ((index = lept_find_object_index(target, m->k, m->klen)) != LEPT_KEY_NOT_EXIST)
+				lept_object_remove(target, index, a);
+		}
+		else
+			lept_merge_patch_with(lept_object_set(target, m->k, m->klen, a), &m->v, a);
+	}
+}
+
+/* Array index token: "0" or digits without a leading zero. "-" (one past the
+ * end) is left to the caller. */
+static int lept_pointer_index(const char * tok, size_t len, size_t * index) {
+	size_t i, n = 0;
+	if (len == 0 || (tok[0] == '0' && len > 1))
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (!ISDIGIT(tok[i]) || n > ((size_t)-1 - 9) / 10)
+			return 0;
+		n = n * 10 + (size_t)(tok[i] - '0');
+	}
+	*index = n;
+	return 1;
+}
+
+static lept_value * lept_pointer_child(lept_value * v, const char * tok, size_t len, const lept_allocator * a) {
+	size_t index;
+	if (v->type == LEPT_OBJECT)
+		return lept_find_object_value(v, tok, len);
+	if (v->type == LEPT_ARRAY && lept_pointer_index(tok, len, &index) && index < v->u.a.size) {
+		lept_unpack_array_with(v, a); /* the caller may change the element */
+		return &v->u.a.e[index];
+	}
+	return NULL;
+}
+
+/* Walks every reference token of the RFC 6901 pointer but the last, which is
+ * unescaped into tok (at least len bytes). *parent is NULL for "", which
+ * names the whole document. The containers passed on the way are about to
+ * change, so their cached hashes are dropped. */
+static int lept_pointer_parent(lept_value * doc, const char * path, size_t len, lept_value ** parent, char * tok, size_t * tlen, const lept_allocator * a) {
+	const char * p = path, * end = path + len;
+	lept_value * v = doc;
+	size_t n;
+	*parent = NULL;
+	lept_uncache_hash(v);
+	if (len == 0)
+		return LEPT_PATCH_OK;
+	if (*p != '/')
+		return LEPT_PATCH_INVALID_POINTER;
+	for (;;) {
+		for (n = 0, p++; p < end && *p != '/'; p++) {
+			if (*p == '~') {
+				if (++p == end || (*p != '0' && *p != '1'))
+					return LEPT_PATCH_INVALID_POINTER;
+				tok[n++] = *p == '0' ? '~' : '/';
+			}
+			else
+				tok[n++] = *p;
+		}
+		if (p == end) {
+			if (v->type == LEPT_ARRAY)
+				lept_unpack_array_with(v, a);
+			*parent = v;
+			*tlen = n;
+			return LEPT_PATCH_OK;
+		}
+		if ((v = lept_pointer_child(v, tok, n, a)) == NULL)
+			return LEPT_PATCH_PATH_NOT_FOUND;
+		lept_uncache_hash(v);
+	}
+}
+
+static int lept_pointer_get(lept_value * doc, const lept_value * path, char * tok, lept_value ** v, const lept_allocator * a) {
+	lept_value * parent;
+	size_t tlen;
+	int ret;
+	if ((ret = lept_pointer_parent(doc, path->u.s.s, path->u.s.len, &parent, tok, &tlen, a)) != LEPT_PATCH_OK)
+		return ret;
+	*v = parent ? lept_pointer_child(parent, tok, tlen, a) : doc;
+	return *v ? LEPT_PATCH_OK : LEPT_PATCH_PATH_NOT_FOUND;
+}
+
+/* "add": value is moved to path, replacing an existing member or shifting
+ * array elements up. */
+static int lept_patch_add(lept_value * doc, const lept_value * path, char * tok, lept_value * value, const lept_allocator * a) {
+	lept_value * parent, * slot;
+	size_t tlen, index;
+	int ret;
+	if ((ret = lept_pointer_parent(doc, path->u.s.s, path->u.s.len, &parent, tok, &tlen, a)) != LEPT_PATCH_OK)
+		return ret;
+	if (!parent)
+		slot = doc;
+	else if (parent->type == LEPT_OBJECT)
+		slot = lept_object_set(parent, tok, tlen, a);
+	else if (parent->type == LEPT_ARRAY) {
+		if (tlen == 1 && tok[0] == '-')
+			index = parent->u.a.size;
+		else if (!lept_pointer_index(tok, tlen, &index))
+			return LEPT_PATCH_INVALID_POINTER;
+		else if (index > parent->u.a.size)
+			return LEPT_PATCH_PATH_NOT_FOUND;
+		slot = lept_array_insert(parent, index, a);
+	}
+	else
+		return LEPT_PATCH_PATH_NOT_FOUND;
+	lept_free_with(slot, a);
+	lept_move(slot, value);
+	return LEPT_PATCH_OK;
+}
+
+/* "remove": the value at path is moved to out (if not NULL) and its slot
+ * deleted. */
+static int lept_patch_remove(lept_value * doc, const lept_value * path, char * tok, lept_value * out, const lept_allocator * a) {
+	lept_value * parent;
+	size_t tlen, index;
+	int ret;
+	if ((ret = lept_pointer_parent(doc, path->u.s.s, path->u.s.len, &parent, tok, &tlen, a)) != LEPT_PATCH_OK)
+		return ret;
+	if (!parent) {
+		if (out)
+			lept_move(out, doc);
+		else
+			lept_free_with(doc, a);
+		return LEPT_PATCH_OK;
+	}
+	if (parent->type == LEPT_OBJECT) {
+		if ((index = lept_find_object_index(parent, tok, tlen)) == LEPT_KEY_NOT_EXIST)
+			return LEPT_PATCH_PATH_NOT_FOUND;
+		if (out)
+			lept_move(out, &parent->u.o.m[index].v);
+		lept_object_remove(parent, index, a);
+	}
+	else if (parent->type == LEPT_ARRAY && lept_pointer_index(tok, tlen, &index) && index < parent->u.a.size) {
+		if (out)
+			lept_move(out, &parent->u.a.e[index]);
+		lept_array_erase(parent, index, a);
+	}
+	else
+		return LEPT_PATCH_PATH_NOT_FOUND;
+	return LEPT_PATCH_OK;
+}
+
+/* Checks one operation object and returns its members; value and from are
+ * NULL for operations that take none. */
+static int lept_patch_check(lept_value * op, const lept_value ** name, const lept_value ** path, lept_value ** value, const lept_value ** from) {
+	static const char * const names[] = { "add", "remove", "replace", "move", "copy", "test" };
 	size_t i;
-	assert(v!=NULL && v->type == LEPT_OBJECT);
-	for (i=0; i<v->u.o.size; i++) {
-		if (klen == v->u.o.m[i].klen && memcmp(v->u.o.m[i].k, key, klen) == 0)
-			return i;
+	const char * s;
+	if (op->type != LEPT_OBJECT)
+		return LEPT_PATCH_INVALID_OPERATION;
+	*name = lept_find_object_value(op, "op", 2);
+	*path = lept_find_object_value(op, "path", 4);
+	*value = lept_find_object_value(op, "value", 5);
+	*from = lept_find_object_value(op, "from", 4);
+	if (!*name || (*name)->type != LEPT_STRING || !*path || (*path)->type != LEPT_STRING)
+		return LEPT_PATCH_INVALID_OPERATION;
+	s = (*name)->u.s.s;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if ((*name)->u.s.len == strlen(names[i]) && memcmp(s, names[i], (*name)->u.s.len) == 0)
+			break;
+	switch (i) {
+		case 0: case 2: case 5: /* add, replace, test */
+			*from = NULL;
+			return *value ? LEPT_PATCH_OK : LEPT_PATCH_INVALID_OPERATION;
+		case 1: /* remove */
+			*value = NULL;
+			*from = NULL;
+			return LEPT_PATCH_OK;
+		case 3: case 4: /* move, copy */
+			*value = NULL;
+			return *from && (*from)->type == LEPT_STRING ? LEPT_PATCH_OK : LEPT_PATCH_INVALID_OPERATION;
+		default:
+			return LEPT_PATCH_INVALID_OPERATION;
 	}
-	return LEPT_KEY_NOT_EXIST;
 }
 
-lept_value * lept_find_object_value(const lept_value * v, const char * key, size_t klen) {
-	size_t index = lept_find_object_index(v, key, klen);
-	return index == LEPT_KEY_NOT_EXIST ? NULL : &v->u.o.m[index].v;
+static int lept_patch_apply(lept_value * doc, lept_value * op, char * tok, const lept_allocator * a) {
+	const lept_value * name = NULL, * path = NULL, * from = NULL;
+	lept_value * value = NULL, * v, temp;
+	int ret;
+	/* lept_patch() has checked every operation already */
+	if ((ret = lept_patch_check(op, &name, &path, &value, &from)) != LEPT_PATCH_OK)
+		return ret;
+	lept_init(&temp);
+	switch (name->u.s.s[0]) {
+		case 'a':
+			return lept_patch_add(doc, path, tok, value, a);
+		case 'r':
+			if (name->u.s.s[2] == 'm')
+				return lept_patch_remove(doc, path, tok, NULL, a);
+			if ((ret = lept_pointer_get(doc, path, tok, &v, a)) == LEPT_PATCH_OK) {
+				lept_free_with(v, a);
+				lept_move(v, value);
+			}
+			return ret;
+		case 't':
+			if ((ret = lept_pointer_get(doc, path, tok, &v, a)) == LEPT_PATCH_OK && !lept_is_equal(v, value))
+				ret = LEPT_PATCH_TEST_FAILED;
+			return ret;
+		case 'c':
+			if ((ret = lept_pointer_get(doc, from, tok, &v, a)) != LEPT_PATCH_OK)
+				return ret;
+			lept_copy_with(&temp, v, a);
+			break;
+		default: /* move */
+			/* a value cannot be moved into one of its own children */
+			if (path->u.s.len > from->u.s.len && memcmp(path->u.s.s, from->u.s.s, from->u.s.len) == 0 && path->u.s.s[from->u.s.len] == '/')
+				return LEPT_PATCH_INVALID_POINTER;
+			if ((ret = lept_patch_remove(doc, from, tok, &temp, a)) != LEPT_PATCH_OK)
+				return ret;
+	}
+	ret = lept_patch_add(doc, path, tok, &temp, a);
+	lept_free_with(&temp, a);
+	return ret;
+}
+
+int lept_patch(lept_value * doc, lept_value * patch) {
+	return lept_patch_with(doc, patch, &lept_global_allocator);
+}
+
+int lept_patch_with(lept_value * doc, lept_value * patch, const lept_allocator * a) {
+	const lept_value * name, * path, * from;
+	lept_value * value;
+	size_t i, max = 0;
+	char * tok;
+	int ret = LEPT_PATCH_OK;
+	assert(doc != NULL && patch != NULL && doc != patch && a != NULL);
+	if (patch->type != LEPT_ARRAY)
+		return LEPT_PATCH_INVALID_OPERATION;
+	/* check the whole patch first, and size the token buffer for its longest pointer */
+	for (i = 0; i < patch->u.a.size; i++) {
+		if ((ret = lept_patch_check(&patch->u.a.e[i], &name, &path, &value, &from)) != LEPT_PATCH_OK)
+			return ret;
+		if (path->u.s.len > max)
+			max = path->u.s.len;
+		if (from && from->u.s.len > max)
+			max = from->u.s.len;
+	}
+	tok = (char *)lept_malloc(a, max + 1);
+	for (i = 0; i < patch->u.a.size && ret == LEPT_PATCH_OK; i++)
+		ret = lept_patch_apply(doc, &patch->u.a.e[i], tok, a);
+	lept_mfree(a, tok, max + 1);
+	return ret;
+}
+
+#ifndef LEPT_DIFF_LINEAR_KEYS
+#define LEPT_DIFF_LINEAR_KEYS 8
+#endif
+
+typedef struct {
+	lept_context path; /* JSON Pointer of the pair being compared */
+	lept_context ops;  /* lept_value operations, when they are recorded */
+	size_t count;
+	unsigned flags;
+	int record;
+} lept_diff_context;
+
+static void lept_diff_key(lept_context * c, const char * k, size_t klen) {
+	size_t i;
+	PUTC(c, '/');
+	for (i = 0; i < klen; i++) {
+		if (k[i] == '~')
+			PUTS(c, "~0", 2);
+		else if (k[i] == '/')
+			PUTS(c, "~1", 2);
+		else
+			PUTC(c, k[i]);
+	}
+}
+
+static void lept_diff_index(lept_context * c, size_t index) {
+	c->top -= 32 - sprintf((char *)lept_context_push(c, 32), "/%lu", (unsigned long)index);
+}
+
+/* Records one operation at the current path; returns non-zero when the diff
+ * should stop there. */
+static int lept_diff_op(lept_diff_context * d, const char * op, const lept_value * value) {
+	lept_value * o;
+	d->count++;
+	if (d->record) {
+		o = (lept_value *)lept_context_push(&d->ops, sizeof(lept_value));
+		lept_init(o);
+		lept_object_init(o, &lept_global_allocator);
+		lept_set_string(lept_object_set(o, "op", 2, &lept_global_allocator), op, strlen(op));
+		lept_set_string(lept_object_set(o, "path", 4, &lept_global_allocator), d->path.stack, d->path.top);
+		if (value)
+			lept_copy(lept_object_set(o, "value", 5, &lept_global_allocator), value);
+	}
+	return d->flags & LEPT_DIFF_FIRST;
+}
+
+static int lept_diff_value(lept_diff_context * d, const lept_value * a, const lept_value * b);
+
+/* Non-zero when a and b are taken to be the same. lept_diff() has hashed
+ * both sides, so non-empty containers compare by cached hash, type and size
+ * alone: a hash collision is the only way to miss a change there. */
+static int lept_diff_same(const lept_value * a, const lept_value * b) {
+	if (a->flags & b->flags & LEPT_FLAG_HASHED)
+		return a->type == b->type && a->u.a.size == b->u.a.size && lept_cached_hash(a) == lept_cached_hash(b);
+	return lept_is_equal(a, b);
+}
+
+static int lept_diff_array(lept_diff_context * d, const lept_value * a, const lept_value * b) {
+	size_t lo = 0, na = a->u.a.size, nb = b->u.a.size, m, i, top = d->path.top;
+	lept_value ta, tb;
+	int stop = 0;
+	/* skip the common ends, so an insertion or deletion is one operation
+	 * instead of a replace of every element after it */
+	while (lo < na && lo < nb && lept_diff_same(lept_array_at(a, lo, &ta), lept_array_at(b, lo, &tb)))
+		lo++;
+	while (na > lo && nb > lo && lept_diff_same(lept_array_at(a, na - 1, &ta), lept_array_at(b, nb - 1, &tb))) {
+		na--;
+		nb--;
+	}
+	m = na < nb ? na : nb;
+	for (i = lo; i < m && !stop; i++) {
+		lept_diff_index(&d->path, i);
+		stop = lept_diff_value(d, lept_array_at(a, i, &ta), lept_array_at(b, i, &tb));
+		d->path.top = top;
+	}
+	/* removals from the back keep the lower indices valid */
+	for (i = na; i > m && !stop; i--) {
+		lept_diff_index(&d->path, i - 1);
+		stop = lept_diff_op(d, "remove", NULL);
+		d->path.top = top;
+	}
+	for (i = m; i < nb && !stop; i++) {
+		lept_diff_index(&d->path, i);
+		stop = lept_diff_op(d, "add", lept_array_at(b, i, &tb));
+		d->path.top = top;
+	}
+	return stop;
+}
+
+static int lept_diff_object(lept_diff_context * d, const lept_value * a, const lept_value * b) {
+	size_t i, j, h, n = b->u.o.size, cap = 0, top = d->path.top;
+	size_t * slots = NULL;
+	unsigned char * seen;
+	int stop = 0;
+	if (n == 0 && a->u.o.size == 0)
+		return 0;
+	/* b's keys go into an open-addressing index (slot holds member + 1) once
+	 * linear lookups would make the match quadratic; seen marks matched members */
+	if (n > LEPT_DIFF_LINEAR_KEYS)
+		for (cap = 16; cap < n * 2; cap <<= 1);
+	slots = (size_t *)lept_malloc(&lept_global_allocator, cap * sizeof(size_t) + n + 1);
+	seen = (unsigned char *)(slots + cap);
+	memset(slots, 0, cap * sizeof(size_t) + n);
+	for (j = 0; j < n && cap; j++) {
+		for (h = lept_hash_bytes(b->u.o.m[j].k, b->u.o.m[j].klen) & (cap - 1); slots[h]; h = (h + 1) & (cap - 1));
+		slots[h] = j + 1;
+	}
+	for (i = 0; i < a->u.o.size && !stop; i++) {
+		const lept_member * m = &a->u.o.m[i];
+		if (cap) {
+			for (h = lept_hash_bytes(m->k, m->klen) & (cap - 1); (j = slots[h]) != 0; h = (h + 1) & (cap - 1))
+				if (b->u.o.m[j - 1].klen == m->klen && memcmp(b->u.o.m[j - 1].k, m->k, m->klen) == 0)
+					break;
+			j = j ? j - 1 : LEPT_KEY_NOT_EXIST;
+		}
+		else
+			j = lept_find_object_index(b, m->k, m->klen);
+		lept_diff_key(&d->path, m->k, m->klen);
+		if (j == LEPT_KEY_NOT_EXIST)
+			stop = lept_diff_op(d, "remove", NULL);
+		else {
+			seen[j] = 1;
+			stop = lept_diff_value(d, &m->v, &b->u.o.m[j].v);
+		}
+		d->path.top = top;
+	}
+	for (j = 0; j < n && !stop; j++) {
+		if (!seen[j]) {
+			lept_diff_key(&d->path, b->u.o.m[j].k, b->u.o.m[j].klen);
+			stop = lept_diff_op(d, "add", &b->u.o.m[j].v);
+			d->path.top = top;
+		}
+	}
+	lept_mfree(&lept_global_allocator, slots, cap * sizeof(size_t) + n + 1);
+	return stop;
+}
+
+static int lept_diff_value(lept_diff_context * d, const lept_value * a, const lept_value * b) {
+	/* identical subtrees are skipped whole, different ones go straight to
+	 * the structural diff */
+	if ((a->flags & b->flags & LEPT_FLAG_HASHED) && lept_diff_same(a, b))
+		return 0;
+	if (a->type == b->type && a->type == LEPT_ARRAY)
+		return lept_diff_array(d, a, b);
+	if (a->type == b->type && a->type == LEPT_OBJECT)
+		return lept_diff_object(d, a, b);
+	return lept_is_equal(a, b) ? 0 : lept_diff_op(d, "replace", b);
+}
+
+size_t lept_diff(const lept_value * from, const lept_value * to, lept_value * patch, unsigned flags) {
+	lept_diff_context d;
+	size_t size;
+	assert(from != NULL && to != NULL && patch != from && patch != to);
+	d.path.stack = d.ops.stack = NULL;
+	d.path.size = d.path.top = d.ops.size = d.ops.top = 0;
+	d.path.alloc = d.ops.alloc = &lept_global_allocator;
+	d.count = 0;
+	d.flags = flags;
+	d.record = patch != NULL;
+	lept_hash(from);
+	lept_hash(to);
+	lept_diff_value(&d, from, to);
+	if (patch) {
+		lept_free(patch);
+		size = d.ops.top;
+		patch->type = LEPT_ARRAY;
+		patch->u.a.size = d.count;
+		patch->u.a.e = NULL;
+		if (size)
+			memcpy(patch->u.a.e = (lept_value *)lept_malloc(&lept_global_allocator, size), lept_context_pop(&d.ops, size), size);
+	}
+	lept_mfree(&lept_global_allocator, d.path.stack, d.path.size);
+	lept_mfree(&lept_global_allocator, d.ops.stack, d.ops.size);
+	return d.count;
+}
+
+void lept_intern_init(lept_intern * t) {
+	lept_intern_init_with(t, &lept_global_allocator);
+}
+
+void lept_intern_init_with(lept_intern * t, const lept_allocator * a) {
+	assert(t != NULL && a != NULL);
+	t->slots = NULL;
+	t->size = t->capacity = 0;
+	t->alloc = a;
+}
+
+void lept_intern_free(lept_intern * t) {
+	size_t i;
+	assert(t != NULL);
+	for (i = 0; i < t->capacity; i++) {
+		if (t->slots[i].k)
+			lept_mfree(t->alloc, t->slots[i].k, t->slots[i].klen + 1);
+	}
+	lept_mfree(t->alloc, t->slots, t->capacity * sizeof(lept_intern_slot));
+	t->slots = NULL;
+	t->size = t->capacity = 0;
+}
+
+static void lept_intern_grow(lept_intern * t) {
+	size_t i, j, capacity = t->capacity ? t->capacity * 2 : LEPT_INTERN_INIT_CAPACITY;
+	lept_intern_slot * slots = (lept_intern_slot*)lept_malloc(t->alloc, capacity * sizeof(lept_intern_slot));
+	memset(slots, 0, capacity * sizeof(lept_intern_slot));
+	for (i = 0; i < t->capacity; i++) {
+		if (!t->slots[i].k)
+			continue;
+		for (j = t->slots[i].hash & (capacity - 1); slots[j].k; j = (j + 1) & (capacity - 1));
+		slots[j] = t->slots[i];
+	}
+	lept_mfree(t->alloc, t->slots, t->capacity * sizeof(lept_intern_slot));
+	t->slots = slots;
+	t->capacity = capacity;
+}
+
+const char * lept_intern_key(lept_intern * t, const char * key, size_t klen) {
+	size_t i, h;
+	lept_intern_slot * slot;
+	assert(t != NULL && (key != NULL || klen == 0));
+	if ((t->size + 1) * 4 > t->capacity * 3) /* keep load factor under 3/4 */
+		lept_intern_grow(t);
+	h = lept_hash_bytes(key, klen);
+	for (i = h & (t->capacity - 1); (slot = &t->slots[i])->k; i = (i + 1) & (t->capacity - 1)) {
+		if (slot->hash == h && slot->klen == klen && memcmp(slot->k, key, klen) == 0)
+			return slot->k;
+	}
+	memcpy(slot->k = (char*)lept_malloc(t->alloc, klen + 1), key, klen);
+	slot->k[klen] = '\0';
+	slot->klen = klen;
+	slot->hash = h;
+	t->size++;
+	return slot->k;
+}
+
+/* Tape words are pushed onto c->stack as they are parsed; string scratch goes
+ * above them and is popped before the next word, so at the end the stack is
+ * the tape. Decoded strings are appended to s. */
+
+#define LEPT_TAPE_WORDS(c) ((lept_tape_word*)(c)->stack)
+#define LEPT_TAPE_MAGIC 0x4C545031u /* "LTP1" */
+
+static void lept_tape_put(lept_context * c, unsigned tag, size_t arg) {
+	lept_tape_word * w = (lept_tape_word*)lept_context_push(c, sizeof(lept_tape_word));
+	assert(arg <= UINT_MAX);
+	w->w.tag = tag;
+	w->w.arg = (unsigned)arg;
+}
+
+static const char * lept_tape_chars(const char * strings, unsigned offset, size_t * len) {
+	unsigned n;
+	memcpy(&n, strings + offset, sizeof(unsigned));
+	*len = n;
+	return strings + offset + sizeof(unsigned);
+}
+
+static int lept_tape_string(lept_context * c, lept_context * s) {
+	size_t len, offset = s->top;
+	unsigned n;
+	char * str, * p;
+	int ret;
+	if ((ret = lept_parse_string_raw(c, &str, &len)) != LEPT_PARSE_OK)
+		return ret;
+	assert(len <= UINT_MAX);
+	n = (unsigned)len;
+	p = (char*)lept_context_push(s, (int)(sizeof(unsigned) + len + 1));
+	memcpy(p, &n, sizeof(unsigned));
+	if (len)
+		memcpy(p + sizeof(unsigned), str, len);
+	p[sizeof(unsigned) + len] = '\0';
+	lept_tape_put(c, LEPT_STRING, offset); /* str is gone after this */
+	return LEPT_PARSE_OK;
+}
+
+static void lept_tape_close(lept_context * c, size_t start, unsigned type, size_t size) {
+	lept_tape_put(c, LEPT_TAPE_END | type, size);
+	LEPT_TAPE_WORDS(c)[start].w.arg = (unsigned)(c->top / sizeof(lept_tape_word) - 1);
+}
+
+static int lept_tape_value(lept_context * c, lept_context * s);
+
+static int lept_tape_array(lept_context * c, lept_context * s) {
+	size_t start = c->top / sizeof(lept_tape_word), size = 0;
+	int ret;
+	EXPECT(c, '[');
+	lept_tape_put(c, LEPT_ARRAY, 0);
+	lept_parse_whitespace(c);
+	if (*c->json != ']') {
+		for (;;) {
+			if ((ret = lept_tape_value(c, s)) != LEPT_PARSE_OK) {
+				if (c->error)
+					lept_error_path_index(c, size);
+				return ret;
+			}
+			size++;
+			lept_parse_whitespace(c);
+			if (*c->json == ',') {
+				c->json++;
+				lept_parse_whitespace(c);
+			} else if (*c->json == ']')
+				break;
+			else
+				return LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+		}
+	}
+	c->json++;
+	lept_tape_close(c, start, LEPT_ARRAY, size);
+	return LEPT_PARSE_OK;
+}
+
+static int lept_tape_object(lept_context * c, lept_context * s) {
+	size_t start = c->top / sizeof(lept_tape_word), size = 0, key, klen;
+	const char * k;
+	int ret;
+	EXPECT(c, '{');
+	lept_tape_put(c, LEPT_OBJECT, 0);
+	lept_parse_whitespace(c);
+	if (*c->json != '}') {
+		for (;;) {
+			if (*c->json != '\"')
+				return LEPT_PARSE_MISS_KEY;
+			key = c->top / sizeof(lept_tape_word);
+			if ((ret = lept_tape_string(c, s)) != LEPT_PARSE_OK)
+				return ret;
+			lept_parse_whitespace(c);
+			if (*c->json != ':')
+				return LEPT_PARSE_MISS_COLON;
+			c->json++;
+			lept_parse_whitespace(c);
+			if ((ret = lept_tape_value(c, s)) != LEPT_PARSE_OK) {
+				if (c->error) {
+					k = lept_tape_chars(s->stack, LEPT_TAPE_WORDS(c)[key].w.arg, &klen);
+					lept_error_path_key(c, k, klen);
+				}
+				return ret;
+			}
+			size++;
+			lept_parse_whitespace(c);
+			if (*c->json == ',') {
+				c->json++;
+				lept_parse_whitespace(c);
+			} else if (*c->json == '}')
+				break;
+			else
+				return LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+		}
+	}
+	c->json++;
+	lept_tape_close(c, start, LEPT_OBJECT, size);
+	return LEPT_PARSE_OK;
+}
+
+static int lept_tape_value(lept_context * c, lept_context * s) {
+	lept_value v;
+	int ret;
+	switch (*c->json) {
+		case '\"':
+			return lept_tape_string(c, s);
+		case '[':
+			return lept_tape_array(c, s);
+		case '{':
+			return lept_tape_object(c, s);
+	}
+	/* the rest does not allocate */
+	lept_init(&v);
+	if ((ret = lept_parse_value(&v, c)) != LEPT_PARSE_OK)
+		return ret;
+	lept_tape_put(c, v.type, 0);
+	if (v.type == LEPT_NUMBER)
+		((lept_tape_word*)lept_context_push(c, sizeof(lept_tape_word)))->n = v.u.n;
+	return LEPT_PARSE_OK;
+}
+
+void lept_tape_init(lept_tape * t) {
+	assert(t != NULL);
+	t->words = NULL;
+	t->strings = NULL;
+	t->nwords = t->nstrings = 0;
+	t->alloc = &lept_global_allocator;
+}
+
+void lept_tape_free(lept_tape * t) {
+	assert(t != NULL);
+	lept_mfree(t->alloc, t->words, t->nwords * sizeof(lept_tape_word));
+	lept_mfree(t->alloc, t->strings, t->nstrings);
+	lept_tape_init(t);
+}
+
+int lept_parse_tape(lept_tape * t, const char * json, const lept_parse_options * opt) {
+	lept_context c, s;
+	int ret;
+	assert(t != NULL);
+	c.json = json;
+	c.top = c.size = 0;
+	c.stack = NULL;
+	c.keys = NULL;
+	c.alloc = opt && opt->alloc ? opt->alloc : &lept_global_allocator;
+	c.error = opt ? opt->error : NULL;
+	c.flags = opt ? opt->flags : 0;
+	c.path_head = LEPT_ERROR_PATH_SIZE - 1;
+	c.path_cut = 0;
+	c.keep = NULL;
+	c.nkeep = 0;
+	LEPT_TRACE_INIT(&c, NULL);
+	s.top = s.size = 0;
+	s.stack = NULL;
+	s.alloc = c.alloc;
+	lept_tape_init(t);
+	lept_parse_whitespace(&c);
+	if ((ret = lept_tape_value(&c, &s)) == LEPT_PARSE_OK) {
+		lept_parse_whitespace(&c);
+		if (*c.json != '\0')
+			ret = LEPT_PARSE_NOT_SINGLE;
+	}
+	if (c.error) {
+		c.error->code = ret;
+		if (ret != LEPT_PARSE_OK)
+			lept_error_locate(&c, json, (size_t)(c.json - json));
+	}
+	if (ret != LEPT_PARSE_OK) {
+		lept_mfree(c.alloc, c.stack, c.size);
+		lept_mfree(s.alloc, s.stack, s.size);
+		return ret;
+	}
+	/* both buffers are trimmed to size and kept */
+	t->alloc = c.alloc;
+	t->nwords = c.top / sizeof(lept_tape_word);
+	t->words = (lept_tape_word*)lept_realloc(c.alloc, c.stack, c.size, c.top);
+	if (s.top) {
+		t->nstrings = s.top;
+		t->strings = (char*)lept_realloc(s.alloc, s.stack, s.size, s.top);
+	}
+	return LEPT_PARSE_OK;
+}
+
+char * lept_tape_save(const lept_tape * t, size_t * length) {
+	unsigned head[4];
+	size_t words, size;
+	char * p;
+	assert(t != NULL && t->nwords <= UINT_MAX && t->nstrings <= UINT_MAX);
+	head[0] = LEPT_TAPE_MAGIC; /* also tells the byte order */
+	head[1] = sizeof(lept_tape_word);
+	head[2] = (unsigned)t->nwords;
+	head[3] = (unsigned)t->nstrings;
+	words = t->nwords * sizeof(lept_tape_word);
+	size = sizeof(head) + words + t->nstrings;
+	p = (char*)lept_malloc(&lept_global_allocator, size);
+	memcpy(p, head, sizeof(head));
+	if (words)
+		memcpy(p + sizeof(head), t->words, words);
+	if (t->nstrings)
+		memcpy(p + sizeof(head) + words, t->strings, t->nstrings);
+	lept_alloc_handoff(&lept_global_allocator, size);
+	if (length)
+		*length = size;
+	return p;
+}
+
+/* One pass over the words with the open containers on a stack, so that a
+ * cursor can never step outside the buffers. Each stack entry saves the
+ * enclosing end index and how many children it had seen. */
+static int lept_tape_check(const lept_tape * t) {
+	lept_context c;
+	size_t i = 0, end = t->nwords, count = 0, len, off, * saved;
+	unsigned tag;
+	int ok = 1;
+	c.stack = NULL;
+	c.size = c.top = 0;
+	c.alloc = t->alloc;
+	while (ok && i < t->nwords) {
+		if (i == end) { /* the tag was checked when the container opened */
+			if (t->words[i].w.tag == (LEPT_TAPE_END | LEPT_OBJECT)) {
+				ok = count % 2 == 0 && t->words[i].w.arg == count / 2;
+			} else
+				ok = t->words[i].w.arg == count;
+			saved = (size_t*)lept_context_pop(&c, 2 * sizeof(size_t));
+			end = saved[0];
+			count = saved[1];
+			i++;
+			continue;
+		}
+		if (c.top == 0 && count == 1) /* a second root */
+			break;
+		tag = t->words[i].w.tag;
+		if (c.top && t->words[end].w.tag == (LEPT_TAPE_END | LEPT_OBJECT) && count % 2 == 0 && tag != LEPT_STRING)
+			break; /* not a key */
+		count++;
+		switch (tag) {
+			case LEPT_NULL:
+			case LEPT_TRUE:
+			case LEPT_FALSE:
+				i++;
+				break;
+			case LEPT_NUMBER:
+				ok = i + 1 < end;
+				i += 2;
+				break;
+			case LEPT_STRING:
+				off = t->words[i].w.arg;
+				if (t->nstrings <= sizeof(unsigned) || off >= t->nstrings - sizeof(unsigned)) {
+					ok = 0;
+					break;
+				}
+				lept_tape_chars(t->strings, (unsigned)off, &len);
+				ok = len < t->nstrings - off - sizeof(unsigned) && t->strings[off + sizeof(unsigned) + len] == '\0';
+				i++;
+				break;
+			case LEPT_ARRAY:
+			case LEPT_OBJECT:
+				if (t->words[i].w.arg <= i || t->words[i].w.arg >= end || t->words[t->words[i].w.arg].w.tag != (LEPT_TAPE_END | tag)) {
+					ok = 0;
+					break;
+				}
+				saved = (size_t*)lept_context_push(&c, 2 * sizeof(size_t));
+				saved[0] = end;
+				saved[1] = count;
+				end = t->words[i].w.arg;
+				count = 0;
+				i++;
+				break;
+			default:
+				ok = 0;
+		}
+	}
+	ok = ok && i == t->nwords && c.top == 0 && count == 1;
+	lept_mfree(c.alloc, c.stack, c.size);
+	return ok;
+}
+
+int lept_tape_load(lept_tape * t, const char * data, size_t length) {
+	unsigned head[4];
+	size_t words;
+	assert(t != NULL && (data != NULL || length == 0));
+	lept_tape_init(t);
+	if (length < sizeof(head))
+		return LEPT_PARSE_INVALID_VALUE;
+	memcpy(head, data, sizeof(head));
+	if (head[0] != LEPT_TAPE_MAGIC || head[1] != sizeof(lept_tape_word) || head[2] > length / sizeof(lept_tape_word))
+		return LEPT_PARSE_INVALID_VALUE;
+	words = head[2] * sizeof(lept_tape_word);
+	if (length - sizeof(head) < words || length - sizeof(head) - words != head[3])
+		return LEPT_PARSE_INVALID_VALUE;
+	t->nwords = head[2];
+	t->nstrings = head[3];
+	if (words)
+		memcpy(t->words = (lept_tape_word*)lept_malloc(t->alloc, words), data + sizeof(head), words);
+	if (t->nstrings)
+		memcpy(t->strings = (char*)lept_malloc(t->alloc, t->nstrings), data + sizeof(head) + words, t->nstrings);
+	if (!lept_tape_check(t)) {
+		lept_tape_free(t);
+		return LEPT_PARSE_INVALID_VALUE;
+	}
+	return LEPT_PARSE_OK;
+}
+
+#define LEPT_CURSOR_WORD(it) ((it)->tape->words[(it)->pos])
+
+void lept_tape_cursor(const lept_tape * t, lept_cursor * it) {
+	assert(t != NULL && t->nwords > 0 && it != NULL);
+	it->tape = t;
+	it->pos = 0;
+	it->end = t->nwords;
+}
+
+static int lept_cursor_in_object(const lept_cursor * it) {
+	return it->end < it->tape->nwords && it->tape->words[it->end].w.tag == (LEPT_TAPE_END | LEPT_OBJECT);
+}
+
+lept_type lept_cursor_get_type(const lept_cursor * it) {
+	assert(it != NULL);
+	return (lept_type)LEPT_CURSOR_WORD(it).w.tag;
+}
+
+double lept_cursor_get_number(const lept_cursor * it) {
+	assert(it != NULL && LEPT_CURSOR_WORD(it).w.tag == LEPT_NUMBER);
+	return it->tape->words[it->pos + 1].n;
+}
+
+const char * lept_cursor_get_string(const lept_cursor * it) {
+	size_t len;
+	assert(it != NULL && LEPT_CURSOR_WORD(it).w.tag == LEPT_STRING);
+	return lept_tape_chars(it->tape->strings, LEPT_CURSOR_WORD(it).w.arg, &len);
+}
+
+size_t lept_cursor_get_string_length(const lept_cursor * it) {
+	size_t len;
+	assert(it != NULL && LEPT_CURSOR_WORD(it).w.tag == LEPT_STRING);
+	lept_tape_chars(it->tape->strings, LEPT_CURSOR_WORD(it).w.arg, &len);
+	return len;
+}
+
+size_t lept_cursor_get_size(const lept_cursor * it) {
+	assert(it != NULL && (LEPT_CURSOR_WORD(it).w.tag == LEPT_ARRAY || LEPT_CURSOR_WORD(it).w.tag == LEPT_OBJECT));
+	return it->tape->words[LEPT_CURSOR_WORD(it).w.arg].w.arg;
+}
+
+const char * lept_cursor_get_key(const lept_cursor * it) {
+	size_t len;
+	assert(it != NULL && lept_cursor_in_object(it));
+	return lept_tape_chars(it->tape->strings, it->tape->words[it->pos - 1].w.arg, &len);
+}
+
+size_t lept_cursor_get_key_length(const lept_cursor * it) {
+	size_t len;
+	assert(it != NULL && lept_cursor_in_object(it));
+	lept_tape_chars(it->tape->strings, it->tape->words[it->pos - 1].w.arg, &len);
+	return len;
+}
+
+int lept_cursor_child(lept_cursor * it) {
+	unsigned tag;
+	assert(it != NULL);
+	tag = LEPT_CURSOR_WORD(it).w.tag;
+	assert(tag == LEPT_ARRAY || tag == LEPT_OBJECT);
+	if (LEPT_CURSOR_WORD(it).w.arg == it->pos + 1)
+		return 0;
+	it->end = LEPT_CURSOR_WORD(it).w.arg;
+	it->pos += tag == LEPT_OBJECT ? 2 : 1;
+	return 1;
 }
 
-int lept_is_equal(const lept_value * v1, const lept_value * v2) {
-	size_t i;
-	lept_value * temp;
-	assert(v1 != NULL && v2 != NULL);
-	if (v1->type != v2->type)
-		return 0;
-	switch (v1->type) {
-		case LEPT_NUMBER:
-			return v1->u.n == v2->u.n;
-		case LEPT_STRING:
-			return v1->u.s.len == v2->u.s.len && memcmp(v1->u.s.s, v2->u.s.s, v1->u.s.len) == 0;
+int lept_cursor_next(lept_cursor * it) {
+	size_t next;
+	assert(it != NULL);
+	switch (LEPT_CURSOR_WORD(it).w.tag) {
 		case LEPT_ARRAY:
-			if (v1->u.a.size != v2->u.a.size) return 0;
-			for (i=0; i<v1->u.a.size; i++) {
-				if (!lept_is_equal(&v1->u.a.e[i], &v2->u.a.e[i]))
-					return 0;
-			}
-			return 1;
 		case LEPT_OBJECT:
-			if (v1->u.o.size != v2->u.o.size) return 0;
-			for (i=0; i<v1->u.o.size; i++) {
-				temp = lept_find_object_value(v2, v1->u.o.m[i].k, v1->u.o.m[i].klen);
-				if (!lept_is_equal(&v1->u.o.m[i].v, temp))
-					return 0;
-			}
-			return 1;
+			next = LEPT_CURSOR_WORD(it).w.arg + 1; /* the whole subtree at once */
+			break;
+		case LEPT_NUMBER:
+			next = it->pos + 2;
+			break;
 		default:
-			return 1;
+			next = it->pos + 1;
 	}
+	if (next >= it->end)
+		return 0;
+	it->pos = next + lept_cursor_in_object(it);
+	return 1;
 }
 
-void lept_copy(lept_value * dst, const lept_value * src) {
-	size_t i, len;
-	assert(src != NULL && dst != NULL && src != dst);
-	lept_free(dst);
-	dst->type = src->type;
-	switch (src->type) {
+int lept_cursor_find(lept_cursor * it, const char * key, size_t klen) {
+	lept_cursor m = *it;
+	size_t len;
+	const char * k;
+	assert(LEPT_CURSOR_WORD(it).w.tag == LEPT_OBJECT);
+	if (lept_cursor_child(&m)) {
+		do {
+			k = lept_tape_chars(m.tape->strings, m.tape->words[m.pos - 1].w.arg, &len);
+			if (len == klen && memcmp(k, key, klen) == 0) {
+				*it = m;
+				return 1;
+			}
+		} while (lept_cursor_next(&m));
+	}
+	return 0;
+}
+
+void lept_cursor_get_value(const lept_cursor * it, lept_value * v) {
+	lept_cursor_get_value_with(it, v, &lept_global_allocator);
+}
+
+void lept_cursor_get_value_with(const lept_cursor * it, lept_value * v, const lept_allocator * a) {
+	lept_cursor e = *it;
+	size_t i = 0, size;
+	assert(it != NULL && v != NULL && a != NULL);
+	lept_free_with(v, a);
+	switch (lept_cursor_get_type(it)) {
 		case LEPT_NUMBER:
-			dst->u.n = src->u.n;
+			v->u.n = lept_cursor_get_number(it);
 			break;
 		case LEPT_STRING:
-			lept_set_string(dst, src->u.s.s, src->u.s.len);
+			lept_set_string_with(v, lept_cursor_get_string(it), lept_cursor_get_string_length(it), a);
+			break;
 		case LEPT_ARRAY:
-			dst->u.a.size = src->u.a.size;
-			dst->u.a.e = (lept_value *)malloc(dst->u.a.size * sizeof(lept_value));
-			for (i=0; i<dst->u.a.size; i++) {
-				lept_copy(&dst->u.a.e[i], &src->u.a.e[i]);
+			size = v->u.a.size = lept_cursor_get_size(it);
+			v->u.a.e = (lept_value*)lept_malloc(a, size * sizeof(lept_value));
+			if (lept_cursor_child(&e)) {
+				do {
+					lept_init(&v->u.a.e[i]);
+					lept_cursor_get_value_with(&e, &v->u.a.e[i++], a);
+				} while (lept_cursor_next(&e));
 			}
 			break;
 		case LEPT_OBJECT:
-			dst->u.o.size = src->u.o.size;
-			dst->u.o.m = (lept_member *)malloc(dst->u.o.size * sizeof(lept_member));
-			for (i=0; i<dst->u.o.size; i++) {
-				len = dst->u.o.m[i].klen = src->u.o.m[i].klen;
-				memcpy(dst->u.o.m[i].k = malloc(len+1), src->u.o.m[i].k, len);
-				dst->u.o.m[i].k[len] = '\0';
-				lept_copy(&dst->u.o.m[i].v, &src->u.o.m[i].v);
+			size = v->u.o.size = lept_cursor_get_size(it);
+			v->u.o.m = (lept_member*)lept_malloc(a, size * sizeof(lept_member));
+			if (lept_cursor_child(&e)) {
+				do {
+					lept_member * m = &v->u.o.m[i++];
+					m->klen = lept_cursor_get_key_length(&e);
+					memcpy(m->k = (char*)lept_malloc(a, m->klen + 1), lept_cursor_get_key(&e), m->klen + 1);
+					lept_init(&m->v);
+					lept_cursor_get_value_with(&e, &m->v, a);
+				} while (lept_cursor_next(&e));
 			}
 			break;
 		default:
 			break;
 	}
-}
-
-void lept_move(lept_value * dst, lept_value * src) {
-	assert(dst != NULL && src != NULL);
-	lept_free(dst);
-	memcpy(dst, src, sizeof(lept_value));
-	lept_init(src);
-}
-
-void lept_swap(lept_value *v1, lept_value * v2) {
-	assert(v1 != NULL && v2 != NULL);
-	if (v1 != v2) {
-		lept_value temp;
-		memcpy(&temp, v1, sizeof(lept_value));
-		memcpy(v1, v2, sizeof(lept_value));
-		memcpy(v2, &temp, sizeof(lept_value));
-	}
+	v->type = lept_cursor_get_type(it);
 }
 
 #if 0
@@ -569,87 +3522,690 @@ static void lept_stringify_string(lept_context* c, const char* s, size_t len) {
     PUTC(c, '"');
 }
 #else
+/* Returns the first byte of [p, end) that must be escaped ('"', '\\' or a
+ * control character), or end. */
+static const char * lept_escape_scan(const char * p, const char * end) {
+    size_t w;
+#ifdef LEPT_SSE2
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1F);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(x, control), control)));
+        if (mask) {
+            for (; !(mask & 1); mask >>= 1)
+                p++;
+            return p;
+        }
+        p += 16;
+    }
+#endif
+    while ((size_t)(end - p) >= sizeof(size_t)) {
+        memcpy(&w, p, sizeof(size_t));
+        if (LEPT_HAS_LESS(w ^ LEPT_BYTES('"'), 1) | LEPT_HAS_LESS(w ^ LEPT_BYTES('\\'), 1) | LEPT_HAS_LESS(w, 0x20))
+            break;
+        p += sizeof(size_t);
+    }
+    for (; p < end; p++)
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+            break;
+    return p;
+}
+
+/* The exact size of s quoted: short escapes add 1 byte, "\u00xx" adds 5. */
+static size_t lept_stringify_string_length(const char* s, size_t len) {
+    const char* end = s + len, * q;
+    size_t size = len + 2;
+    for (q = lept_escape_scan(s, end); q != end; q = lept_escape_scan(q + 1, end))
+        size += *q == '"' || *q == '\\' || (*q >= '\b' && *q <= '\r' && *q != '\v') ? 1 : 5;
+    return size;
+}
+
 static void lept_stringify_string(lept_context* c, const char* s, size_t len) {
     static const char hex_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-    size_t i, size;
-    char* head, *p;
+    const char* end = s + len, * q;
+    size_t size;
+    char* p;
     assert(s != NULL);
-    p = head = lept_context_push(c, size = len * 6 + 2); /* "\u00xx..." */
+    size = lept_stringify_string_length(s, len);
+    p = lept_context_push(c, size);
     *p++ = '"';
-    for (i = 0; i < len; i++) {
-        unsigned char ch = (unsigned char)s[i];
-        switch (ch) {
-            case '\"': *p++ = '\\'; *p++ = '\"'; break;
-            case '\\': *p++ = '\\'; *p++ = '\\'; break;
-            case '\b': *p++ = '\\'; *p++ = 'b';  break;
-            case '\f': *p++ = '\\'; *p++ = 'f';  break;
-            case '\n': *p++ = '\\'; *p++ = 'n';  break;
-            case '\r': *p++ = '\\'; *p++ = 'r';  break;
-            case '\t': *p++ = '\\'; *p++ = 't';  break;
-            default:
-                if (ch < 0x20) {
-                    *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
-                    *p++ = hex_digits[ch >> 4];
-                    *p++ = hex_digits[ch & 15];
-                }
-                else
-                    *p++ = s[i];
+    if (size == len + 2) {
+        memcpy(p, s, len);
+        p += len;
+    }
+    else {
+        for (;;) {
+            q = lept_escape_scan(s, end);
+            memcpy(p, s, q - s);
+            p += q - s;
+            if (q == end)
+                break;
+            *p++ = '\\';
+            switch (*q) {
+                case '\"': *p++ = '\"'; break;
+                case '\\': *p++ = '\\'; break;
+                case '\b': *p++ = 'b';  break;
+                case '\f': *p++ = 'f';  break;
+                case '\n': *p++ = 'n';  break;
+                case '\r': *p++ = 'r';  break;
+                case '\t': *p++ = 't';  break;
+                default:
+                    *p++ = 'u'; *p++ = '0'; *p++ = '0';
+                    *p++ = hex_digits[(unsigned char)*q >> 4];
+                    *p++ = hex_digits[*q & 15];
+            }
+            s = q + 1;
         }
     }
-    *p++ = '"';
-    c->top -= size - (p - head);
+    *p = '"';
 }
 #endif
 
-static void lept_stringify_number(lept_context * c, const lept_value * v) {
-	char* buffer = lept_context_push(c, 32);
-    int length = sprintf(buffer, "%.17g", v->u.n);
+static void lept_stringify_number(lept_context * c, double n) {
+	char* buffer;
+	int length;
+	if (c->top + 32 >= c->size) { /* near the end of a caller's buffer, which cannot grow */
+		char tmp[32];
+		length = sprintf(tmp, "%.17g", n);
+		memcpy(lept_context_push(c, length), tmp, length);
+		return;
+	}
+	buffer = lept_context_push(c, 32);
+    length = sprintf(buffer, "%.17g", n);
     c->top -= 32 - length;
 	/*c->top -= 32 - sprintf(lept_context_push(c, 32), "%.17g", v->u.n);*/
 }
 
+static void lept_stringify_indent(lept_context* c) {
+    size_t n = LEPT_STRINGIFY_INDENT(c->flags) * c->depth;
+    char* p = lept_context_push(c, (int)n + 1);
+    *p = '\n';
+    memset(p + 1, ' ', n);
+}
+
+/* by key, then by position so that duplicate keys keep a fixed order */
+static int lept_member_order(const lept_member* m1, const lept_member* m2) {
+    int r = memcmp(m1->k, m2->k, m1->klen < m2->klen ? m1->klen : m2->klen);
+    if (r)
+        return r;
+    if (m1->klen != m2->klen)
+        return (m1->klen > m2->klen) - (m1->klen < m2->klen);
+    return (m1 > m2) - (m1 < m2);
+}
+
+static int lept_member_compare(const void* a, const void* b) {
+    return lept_member_order(*(const lept_member* const*)a, *(const lept_member* const*)b);
+}
+
+/* the member right after prev (or the first one) in sorted order */
+static const lept_member* lept_member_next(const lept_value* v, const lept_member* prev) {
+    const lept_member* m, * best = NULL;
+    size_t i;
+    for (i = 0; i < v->u.o.size; i++) {
+        m = &v->u.o.m[i];
+        if ((!prev || lept_member_order(prev, m) < 0) && (!best || lept_member_order(m, best) < 0))
+            best = m;
+    }
+    return best;
+}
+
+static void lept_stringify_value(lept_context* c, const lept_value* v);
+
+static void lept_stringify_object(lept_context* c, const lept_value* v) {
+    const lept_member** order = NULL;
+    const lept_member* m = NULL;
+    char* scratch = c->scratch;
+    size_t i, pad, size = v->u.o.size, need = size * sizeof(const lept_member*);
+    int sorted = (c->flags & LEPT_STRINGIFY_SORT_KEYS) && size > 1;
+    if (sorted) {
+        /* sort pointers to the members, the value itself stays untouched */
+        if (!c->scratch_end)
+            order = (const lept_member**)lept_malloc(c->alloc, need);
+        else {
+            /* lept_stringify_to() does not allocate: the pointers go past the
+             * text in the caller's buffer, or members are picked one by one */
+            pad = (sizeof(const lept_member*) - (unsigned long)scratch % sizeof(const lept_member*)) % sizeof(const lept_member*);
+            if ((size_t)(c->scratch_end - scratch) >= pad + need) {
+                order = (const lept_member**)(scratch + pad);
+                c->scratch = scratch + pad + need;
+            }
+        }
+        if (order) {
+            for (i = 0; i < size; i++)
+                order[i] = &v->u.o.m[i];
+            qsort(order, size, sizeof(const lept_member*), lept_member_compare);
+        }
+    }
+    PUTC(c, '{');
+    c->depth++;
+    for (i = 0; i < size; i++) {
+        if (order)
+            m = order[i];
+        else if (sorted)
+            m = lept_member_next(v, m);
+        else
+            m = &v->u.o.m[i];
+        if (i > 0)
+            PUTC(c, ',');
+        if (c->flags & LEPT_STRINGIFY_INDENT_MASK)
+            lept_stringify_indent(c);
+        lept_stringify_string(c, m->k, m->klen);
+        if (c->flags & LEPT_STRINGIFY_INDENT_MASK)
+            PUTS(c, ": ", 2);
+        else
+            PUTC(c, ':');
+        lept_stringify_value(c, &m->v);
+    }
+    c->depth--;
+    if ((c->flags & LEPT_STRINGIFY_INDENT_MASK) && size > 0)
+        lept_stringify_indent(c);
+    PUTC(c, '}');
+    if (c->scratch_end)
+        c->scratch = scratch;
+    else if (order)
+        lept_mfree(c->alloc, order, need);
+}
+
 static void lept_stringify_value(lept_context* c, const lept_value* v) {
     size_t i;
     switch (v->type) {
         case LEPT_NULL:   PUTS(c, "null",  4); break;
         case LEPT_FALSE:  PUTS(c, "false", 5); break;
         case LEPT_TRUE:   PUTS(c, "true",  4); break;
-		case LEPT_NUMBER: lept_stringify_number(c, v);break;
+		case LEPT_NUMBER: lept_stringify_number(c, v->u.n);break;
         case LEPT_STRING: lept_stringify_string(c, v->u.s.s, v->u.s.len); break;
         case LEPT_ARRAY:
             PUTC(c, '[');
+            c->depth++;
             for (i = 0; i < v->u.a.size; i++) {
                 if (i > 0)
                     PUTC(c, ',');
-                lept_stringify_value(c, &v->u.a.e[i]);
+                if (c->flags & LEPT_STRINGIFY_INDENT_MASK)
+                    lept_stringify_indent(c);
+                if (v->flags & LEPT_FLAG_PACKED)
+                    lept_stringify_number(c, ((const double *)v->u.a.e)[i]);
+                else
+                    lept_stringify_value(c, &v->u.a.e[i]);
             }
+            c->depth--;
+            if ((c->flags & LEPT_STRINGIFY_INDENT_MASK) && v->u.a.size > 0)
+                lept_stringify_indent(c);
             PUTC(c, ']');
             break;
-        case LEPT_OBJECT:
-            PUTC(c, '{');
-            for (i = 0; i < v->u.o.size; i++) {
-                if (i > 0)
-                    PUTC(c, ',');
-                lept_stringify_string(c, v->u.o.m[i].k, v->u.o.m[i].klen);
-                PUTC(c, ':');
-                lept_stringify_value(c, &v->u.o.m[i].v);
+        case LEPT_OBJECT: lept_stringify_object(c, v); break;
+        default: assert(0 && "invalid type");
+    }
+}
+
+/* Mirrors lept_stringify_value() without writing; depth is that of v. */
+static size_t lept_stringify_length_value(const lept_value* v, unsigned flags, size_t depth) {
+    size_t i, n, size, indent = LEPT_STRINGIFY_INDENT(flags);
+    char buffer[32];
+    switch (v->type) {
+        case LEPT_NULL:   return 4;
+        case LEPT_FALSE:  return 5;
+        case LEPT_TRUE:   return 4;
+        case LEPT_NUMBER: return sprintf(buffer, "%.17g", v->u.n);
+        case LEPT_STRING: return lept_stringify_string_length(v->u.s.s, v->u.s.len);
+        case LEPT_ARRAY:
+            n = v->u.a.size;
+            size = n ? 2 + n - 1 : 2;
+            for (i = 0; i < n; i++) {
+                if (v->flags & LEPT_FLAG_PACKED)
+                    size += sprintf(buffer, "%.17g", ((const double *)v->u.a.e)[i]);
+                else
+                    size += lept_stringify_length_value(&v->u.a.e[i], flags, depth + 1);
             }
-            PUTC(c, '}');
             break;
-        default: assert(0 && "invalid type");
+        case LEPT_OBJECT:
+            n = v->u.o.size;
+            size = n ? 2 + n - 1 + n * (indent ? 2 : 1) : 2;
+            for (i = 0; i < n; i++)
+                size += lept_stringify_string_length(v->u.o.m[i].k, v->u.o.m[i].klen)
+                    + lept_stringify_length_value(&v->u.o.m[i].v, flags, depth + 1);
+            break;
+        default: assert(0 && "invalid type"); return 0;
+    }
+    /* a newline and indentation before each element and the closing bracket */
+    if (indent && n)
+        size += n * (1 + indent * (depth + 1)) + 1 + indent * depth;
+    return size;
+}
+
+size_t lept_stringify_length(const lept_value* v, unsigned flags) {
+    assert(v != NULL);
+    return lept_stringify_length_value(v, flags, 0);
+}
+
+/* lept_stringify_to() runs the stack in the caller's buffer under this
+ * allocator: growing out of it moves to scratch memory, which only happens
+ * when the text does not fit. */
+typedef struct {
+    const lept_allocator* base;
+    const char* buffer;
+} lept_fixed_stack;
+
+static void* lept_fixed_malloc(void* ud, size_t size) {
+    const lept_allocator* a = ((lept_fixed_stack*)ud)->base;
+    return a->malloc(a->ud, size);
+}
+
+static void* lept_fixed_realloc(void* ud, void* p, size_t old_size, size_t size) {
+    const lept_allocator* a = ((lept_fixed_stack*)ud)->base;
+    void* q;
+    if (p != ((lept_fixed_stack*)ud)->buffer)
+        return a->realloc(a->ud, p, old_size, size);
+    if ((q = a->malloc(a->ud, size)) && old_size)
+        memcpy(q, p, old_size);
+    return q;
+}
+
+static void lept_fixed_free(void* ud, void* p) {
+    const lept_allocator* a = ((lept_fixed_stack*)ud)->base;
+    a->free(a->ud, p);
+}
+
+int lept_stringify_to(const lept_value* v, char* buffer, size_t size, size_t* length, unsigned flags) {
+    lept_fixed_stack f;
+    lept_allocator a;
+    lept_context c;
+    assert(v != NULL && (buffer != NULL || size == 0));
+    LEPT_TRACE_EVENT(LEPT_TRACE_STRINGIFY_BEGIN, stringify__begin, 0);
+    f.base = &lept_global_allocator;
+    f.buffer = buffer;
+    a.malloc = lept_fixed_malloc;
+    a.realloc = lept_fixed_realloc;
+    a.free = lept_fixed_free;
+    a.ud = &f;
+    a.stats = lept_global_allocator.stats;
+    c.alloc = &a;
+    c.stack = buffer;
+    c.size = size < 2 ? 0 : size; /* the stack grows by half its size */
+    c.top = 0;
+    c.flags = flags;
+    c.depth = 0;
+    c.scratch = c.scratch_end = NULL;
+    if (flags & LEPT_STRINGIFY_SORT_KEYS) {
+        /* sorting keeps its scratch past the text, so find where that ends */
+        size_t n = lept_stringify_length(v, flags);
+        if (n >= size) {
+            if (length)
+                *length = n;
+            LEPT_TRACE_EVENT(LEPT_TRACE_STRINGIFY_END, stringify__end, n);
+            return LEPT_STRINGIFY_BUFFER_TOO_SMALL;
+        }
+        c.scratch = buffer + n + 1;
+        c.scratch_end = buffer + size;
+    }
+    lept_stringify_value(&c, v);
+    if (length)
+        *length = c.top;
+    LEPT_TRACE_EVENT(LEPT_TRACE_STRINGIFY_END, stringify__end, c.top);
+    if (c.stack != buffer) {
+        /* the counters saw the growth beyond the caller's buffer only */
+        lept_mfree(&a, c.stack, c.size - (size < 2 ? 0 : size));
+        return LEPT_STRINGIFY_BUFFER_TOO_SMALL;
     }
+    buffer[c.top] = '\0';
+    return LEPT_STRINGIFY_OK;
 }
 
 char* lept_stringify(const lept_value* v, size_t* length) {
+    return lept_stringify_ex(v, length, 0);
+}
+
+char* lept_stringify_ex(const lept_value* v, size_t* length, unsigned flags) {
     lept_context c;
     assert(v != NULL);
-    c.stack = (char*)malloc(c.size = LEPT_PARSE_STRINGIFY_INIT_SIZE);
+    LEPT_TRACE_EVENT(LEPT_TRACE_STRINGIFY_BEGIN, stringify__begin, 0);
+    c.alloc = &lept_global_allocator;
+    c.stack = (char*)lept_malloc(c.alloc, c.size = LEPT_PARSE_STRINGIFY_INIT_SIZE);
     c.top = 0;
+    c.flags = flags;
+    c.depth = 0;
+    c.scratch = c.scratch_end = NULL;
     lept_stringify_value(&c, v);
     if (length)
         *length = c.top;
+    LEPT_TRACE_EVENT(LEPT_TRACE_STRINGIFY_END, stringify__end, c.top);
     PUTC(&c, '\0');
+    lept_alloc_handoff(c.alloc, c.size);
     return c.stack;
 }
 
 
+
+static int lept_skip_value(lept_context * c) {
+	lept_value tmp;
+	char * str;
+	size_t len;
+	int ret;
+	switch (*c->json) {
+		case '\"':
+			return lept_parse_string_raw(c, &str, &len);
+		case '[':
+			c->json++;
+			lept_parse_whitespace(c);
+			if (*c->json == ']') {
+				c->json++;
+				return LEPT_PARSE_OK;
+			}
+			for (;;) {
+				if ((ret = lept_skip_value(c)) != LEPT_PARSE_OK)
+					return ret;
+				lept_parse_whitespace(c);
+				if (*c->json == ',') {
+					c->json++;
+					lept_parse_whitespace(c);
+				} else if (*c->json == ']') {
+					c->json++;
+					return LEPT_PARSE_OK;
+				} else
+					return LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+			}
+		case '{':
+			c->json++;
+			lept_parse_whitespace(c);
+			if (*c->json == '}') {
+				c->json++;
+				return LEPT_PARSE_OK;
+			}
+			for (;;) {
+				if (*c->json != '\"')
+					return LEPT_PARSE_MISS_KEY;
+				if ((ret = lept_parse_string_raw(c, &str, &len)) != LEPT_PARSE_OK)
+					return ret;
+				lept_parse_whitespace(c);
+				if (*c->json != ':')
+					return LEPT_PARSE_MISS_COLON;
+				c->json++;
+				lept_parse_whitespace(c);
+				if ((ret = lept_skip_value(c)) != LEPT_PARSE_OK)
+					return ret;
+				lept_parse_whitespace(c);
+				if (*c->json == ',') {
+					c->json++;
+					lept_parse_whitespace(c);
+				} else if (*c->json == '}') {
+					c->json++;
+					return LEPT_PARSE_OK;
+				} else
+					return LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+			}
+		default: /* scalars allocate nothing */
+			lept_init(&tmp);
+			return lept_parse_value(&tmp, c);
+	}
+}
+
+static int lept_decode_struct(lept_context * c, char * out, const lept_field * fields, size_t count);
+static int lept_decode_array(lept_context * c, char * out, const lept_field * f);
+static void lept_free_field(char * out, const lept_field * f, const lept_allocator * a);
+
+/* out is the struct holding the field, or the array element for f->sub */
+static int lept_decode_field(lept_context * c, char * out, const lept_field * f) {
+	char * p = out + f->offset;
+	lept_value tmp;
+	char * str;
+	size_t len;
+	int ret;
+	switch (*c->json) {
+		case '{':
+			if (f->type != LEPT_FIELD_STRUCT)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			return lept_decode_struct(c, p, f->sub, f->nsub);
+		case '\"':
+			if (f->type != LEPT_FIELD_STRING)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			if ((ret = lept_parse_string_raw(c, &str, &len)) != LEPT_PARSE_OK)
+				return ret;
+			if (*(char**)p)
+				lept_mfree(c->alloc, *(char**)p, strlen(*(char**)p) + 1);
+			*(char**)p = (char*)lept_malloc(c->alloc, len + 1);
+			if (len) /* str is NULL for a leading "" */
+				memcpy(*(char**)p, str, len);
+			(*(char**)p)[len] = '\0';
+			return LEPT_PARSE_OK;
+		case '[':
+			if (f->type != LEPT_FIELD_ARRAY)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			return lept_decode_array(c, out, f);
+	}
+	lept_init(&tmp);
+	if ((ret = lept_parse_value(&tmp, c)) != LEPT_PARSE_OK)
+		return ret;
+	switch (f->type) {
+		case LEPT_FIELD_NUMBER:
+			if (tmp.type != LEPT_NUMBER)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			*(double*)p = tmp.u.n;
+			return LEPT_PARSE_OK;
+		case LEPT_FIELD_INT:
+			if (tmp.type != LEPT_NUMBER || tmp.u.n < INT_MIN || tmp.u.n > INT_MAX || tmp.u.n != (int)tmp.u.n)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			*(int*)p = (int)tmp.u.n;
+			return LEPT_PARSE_OK;
+		case LEPT_FIELD_BOOLEAN:
+			if (tmp.type != LEPT_TRUE && tmp.type != LEPT_FALSE)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			*(int*)p = tmp.type == LEPT_TRUE;
+			return LEPT_PARSE_OK;
+		case LEPT_FIELD_STRING:
+			if (tmp.type != LEPT_NULL)
+				return LEPT_PARSE_TYPE_MISMATCH;
+			if (*(char**)p)
+				lept_mfree(c->alloc, *(char**)p, strlen(*(char**)p) + 1);
+			*(char**)p = NULL;
+			return LEPT_PARSE_OK;
+		default:
+			return LEPT_PARSE_TYPE_MISMATCH;
+	}
+}
+
+static int lept_decode_array(lept_context * c, char * out, const lept_field * f) {
+	size_t i, n = 0, capacity = 0;
+	char * items = NULL;
+	int ret = LEPT_PARSE_OK;
+	EXPECT(c, '[');
+	lept_parse_whitespace(c);
+	if (*c->json == ']')
+		c->json++;
+	else for (;;) {
+		if (n == capacity) {
+			size_t grown = capacity ? capacity + (capacity >> 1) : 4;
+			items = (char*)(items ? lept_realloc(c->alloc, items, capacity * f->size, grown * f->size)
+				: lept_malloc(c->alloc, grown * f->size));
+			capacity = grown;
+		}
+		/* zeroed first, so a half-decoded element can be freed like the others */
+		memset(items + n * f->size, 0, f->size);
+		if ((ret = lept_decode_field(c, items + n++ * f->size, f->sub)) != LEPT_PARSE_OK)
+			break;
+		lept_parse_whitespace(c);
+		if (*c->json == ',') {
+			c->json++;
+			lept_parse_whitespace(c);
+		} else if (*c->json == ']') {
+			c->json++;
+			break;
+		} else {
+			ret = LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+			break;
+		}
+	}
+	if (ret != LEPT_PARSE_OK) {
+		for (i = 0; i < n; i++)
+			lept_free_field(items + i * f->size, f->sub, c->alloc);
+		lept_mfree(c->alloc, items, capacity * f->size);
+		return ret;
+	}
+	if (n < capacity)
+		items = (char*)lept_realloc(c->alloc, items, capacity * f->size, n * f->size);
+	lept_free_field(out, f, c->alloc);
+	*(char**)(out + f->offset) = items;
+	*(size_t*)(out + f->count) = n;
+	return LEPT_PARSE_OK;
+}
+
+static int lept_decode_struct(lept_context * c, char * out, const lept_field * fields, size_t count) {
+	size_t i, hint = 0, klen;
+	const lept_field * f;
+	char * key;
+	int ret;
+	EXPECT(c, '{');
+	lept_parse_whitespace(c);
+	if (*c->json == '}') {
+		c->json++;
+		return LEPT_PARSE_OK;
+	}
+	for (;;) {
+		if (*c->json != '\"')
+			return LEPT_PARSE_MISS_KEY;
+		if ((ret = lept_parse_string_raw(c, &key, &klen)) != LEPT_PARSE_OK)
+			return ret;
+		/* documents usually list keys in table order, so start after the last match */
+		f = NULL;
+		for (i = 0; i < count; i++) {
+			const lept_field * g = &fields[(hint + i) % count];
+			if (g->nlen == klen && memcmp(g->name, key, klen) == 0) {
+				f = g;
+				hint = (hint + i + 1) % count;
+				break;
+			}
+		}
+		lept_parse_whitespace(c);
+		if (*c->json != ':')
+			return LEPT_PARSE_MISS_COLON;
+		c->json++;
+		lept_parse_whitespace(c);
+		if ((ret = f ? lept_decode_field(c, out, f) : lept_skip_value(c)) != LEPT_PARSE_OK)
+			return ret;
+		lept_parse_whitespace(c);
+		if (*c->json == ',') {
+			c->json++;
+			lept_parse_whitespace(c);
+		} else if (*c->json == '}') {
+			c->json++;
+			return LEPT_PARSE_OK;
+		} else
+			return LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+	}
+}
+
+int lept_parse_struct(void * out, const lept_field * fields, size_t count, const char * json) {
+	lept_context c;
+	int ret;
+	assert(out != NULL && (fields != NULL || count == 0) && json != NULL);
+	c.json = json;
+	c.top = c.size = 0;
+	c.stack = NULL;
+	c.keys = NULL;
+	c.alloc = &lept_global_allocator;
+	c.error = NULL;
+	c.flags = 0;
+	LEPT_TRACE_INIT(&c, NULL);
+	lept_parse_whitespace(&c);
+	if (*c.json == '{') {
+		if ((ret = lept_decode_struct(&c, (char*)out, fields, count)) == LEPT_PARSE_OK) {
+			lept_parse_whitespace(&c);
+			if (*c.json != '\0')
+				ret = LEPT_PARSE_NOT_SINGLE;
+		}
+	} else
+		ret = *c.json == '\0' ? LEPT_PARSE_ALL_BLANK : LEPT_PARSE_TYPE_MISMATCH;
+	assert(c.top == 0);
+	lept_mfree(c.alloc, c.stack, c.size);
+	return ret;
+}
+
+static void lept_encode_struct(lept_context * c, const char * in, const lept_field * fields, size_t count);
+
+static void lept_encode_field(lept_context * c, const char * in, const lept_field * f) {
+	const char * p = in + f->offset;
+	size_t i, n;
+	switch (f->type) {
+		case LEPT_FIELD_NUMBER: lept_stringify_number(c, *(const double*)p); break;
+		case LEPT_FIELD_INT:
+			c->top -= 32 - sprintf((char*)lept_context_push(c, 32), "%d", *(const int*)p);
+			break;
+		case LEPT_FIELD_BOOLEAN:
+			if (*(const int*)p)
+				PUTS(c, "true", 4);
+			else
+				PUTS(c, "false", 5);
+			break;
+		case LEPT_FIELD_STRING:
+			if (*(char* const*)p)
+				lept_stringify_string(c, *(char* const*)p, strlen(*(char* const*)p));
+			else
+				PUTS(c, "null", 4);
+			break;
+		case LEPT_FIELD_STRUCT: lept_encode_struct(c, p, f->sub, f->nsub); break;
+		case LEPT_FIELD_ARRAY:
+			PUTC(c, '[');
+			for (i = 0, n = *(const size_t*)(in + f->count); i < n; i++) {
+				if (i > 0)
+					PUTC(c, ',');
+				lept_encode_field(c, *(char* const*)p + i * f->size, f->sub);
+			}
+			PUTC(c, ']');
+			break;
+		default: assert(0 && "invalid field type");
+	}
+}
+
+static void lept_encode_struct(lept_context * c, const char * in, const lept_field * fields, size_t count) {
+	size_t i;
+	PUTC(c, '{');
+	for (i = 0; i < count; i++) {
+		if (i > 0)
+			PUTC(c, ',');
+		lept_stringify_string(c, fields[i].name, fields[i].nlen);
+		PUTC(c, ':');
+		lept_encode_field(c, in, &fields[i]);
+	}
+	PUTC(c, '}');
+}
+
+char* lept_stringify_struct(const void * in, const lept_field * fields, size_t count, size_t * length) {
+	lept_context c;
+	assert(in != NULL && (fields != NULL || count == 0));
+	c.alloc = &lept_global_allocator;
+	c.stack = (char*)lept_malloc(c.alloc, c.size = LEPT_PARSE_STRINGIFY_INIT_SIZE);
+	c.top = 0;
+	lept_encode_struct(&c, (const char*)in, fields, count);
+	if (length)
+		*length = c.top;
+	PUTC(&c, '\0');
+	lept_alloc_handoff(c.alloc, c.size);
+	return c.stack;
+}
+
+static void lept_free_field(char * out, const lept_field * f, const lept_allocator * a) {
+	char * q = out + f->offset;
+	size_t i, n;
+	if (f->type == LEPT_FIELD_STRING) {
+		if (*(char**)q)
+			lept_mfree(a, *(char**)q, strlen(*(char**)q) + 1);
+		*(char**)q = NULL;
+	} else if (f->type == LEPT_FIELD_STRUCT) {
+		for (i = 0; i < f->nsub; i++)
+			lept_free_field(q, &f->sub[i], a);
+	} else if (f->type == LEPT_FIELD_ARRAY) {
+		n = *(size_t*)(out + f->count);
+		for (i = 0; i < n; i++)
+			lept_free_field(*(char**)q + i * f->size, f->sub, a);
+		lept_mfree(a, *(char**)q, n * f->size);
+		*(char**)q = NULL;
+		*(size_t*)(out + f->count) = 0;
+	}
+}
+
+void lept_free_struct(void * p, const lept_field * fields, size_t count) {
+	size_t i;
+	assert(p != NULL && (fields != NULL || count == 0));
+	for (i = 0; i < count; i++)
+		lept_free_field((char*)p, &fields[i], &lept_global_allocator);
+}
@@ -1,9 +1,13 @@
 #ifndef LEPTJSON_H__
 #define LEPTJSON_H__
 #include <stddef.h> /* size_t */
-#include <string.h> /* memcmp() */
+#include <string.h> /* memcmp(), memset() */
 
-#define lept_init(v) do {(v)->type = LEPT_NULL;} while(0)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define lept_init(v) do {(v)->type = LEPT_NULL; (v)->flags = 0;} while(0)
 
 typedef enum {LEPT_NULL, LEPT_TRUE, LEPT_FALSE, LEPT_NUMBER, LEPT_STRING, LEPT_ARRAY, LEPT_OBJECT} lept_type;
 
@@ -27,8 +31,16 @@ struct lept_value {
 		} o;
 	} u;
 	lept_type type;
+	unsigned flags; /* LEPT_FLAG_* bits, meaning depends on type */
 };
 
+/* LEPT_OBJECT: member keys are owned by a lept_intern table, not by the object */
+#define LEPT_FLAG_SHARED_KEYS 0x1
+/* LEPT_ARRAY, LEPT_OBJECT: lept_hash() is cached in a side table keyed by u.a.e / u.o.m */
+#define LEPT_FLAG_HASHED 0x2
+/* LEPT_ARRAY: u.a.e points to u.a.size doubles, see lept_get_array_numbers() */
+#define LEPT_FLAG_PACKED 0x4
+
 struct lept_member{
 	char * k; size_t klen;
 	lept_value v;
@@ -49,10 +61,188 @@ enum {
 	LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET,
 	LEPT_PARSE_MISS_KEY,
     LEPT_PARSE_MISS_COLON,
-    LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET
+    LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET,
+    LEPT_PARSE_TYPE_MISMATCH,
+    LEPT_PARSE_TOO_DEEP,
+    LEPT_PARSE_INVALID_UTF8,
+    LEPT_PARSE_READ_ERROR
+};
+
+/* Optional allocation counters, updated by the allocator they are attached to.
+ * live and peak cover values and scratch buffers; buffers returned to the
+ * caller (lept_stringify) stop counting as live once handed over. */
+typedef struct {
+	unsigned long allocs, reallocs, frees;
+	unsigned long stack_grows; /* parse/stringify stack regrowths */
+	size_t bytes;              /* total bytes requested */
+	size_t live, peak;
+} lept_alloc_stats;
+
+typedef struct {
+	void * (*malloc)(void * ud, size_t size);
+	void * (*realloc)(void * ud, void * p, size_t old_size, size_t size);
+	void (*free)(void * ud, void * p);
+	void * ud;
+	lept_alloc_stats * stats; /* or NULL */
+} lept_allocator;
+
+/* Installs the allocator used by every call without one of its own; NULL
+ * restores malloc()/realloc()/free(). Install it before creating values:
+ * memory must go back to the allocator it came from. A value built with
+ * another allocator (lept_parse_options.alloc) may only be grown, copied into
+ * or patched through the _with variants given that same allocator; the
+ * calls without one, lept_set_boolean(), lept_set_number(), lept_set_null()
+ * and lept_move() among them, release the old content of their target with
+ * the global allocator, so lept_free_with() such a target first. */
+void lept_set_allocator(const lept_allocator * a);
+const lept_allocator * lept_get_allocator(void);
+
+typedef struct lept_intern_slot lept_intern_slot;
+
+/* Key interning table: identical object keys are stored once and shared by
+ * every member that uses them. It may serve one document or many parses, but
+ * must outlive every value parsed with it. Its keys come from the allocator
+ * it was initialized with, whatever the parses use. */
+typedef struct {
+	lept_intern_slot * slots;
+	size_t size, capacity;
+	const lept_allocator * alloc;
+} lept_intern;
+
+#ifndef LEPT_ERROR_PATH_SIZE
+#define LEPT_ERROR_PATH_SIZE 128
+#endif
+
+#ifndef LEPT_ERROR_EXCERPT_SIZE
+#define LEPT_ERROR_EXCERPT_SIZE 40
+#endif
+
+/* Where and why a parse failed. Only code is written on success; the rest is
+ * worked out after the failure, so asking for it costs nothing while the
+ * document is valid. path is a JSONPath-like route to the value that failed
+ * ("$.statuses[3].user"), starting with "..." when it had to be cut short;
+ * excerpt is the text around offset with control characters blanked. */
+typedef struct {
+	int code;
+	size_t offset;         /* byte offset where the error was detected */
+	size_t line, column;   /* 1-based; column counts bytes */
+	size_t excerpt_offset; /* position of offset within excerpt */
+	char path[LEPT_ERROR_PATH_SIZE];
+	char excerpt[LEPT_ERROR_EXCERPT_SIZE];
+} lept_parse_error;
+
+/* Rejects strings (keys included) whose raw bytes are not well-formed UTF-8:
+ * stray continuation bytes, overlong forms, surrogates and code points past
+ * U+10FFFF fail with LEPT_PARSE_INVALID_UTF8. A \uDC00-\uDFFF escape that
+ * does not follow a high surrogate fails with
+ * LEPT_PARSE_INVALID_UNICODE_SURROGATE, as an unpaired high one always does. */
+#define LEPT_PARSE_STRICT_UTF8 0x1u
+
+/* Stores arrays made only of numbers packed: one double each instead of a
+ * lept_value, about a third of the memory. */
+#define LEPT_PARSE_PACK_NUMBERS 0x2u
+
+/* Projection: with keep set, only the values at those JSON Pointer paths
+ * (and everything below them) are decoded, together with the containers
+ * leading to them. A "*" token matches any key or array index, and kept
+ * array elements are packed together. Everything else is stepped over by a
+ * scanner that only follows strings and brackets: it allocates nothing and
+ * does not check the skipped text beyond its nesting and string quoting. */
+#define LEPT_PARSE_MAX_KEEP 32
+
+/* Tracing, compiled in only when the library is built with LEPT_TRACE; in
+ * other builds the hooks below are never called and lept_trace is left
+ * alone. A parse given a lept_trace adds to its counters, so zero it for
+ * figures per document. Phase ticks are read from clock, when set, around
+ * each whitespace run, string (keys included), number and the assembly of
+ * each array or object from the parse stack; everything else (literals,
+ * punctuation, dispatch) is not timed. A traced parse runs on one thread. */
+enum {
+	LEPT_PHASE_WHITESPACE,
+	LEPT_PHASE_STRING,
+	LEPT_PHASE_NUMBER,
+	LEPT_PHASE_CONTAINER,
+	LEPT_PHASES
 };
 
+typedef struct {
+	size_t nodes[7];    /* values parsed, by lept_type; keys are not values */
+	size_t unescaped;   /* bytes of string and key content after unescaping */
+	size_t max_depth;   /* deepest array/object nesting, 1 for a flat array */
+	size_t stack_peak;  /* parse stack high-water mark, bytes */
+	unsigned long ticks[LEPT_PHASES];
+	unsigned long (*clock)(void * ud); /* any monotonic tick source, or NULL */
+	void * ud;
+} lept_trace;
+
+/* Called on entry to and exit from lept_parse_ex() (and lept_parse()),
+ * lept_stringify_ex() (and lept_stringify()) and lept_stringify_to(), with
+ * the parse result or the text length as arg on exit. Builds that also
+ * define LEPT_USDT fire USDT probes of the same names (leptjson:parse__begin
+ * and so on) through <sys/sdt.h>. Install the hook before use; NULL removes
+ * it. */
+enum {
+	LEPT_TRACE_PARSE_BEGIN,
+	LEPT_TRACE_PARSE_END,
+	LEPT_TRACE_STRINGIFY_BEGIN,
+	LEPT_TRACE_STRINGIFY_END
+};
+
+void lept_set_trace_hook(void (*hook)(void * ud, unsigned event, size_t arg), void * ud);
+
+/* Threads: threads > 1 splits a large top-level array between that many
+ * threads, which then call the allocator concurrently, so its functions must
+ * be thread-safe; counters are kept per thread and added up at the end.
+ * Other documents, and any invalid one, are parsed on the calling thread, so
+ * the result and the error reported are the same as without threads. keys
+ * and keep turn it off, and builds without LEPT_HAVE_PTHREAD do the same
+ * work on one thread. */
+typedef struct {
+	lept_intern * keys;          /* intern object keys into this table, or NULL */
+	const lept_allocator * alloc; /* allocator for this parse and its value, or NULL */
+	lept_parse_error * error;    /* filled in with the outcome, or NULL */
+	unsigned flags;              /* LEPT_PARSE_STRICT_UTF8, LEPT_PARSE_PACK_NUMBERS */
+	const char * const * keep;   /* paths to decode, or NULL for all */
+	size_t nkeep;                /* at most LEPT_PARSE_MAX_KEEP */
+	unsigned threads;            /* 0 or 1 for the calling thread only */
+	lept_trace * trace;          /* counters to add to, or NULL; see above */
+} lept_parse_options;
+
+#define lept_parse_options_init(opt) memset((opt), 0, sizeof(lept_parse_options))
+
 int lept_parse(lept_value * v, const char * json);
+int lept_parse_ex(lept_value * v, const char * json, const lept_parse_options * opt);
+
+/* Loads paths[0..n) into results[0..n): opt->threads workers (the calling
+ * thread alone for 0 or 1) each take the next file, read it whole into a
+ * buffer of their own and parse it at once, so reads on some workers overlap
+ * parsing on others. Built with LEPT_HAVE_IO_URING on Linux, each worker
+ * also keeps up to LEPT_LOAD_QUEUE_DEPTH (32) reads in an io_uring of its
+ * own and parses every file as its read completes, so that a single worker
+ * overlaps the two as well; where no ring can be set up, workers read with
+ * stdio as on other platforms. Each document is parsed on one thread with the rest of
+ * opt; keys or trace keep the whole batch on the calling thread, and
+ * opt->error is not used. A file that cannot be read gets
+ * LEPT_PARSE_READ_ERROR with errno in sys_errno. Returns the number of files
+ * that failed; release every result's v, failed ones included. */
+typedef struct {
+	lept_value v;           /* null unless error.code is LEPT_PARSE_OK */
+	lept_parse_error error;
+	int sys_errno;          /* for LEPT_PARSE_READ_ERROR, else 0 */
+} lept_load_result;
+
+size_t lept_load_files(lept_load_result * results, const char * const * paths, size_t n, const lept_parse_options * opt);
+
+/* Checks that json[0..len) is a single valid JSON text, applying the same
+ * rules as lept_parse() without allocating. Nesting is tracked in a fixed
+ * bit stack, deeper documents fail with LEPT_PARSE_TOO_DEEP. On error
+ * *offset (if not NULL) is set to the byte offset where it was detected. */
+int lept_validate(const char * json, size_t len, size_t * offset);
+
+void lept_intern_init(lept_intern * t);
+void lept_intern_init_with(lept_intern * t, const lept_allocator * a);
+void lept_intern_free(lept_intern * t);
+const char * lept_intern_key(lept_intern * t, const char * key, size_t klen);
 
 lept_type lept_get_type(const lept_value * v);
 
@@ -63,6 +253,7 @@ void lept_set_boolean(lept_value * v, int b);
 double lept_get_number(const lept_value * v);
 
 void lept_set_string(lept_value * v, const char * s, size_t len);
+void lept_set_string_with(lept_value * v, const char * s, size_t len, const lept_allocator * a);
 
 const char* lept_get_string(const lept_value * v);
 
@@ -72,6 +263,20 @@ size_t lept_get_array_size(const lept_value * v);
 
 const lept_value * lept_get_array_element(const lept_value * v, size_t index);
 
+/* Packed arrays hold their numbers in one block instead of as elements: the
+ * library reads, compares, copies and writes them like any other array, but
+ * lept_get_array_element() cannot be used on them. lept_get_array_numbers()
+ * returns the block (lept_get_array_size() doubles), or NULL when the array
+ * is not packed. lept_pack_array() packs an array of numbers and returns 0
+ * for any other, lept_unpack_array() turns a packed one back into elements.
+ * Patching an element of a packed array unpacks it. The _with variants
+ * rebuild the block with the allocator the array was made with. */
+double * lept_get_array_numbers(const lept_value * v);
+int lept_pack_array(lept_value * v);
+int lept_pack_array_with(lept_value * v, const lept_allocator * a);
+void lept_unpack_array(lept_value * v);
+void lept_unpack_array_with(lept_value * v, const lept_allocator * a);
+
 size_t lept_get_object_size(const lept_value* v);
 const char* lept_get_object_key(const lept_value* v, size_t index);
 size_t lept_get_object_key_length(const lept_value* v, size_t index);
@@ -79,12 +284,210 @@ lept_value* lept_get_object_value(const lept_value* v, size_t index);
 size_t lept_find_object_index(const lept_value * v, const char * key, size_t klen);
 lept_value * lept_find_object_value(const lept_value * v, const char * key, size_t klen);
 
+/* Content hash: equal values hash equal, and object hashes do not depend on
+ * member order. Non-empty arrays and objects keep theirs once computed, in a
+ * process-wide table keyed by their element block (allocated with malloc(),
+ * outside any lept_allocator, and kept at its largest size), which also lets lept_is_equal() reject two
+ * containers with different cached hashes at once. The library's
+ * own updates drop the cached hashes they make stale; after changing a value
+ * in place through a returned pointer, call lept_invalidate_hash() on every
+ * container enclosing it. Storing the hashes writes to the tree, so
+ * lept_hash() (and lept_diff(), which calls it) must not run on a tree other
+ * threads are reading unless it has been hashed once beforehand. */
+size_t lept_hash(const lept_value * v);
+void lept_invalidate_hash(lept_value * v);
+
 int lept_is_equal(const lept_value * v1, const lept_value * v2);
 void lept_copy(lept_value * dst, const lept_value * src);
+void lept_copy_with(lept_value * dst, const lept_value * src, const lept_allocator * a);
 void lept_move(lept_value * dst, lept_value * src);
 void lept_swap(lept_value *v1, lept_value * v2);
 
+/* In-place updates. Values are moved out of patch with lept_move(), so only
+ * the patched paths are touched; patch is left fit only for lept_free().
+ * lept_merge_patch() applies an RFC 7386 merge patch and cannot fail.
+ * lept_patch() applies an RFC 6902 operation array. Its shape is checked
+ * before anything changes, but an operation that fails on the document
+ * (missing path, failed test) leaves the earlier ones applied: patch a copy
+ * when the update has to be all or nothing. The _with variants update a
+ * document built with allocator a; patch must come from the same one, since
+ * its values move into the document. */
+enum {
+	LEPT_PATCH_OK,
+	LEPT_PATCH_INVALID_OPERATION, /* not an array of well-formed operations */
+	LEPT_PATCH_INVALID_POINTER,   /* malformed JSON Pointer or array index */
+	LEPT_PATCH_PATH_NOT_FOUND,
+	LEPT_PATCH_TEST_FAILED
+};
+
+void lept_merge_patch(lept_value * target, lept_value * patch);
+void lept_merge_patch_with(lept_value * target, lept_value * patch, const lept_allocator * a);
+int lept_patch(lept_value * doc, lept_value * patch);
+int lept_patch_with(lept_value * doc, lept_value * patch, const lept_allocator * a);
+
+/* Finds the changes that turn from into to and returns how many there are.
+ * When patch is not NULL it is set to them as a JSON Patch array that
+ * lept_patch() applies. Object members are matched by key through a hash
+ * index, arrays element by element once their common ends are skipped.
+ * Both sides are hashed first with lept_hash() (cached hashes are reused),
+ * and a pair of subtrees whose hashes, types and sizes match is skipped
+ * without being compared: only a collision of two different subtrees on a
+ * size_t hash could hide a change. LEPT_DIFF_FIRST stops at the first
+ * change: a cheap "has it changed". */
+#define LEPT_DIFF_FIRST 0x1u
+
+size_t lept_diff(const lept_value * from, const lept_value * to, lept_value * patch, unsigned flags);
+
+/* Tape: a read-only document in two flat buffers instead of a tree. Values
+ * are tagged words in document order, numbers followed by a word holding the
+ * double. A string (object keys included) is an offset into strings, which
+ * holds its unsigned length, its bytes and a NUL. An array or object start
+ * word holds the index of its end word, tagged LEPT_TAPE_END | type, and the
+ * end word holds the element count, so a subtree is stepped over in one move.
+ * Object members are a key word followed by the value. Indices and offsets
+ * are unsigned ints, which bounds the size of a document. */
+#define LEPT_TAPE_END 0x80u
+
+typedef union {
+	struct {
+		unsigned tag; /* lept_type, or LEPT_TAPE_END | LEPT_ARRAY / LEPT_OBJECT */
+		unsigned arg; /* end word index, element count or string offset */
+	} w;
+	double n;
+} lept_tape_word;
+
+typedef struct {
+	lept_tape_word * words;
+	size_t nwords;
+	char * strings;
+	size_t nstrings;
+	const lept_allocator * alloc;
+} lept_tape;
+
+/* A position in a tape: the value at pos, inside the container whose end word
+ * is end (nwords at the root). Cursors are plain values, copy one to come back
+ * to it after moving into a child. */
+typedef struct {
+	const lept_tape * tape;
+	size_t pos, end;
+} lept_cursor;
+
+void lept_tape_init(lept_tape * t);
+void lept_tape_free(lept_tape * t);
+/* Takes the same options as lept_parse_ex() except keys and keep, which are
+ * ignored. The tape is left empty on error. */
+int lept_parse_tape(lept_tape * t, const char * json, const lept_parse_options * opt);
+
+/* The saved form is a small header followed by both buffers as they are in
+ * memory, so only a build with the same word size and byte order can load
+ * it. Loading copies the buffers and checks that every index and offset stays
+ * in range and that containers nest, but parses nothing: it fails with
+ * LEPT_PARSE_INVALID_VALUE on anything else. */
+char * lept_tape_save(const lept_tape * t, size_t * length);
+int lept_tape_load(lept_tape * t, const char * data, size_t length);
+
+/* lept_cursor_child() moves to the first element (or member value) of an
+ * array or object, lept_cursor_next() to the following one; both return 0
+ * and leave the cursor alone when there is none. lept_cursor_find() moves to
+ * the value of the member named key. */
+void lept_tape_cursor(const lept_tape * t, lept_cursor * it);
+lept_type lept_cursor_get_type(const lept_cursor * it);
+double lept_cursor_get_number(const lept_cursor * it);
+const char * lept_cursor_get_string(const lept_cursor * it);
+size_t lept_cursor_get_string_length(const lept_cursor * it);
+size_t lept_cursor_get_size(const lept_cursor * it);
+const char * lept_cursor_get_key(const lept_cursor * it);
+size_t lept_cursor_get_key_length(const lept_cursor * it);
+int lept_cursor_child(lept_cursor * it);
+int lept_cursor_next(lept_cursor * it);
+int lept_cursor_find(lept_cursor * it, const char * key, size_t klen);
+/* Builds the subtree under the cursor as a lept_value, like lept_copy(). */
+void lept_cursor_get_value(const lept_cursor * it, lept_value * v);
+void lept_cursor_get_value_with(const lept_cursor * it, lept_value * v, const lept_allocator * a);
+
+/* lept_stringify_ex() flags: LEPT_STRINGIFY_INDENT(n) puts each element on
+ * its own line indented by n spaces per level (n <= 31), SORT_KEYS writes
+ * object members in byte order of their keys for a canonical form. */
+#define LEPT_STRINGIFY_INDENT(n) ((unsigned)(n) & LEPT_STRINGIFY_INDENT_MASK)
+#define LEPT_STRINGIFY_INDENT_MASK 0x1Fu
+#define LEPT_STRINGIFY_SORT_KEYS 0x20u
+
 char* lept_stringify(const lept_value* v, size_t* length);
+char* lept_stringify_ex(const lept_value* v, size_t* length, unsigned flags);
+
+/* Writing into the caller's memory: lept_stringify_length() returns the
+ * exact length lept_stringify_ex() would produce with the same flags, and
+ * lept_stringify_to() writes that text and a NUL into buffer in one pass,
+ * without allocating as long as it fits in size bytes. When it does not, the
+ * call fails and the contents of buffer are unspecified. *length is set to
+ * the text length either way. With LEPT_STRINGIFY_SORT_KEYS the length is
+ * measured first, and the bytes of buffer past the text hold the sort;
+ * objects too big for them are written by picking members one at a time,
+ * which is quadratic in their size. */
+enum {
+	LEPT_STRINGIFY_OK,
+	LEPT_STRINGIFY_BUFFER_TOO_SMALL
+};
+
+size_t lept_stringify_length(const lept_value* v, unsigned flags);
+int lept_stringify_to(const lept_value* v, char* buffer, size_t size, size_t* length, unsigned flags);
+/* lept_free() releases a value of any depth without recursing and leaves it
+ * null. lept_free_deferred() detaches the tree at once and leaves the freeing
+ * to a background thread, keeping the teardown of a large document off the
+ * caller's path; the allocator must then accept frees from that thread.
+ * Values allocated with counters attached, and all values in builds without
+ * threads, are freed on the spot. lept_free_wait() returns once every
+ * deferred free has finished. */
 void lept_free(lept_value * v);
+void lept_free_with(lept_value * v, const lept_allocator * a);
+void lept_free_deferred(lept_value * v);
+void lept_free_deferred_with(lept_value * v, const lept_allocator * a);
+void lept_free_wait(void);
+
+/* Typed decoding: a table of lept_field describes a C struct, and JSON
+ * objects are decoded into it (and encoded from it) without building a
+ * lept_value tree. Unknown keys are skipped, missing ones leave the struct
+ * member untouched. */
+typedef enum {
+	LEPT_FIELD_NUMBER,  /* double */
+	LEPT_FIELD_INT,     /* int, the JSON number must be integral */
+	LEPT_FIELD_BOOLEAN, /* int, 0 or 1 */
+	LEPT_FIELD_STRING,  /* char*, malloc()ed and NUL-terminated, NULL for null */
+	LEPT_FIELD_STRUCT,  /* nested struct described by sub */
+	LEPT_FIELD_ARRAY    /* T*, malloc()ed, and a size_t count; sub describes a T */
+} lept_field_type;
+
+typedef struct lept_field lept_field;
+
+struct lept_field {
+	const char * name; size_t nlen;
+	size_t offset;
+	lept_field_type type;
+	const lept_field * sub; size_t nsub;
+	size_t size, count; /* arrays: element size, offset of the count member */
+};
+
+#define LEPT_FIELD(s, m, type) { #m, sizeof(#m) - 1, offsetof(s, m), type, NULL, 0, 0, 0 }
+#define LEPT_FIELD_NAMED(name, s, m, type) { name, sizeof(name) - 1, offsetof(s, m), type, NULL, 0, 0, 0 }
+#define LEPT_FIELD_SUB(s, m, sub) { #m, sizeof(#m) - 1, offsetof(s, m), LEPT_FIELD_STRUCT, sub, sizeof(sub) / sizeof((sub)[0]), 0, 0 }
+
+/* An array member m with its element count in member n. elem describes one
+ * element, by itself at offset 0: any kind but LEPT_FIELD_ARRAY, so arrays of
+ * arrays need an element struct in between. Decoding builds the whole array
+ * before replacing the old one, and an error leaves the old one in place. */
+#define LEPT_FIELD_ITEMS(s, m, n, elem) { #m, sizeof(#m) - 1, offsetof(s, m), LEPT_FIELD_ARRAY, &(elem), 1, sizeof(*((s*)0)->m), offsetof(s, n) }
+#define LEPT_FIELD_ELEMENT(type) { NULL, 0, 0, type, NULL, 0, 0, 0 }
+#define LEPT_FIELD_ELEMENT_SUB(sub) { NULL, 0, 0, LEPT_FIELD_STRUCT, sub, sizeof(sub) / sizeof((sub)[0]), 0, 0 }
+
+/* String and array members of out must be NULL or malloc()ed (arrays with
+ * their count): decoding replaces them.
+ * On error out may be partially filled; release it with lept_free_struct(). */
+int lept_parse_struct(void * out, const lept_field * fields, size_t count, const char * json);
+char* lept_stringify_struct(const void * in, const lept_field * fields, size_t count, size_t * length);
+void lept_free_struct(void * p, const lept_field * fields, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* LEPTJSON_H__ */
@@ -0,0 +1,223 @@
+#ifndef LEPTJSON_HPP__
+#define LEPTJSON_HPP__
+/* C++17 layer over leptjson.h, header only. lept::value owns a lept_value
+ * and is move-only: copies are explicit through clone(). lept::view is a
+ * non-owning, read-only handle into a tree, as cheap as the pointer it
+ * holds. Strings come back as std::string_view with their stored length,
+ * arrays and objects iterate with range-based for, and "name"_key builds a
+ * key whose length is known at compile time. Lookups by key are the linear
+ * length-and-bytes scan of lept_find_object_value(): no hashed lookup is
+ * provided. Nothing here throws: parsing returns the LEPT_PARSE_* code like
+ * the C calls do. */
+#include "leptjson.h"
+#include <cassert>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace lept {
+
+struct key {
+    std::string_view name;
+    constexpr explicit key(std::string_view s) noexcept : name(s) {}
+};
+
+namespace literals {
+constexpr key operator""_key(const char* s, std::size_t n) noexcept { return key(std::string_view(s, n)); }
+}
+
+class view;
+
+/* An object member: the key as stored, and a view of its value. */
+class member {
+public:
+    explicit member(const lept_member* m) noexcept : m_(m) {}
+    std::string_view key() const noexcept { return std::string_view(m_->k, m_->klen); }
+    inline lept::view value() const noexcept;
+private:
+    const lept_member* m_;
+};
+
+/* Random-access iteration over contiguous elements, yielding T(pointer). */
+template <class T, class E>
+class iterator {
+public:
+    explicit iterator(const E* p) noexcept : p_(p) {}
+    T operator*() const noexcept { return T(p_); }
+    iterator& operator++() noexcept { ++p_; return *this; }
+    iterator operator++(int) noexcept { iterator t(*this); ++p_; return t; }
+    iterator& operator--() noexcept { --p_; return *this; }
+    iterator& operator+=(std::ptrdiff_t n) noexcept { p_ += n; return *this; }
+    iterator operator+(std::ptrdiff_t n) const noexcept { return iterator(p_ + n); }
+    std::ptrdiff_t operator-(const iterator& o) const noexcept { return p_ - o.p_; }
+    T operator[](std::ptrdiff_t n) const noexcept { return T(p_ + n); }
+    bool operator==(const iterator& o) const noexcept { return p_ == o.p_; }
+    bool operator!=(const iterator& o) const noexcept { return p_ != o.p_; }
+private:
+    const E* p_;
+};
+
+template <class T, class E>
+class range {
+public:
+    range(const E* p, std::size_t n) noexcept : p_(p), n_(n) {}
+    iterator<T, E> begin() const noexcept { return iterator<T, E>(p_); }
+    iterator<T, E> end() const noexcept { return iterator<T, E>(p_ + n_); }
+    std::size_t size() const noexcept { return n_; }
+    bool empty() const noexcept { return n_ == 0; }
+    T operator[](std::size_t i) const noexcept { return T(p_ + i); }
+private:
+    const E* p_;
+    std::size_t n_;
+};
+
+using array_range = range<view, lept_value>;
+using object_range = range<member, lept_member>;
+
+/* Read access shared by view and value; Derived provides get(). */
+template <class Derived>
+class reader {
+public:
+    lept_type type() const noexcept { return lept_get_type(ptr()); }
+    bool is_null() const noexcept { return type() == LEPT_NULL; }
+    bool is_bool() const noexcept { return type() == LEPT_TRUE || type() == LEPT_FALSE; }
+    bool is_number() const noexcept { return type() == LEPT_NUMBER; }
+    bool is_string() const noexcept { return type() == LEPT_STRING; }
+    bool is_array() const noexcept { return type() == LEPT_ARRAY; }
+    bool is_object() const noexcept { return type() == LEPT_OBJECT; }
+
+    bool boolean() const noexcept { return type() == LEPT_TRUE; }
+    double number() const noexcept { return lept_get_number(ptr()); }
+    std::string_view string() const noexcept {
+        return std::string_view(lept_get_string(ptr()), lept_get_string_length(ptr()));
+    }
+
+    /* element or member count of an array or object */
+    std::size_t size() const noexcept {
+        return is_array() ? lept_get_array_size(ptr()) : lept_get_object_size(ptr());
+    }
+    /* the elements of an array that is not packed */
+    array_range elements() const noexcept {
+        assert(!lept_get_array_numbers(ptr()));
+        return array_range(ptr()->u.a.e, lept_get_array_size(ptr()));
+    }
+    /* the numbers of a packed array, or NULL */
+    const double* numbers() const noexcept { return lept_get_array_numbers(ptr()); }
+    object_range members() const noexcept {
+        return object_range(ptr()->u.o.m, lept_get_object_size(ptr()));
+    }
+
+    inline view operator[](std::size_t index) const noexcept;
+    /* the value of a member, or an empty view when there is none */
+    inline view find(std::string_view k) const noexcept;
+    inline view find(const key& k) const noexcept;
+    inline view operator[](const key& k) const noexcept;
+
+    std::size_t hash() const noexcept { return lept_hash(ptr()); }
+    template <class Other>
+    bool operator==(const reader<Other>& o) const noexcept { return lept_is_equal(ptr(), o.ptr()) != 0; }
+    template <class Other>
+    bool operator!=(const reader<Other>& o) const noexcept { return !(*this == o); }
+
+    /* Writes straight into the string's own buffer, no intermediate copy. */
+    std::string stringify(unsigned flags = 0) const {
+        std::string s(lept_stringify_length(ptr(), flags), '\0');
+        std::size_t length;
+        lept_stringify_to(ptr(), &s[0], s.size() + 1, &length, flags);
+        return s;
+    }
+    int stringify_to(char* buffer, std::size_t size, std::size_t* length, unsigned flags = 0) const noexcept {
+        return lept_stringify_to(ptr(), buffer, size, length, flags);
+    }
+
+    const lept_value* ptr() const noexcept { return static_cast<const Derived*>(this)->get(); }
+};
+
+class view : public reader<view> {
+public:
+    view() noexcept : v_(nullptr) {}
+    explicit view(const lept_value* v) noexcept : v_(v) {}
+    explicit operator bool() const noexcept { return v_ != nullptr; }
+    const lept_value* get() const noexcept { return v_; }
+private:
+    const lept_value* v_;
+};
+
+inline view member::value() const noexcept { return view(&m_->v); }
+
+template <class Derived>
+inline view reader<Derived>::operator[](std::size_t index) const noexcept {
+    return view(lept_get_array_element(ptr(), index));
+}
+
+template <class Derived>
+inline view reader<Derived>::find(std::string_view k) const noexcept {
+    return view(lept_find_object_value(ptr(), k.data(), k.size()));
+}
+
+template <class Derived>
+inline view reader<Derived>::find(const key& k) const noexcept {
+    return find(k.name);
+}
+
+template <class Derived>
+inline view reader<Derived>::operator[](const key& k) const noexcept {
+    return find(k.name);
+}
+
+/* Owns its tree and frees it with the allocator it was parsed with. */
+class value : public reader<value> {
+public:
+    value() noexcept : alloc_(lept_get_allocator()) { lept_init(&v_); }
+    ~value() { lept_free_with(&v_, alloc_); }
+    value(value&& o) noexcept : v_(o.v_), alloc_(o.alloc_) { lept_init(&o.v_); }
+    value& operator=(value&& o) noexcept {
+        if (this != &o) {
+            lept_free_with(&v_, alloc_);
+            v_ = o.v_;
+            alloc_ = o.alloc_;
+            lept_init(&o.v_);
+        }
+        return *this;
+    }
+    value(const value&) = delete;
+    value& operator=(const value&) = delete;
+
+    /* a deep copy, made with the global allocator */
+    value clone() const {
+        value r;
+        lept_copy(&r.v_, &v_);
+        return r;
+    }
+
+    /* json must be NUL-terminated, as for lept_parse() */
+    int parse(const char* json, const lept_parse_options* opt = nullptr) noexcept {
+        lept_free_with(&v_, alloc_);
+        alloc_ = opt && opt->alloc ? opt->alloc : lept_get_allocator();
+        return lept_parse_ex(&v_, json, opt);
+    }
+    int parse(const std::string& json, const lept_parse_options* opt = nullptr) noexcept {
+        return parse(json.c_str(), opt);
+    }
+
+    void swap(value& o) noexcept {
+        const lept_allocator* a = alloc_;
+        lept_swap(&v_, &o.v_);
+        alloc_ = o.alloc_;
+        o.alloc_ = a;
+    }
+
+    operator lept::view() const noexcept { return lept::view(&v_); }
+    const lept_value* get() const noexcept { return &v_; }
+    /* for C calls that update the value in place */
+    lept_value* get() noexcept { return &v_; }
+private:
+    lept_value v_;
+    const lept_allocator* alloc_;
+};
+
+inline void swap(value& a, value& b) noexcept { a.swap(b); }
+
+}
+
+#endif /* LEPTJSON_HPP__ */
@@ -1,5 +1,6 @@
 #include "leptjson.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 static int main_ret = 0;
 static int test_count = 0;
@@ -32,16 +33,25 @@ static int test_pass = 0;
 
 #define TEST_ERROR(err_type, json)\
 	do {\
+		lept_parse_options opt;\
+		lept_parse_error e;\
 		lept_value v;\
+		size_t offset;\
+		lept_parse_options_init(&opt);\
+		opt.error = &e;\
 		v.type = LEPT_NULL;\
 		EXPECT_EQ_INT(err_type, lept_parse(&v, json));\
 		EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+		EXPECT_EQ_INT(err_type, lept_parse_ex(&v, json, &opt));\
+		EXPECT_EQ_INT(err_type, lept_validate(json, strlen(json), &offset));\
+		EXPECT_EQ_SIZE_T(e.offset, offset);\
 	} while(0)
 
 #define TEST_NUMBER(expect, json)\
 	do {\
 		lept_value v;\
 		EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+		EXPECT_EQ_INT(LEPT_PARSE_OK, lept_validate(json, strlen(json), NULL));\
 		EXPECT_EQ_INT(LEPT_NUMBER, lept_get_type(&v));\
 		EXPECT_EQ_DOUBLE(expect, lept_get_number(&v));\
 	}while(0)
@@ -51,6 +61,7 @@ static int test_pass = 0;
 		lept_value v;\
 		lept_init(&v);\
 		EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+		EXPECT_EQ_INT(LEPT_PARSE_OK, lept_validate(json, strlen(json), NULL));\
 		EXPECT_EQ_INT(LEPT_STRING, lept_get_type(&v));\
 		EXPECT_EQ_STRING(expect, lept_get_string(&v), lept_get_string_length(&v));\
 		lept_free(&v);\
@@ -64,6 +75,9 @@ static void test_parse_all_blank() {
 static void test_parse_invalid_type() {
 	TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "nul f");
 	TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "?");
+	TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "nul");
+	TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "fals");
+	TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "trUe");
 
 	/* invalid number */
     TEST_ERROR(LEPT_PARSE_INVALID_VALUE, "+0");
@@ -297,6 +311,1094 @@ static void test_parse_object() {
     lept_free(&v);
 }
 
+#define TEST_VALIDATE(error, expect_offset, json, len)\
+    do {\
+        size_t offset = 0;\
+        EXPECT_EQ_INT(error, lept_validate(json, len, &offset));\
+        EXPECT_EQ_SIZE_T(expect_offset, offset);\
+    } while(0)
+
+static void test_validate() {
+    char deep[2 * 4097 + 1];
+    size_t i;
+
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, " { \"a\" : [ 1, -2.5e-3, true, false, null, \"\\uD834\\uDD1E\" ], \"b\" : { } } ", 72);
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, "[1,2]xyz", 5); /* only len bytes count */
+    TEST_VALIDATE(LEPT_PARSE_ALL_BLANK, 0, "", 0);
+    TEST_VALIDATE(LEPT_PARSE_ALL_BLANK, 3, "[1,2]", 3);
+    TEST_VALIDATE(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, 2, "[1,2]", 2);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_VALUE, 6, "[1,tru]", 7);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_VALUE, 4, "[tru", 4);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_VALUE, 1, "[1.]", 4);
+    TEST_VALIDATE(LEPT_PARSE_NOT_SINGLE, 5, "null x", 6);
+    TEST_VALIDATE(LEPT_PARSE_NOT_SINGLE, 1, "0\0", 2);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_STRING_CHAR, 2, "\"a\0\"", 4);
+    TEST_VALIDATE(LEPT_PARSE_MISS_QUOTATION_MARK, 4, "\"abc", 4);
+    TEST_VALIDATE(LEPT_PARSE_MISS_QUOTATION_MARK, 3, "\"ab\"", 3);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_STRING_ESCAPE, 3, "\"a\\x\"", 6);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_UNICODE_HEX, 3, "\"\\u12\"", 7);
+    TEST_VALIDATE(LEPT_PARSE_INVALID_UNICODE_SURROGATE, 7, "\"\\uD800x\"", 9);
+    TEST_VALIDATE(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, 3, "[1 2]", 5);
+    TEST_VALIDATE(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, 8, "{\"a\":[1]]", 10);
+    TEST_VALIDATE(LEPT_PARSE_MISS_KEY, 7, "{\"a\":1,}", 8);
+    TEST_VALIDATE(LEPT_PARSE_MISS_COLON, 4, "{\"a\"", 4);
+    TEST_VALIDATE(LEPT_PARSE_NUMBER_TOO_BIG, 1, "[1.7976931348623159e308]", 24);
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, "[1.7976931348623157e308,0.01e310,0.0e999,1e-400]", 48);
+    TEST_VALIDATE(LEPT_PARSE_NUMBER_TOO_BIG, 24, "[1.7976931348623157e308,0.02e310]", 33);
+
+    for (i = 0; i < 4097; i++) {
+        deep[i] = '[';
+        deep[2 * 4097 - 1 - i] = ']';
+    }
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, deep + 1, 2 * 4096);
+    TEST_VALIDATE(LEPT_PARSE_TOO_DEEP, 4096, deep, 2 * 4097);
+}
+
+static void test_parse_intern() {
+    lept_intern keys;
+    lept_parse_options opt;
+    lept_value v;
+    const lept_value* a, * b;
+    size_t i;
+
+    lept_intern_init(&keys);
+    lept_parse_options_init(&opt);
+    opt.keys = &keys;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[ {\"id\":1,\"name\":\"a\"}, {\"id\":2,\"name\":\"b\"}, {\"name\":\"c\",\"id\":3} ]", &opt));
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(&v));
+    EXPECT_EQ_SIZE_T(2, keys.size);
+    a = lept_get_array_element(&v, 0);
+    for (i = 1; i < 3; i++) {
+        b = lept_get_array_element(&v, i);
+        EXPECT_TRUE(lept_find_object_index(a, "id", 2) == 0);
+        EXPECT_TRUE(lept_get_object_key(a, 0) == lept_get_object_key(b, lept_find_object_index(b, "id", 2)));
+        EXPECT_TRUE(lept_get_object_key(a, 1) == lept_get_object_key(b, lept_find_object_index(b, "name", 4)));
+    }
+    EXPECT_TRUE(lept_intern_key(&keys, "name", 4) == lept_get_object_key(a, 1));
+    EXPECT_EQ_DOUBLE(3.0, lept_get_number(lept_find_object_value(b, lept_intern_key(&keys, "id", 2), 2)));
+    EXPECT_EQ_SIZE_T(2, keys.size);
+    lept_free(&v);
+
+    /* a shared table keeps keys across parses, failed ones included */
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, lept_parse_ex(&v, "{\"id\":1,\"extra\":2", &opt));
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COLON, lept_parse_ex(&v, "{\"id\":1,\"other\"}", &opt));
+    EXPECT_EQ_SIZE_T(4, keys.size);
+    for (i = 0; i < 100; i++) {
+        char key[8];
+        sprintf(key, "k%d", (int)i);
+        EXPECT_TRUE(lept_intern_key(&keys, key, strlen(key)) == lept_intern_key(&keys, key, strlen(key)));
+    }
+    EXPECT_EQ_SIZE_T(104, keys.size);
+    lept_intern_free(&keys);
+    EXPECT_EQ_SIZE_T(0, keys.size);
+}
+
+#define TEST_ERROR_AT(expect, expect_path, expect_line, expect_column, json)\
+    do {\
+        lept_parse_options opt;\
+        lept_parse_error e;\
+        lept_value v;\
+        lept_parse_options_init(&opt);\
+        opt.error = &e;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(expect, lept_parse_ex(&v, json, &opt));\
+        EXPECT_EQ_INT(expect, e.code);\
+        EXPECT_EQ_STRING(expect_path, e.path, strlen(e.path));\
+        EXPECT_EQ_SIZE_T(expect_line, e.line);\
+        EXPECT_EQ_SIZE_T(expect_column, e.column);\
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+    } while(0)
+
+static void test_parse_error_context() {
+    lept_parse_options opt;
+    lept_parse_error e;
+    lept_value v;
+    char deep[256];
+    size_t i;
+
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_VALUE, "$.a[2].b", 1, 19, "{\"a\":[1,2,{\"b\":tru}]}");
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_VALUE, "$.x[1]", 4, 5, "{\n  \"x\": [\n    1,\n    @\n  ]\n}");
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_STRING_ESCAPE, "$[1]", 1, 13, "[\"ok\", \"bad\\q\"]");
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_UNICODE_HEX, "$", 1, 4, "\"\\u12G4\"");
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_UNICODE_SURROGATE, "$.s", 1, 13, "{\"s\":\"\\uD800x\"}");
+    TEST_ERROR_AT(LEPT_PARSE_INVALID_VALUE, "$[\"a b\"].c", 1, 13, "{\"a b\":{\"c\":}}");
+    TEST_ERROR_AT(LEPT_PARSE_MISS_COLON, "$.k", 2, 11, "{\"k\":{\n  \"inner\" 1}}");
+    TEST_ERROR_AT(LEPT_PARSE_MISS_QUOTATION_MARK, "$[0]", 1, 6, "[\"abc");
+    TEST_ERROR_AT(LEPT_PARSE_NOT_SINGLE, "$", 1, 6, "null x");
+
+    lept_parse_options_init(&opt);
+    opt.error = &e;
+    lept_init(&v);
+
+    /* excerpt is cut at line ends and locates the error within itself */
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, lept_parse_ex(&v, "[\n\t1 2\n]", &opt));
+    EXPECT_EQ_SIZE_T(5, e.offset);
+    EXPECT_EQ_STRING(" 1 2", e.excerpt, strlen(e.excerpt));
+    EXPECT_EQ_SIZE_T(3, e.excerpt_offset);
+
+    /* long paths keep the innermost steps */
+    for (i = 0; i < 100; i++)
+        deep[i] = '[';
+    deep[i++] = 'x';
+    deep[i] = '\0';
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_parse_ex(&v, deep, &opt));
+    EXPECT_EQ_SIZE_T(100, e.offset);
+    EXPECT_EQ_INT(0, memcmp(e.path, "...", 3));
+    EXPECT_EQ_INT(0, strcmp(e.path + strlen(e.path) - 6, "[0][0]"));
+    EXPECT_TRUE(strlen(e.excerpt) < LEPT_ERROR_EXCERPT_SIZE);
+    EXPECT_EQ_INT('x', e.excerpt[e.excerpt_offset]);
+
+    /* success only reports the code */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[1,2]}", &opt));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, e.code);
+    lept_free(&v);
+}
+
+#define TEST_UTF8(expect, expect_offset, json)\
+    do {\
+        lept_parse_options opt;\
+        lept_parse_error e;\
+        lept_value v;\
+        lept_parse_options_init(&opt);\
+        opt.error = &e;\
+        opt.flags = LEPT_PARSE_STRICT_UTF8;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(expect, lept_parse_ex(&v, json, &opt));\
+        if (expect != LEPT_PARSE_OK) {\
+            EXPECT_EQ_SIZE_T(expect_offset, e.offset);\
+            EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+        }\
+        lept_free(&v);\
+    } while(0)
+
+static void test_parse_strict_utf8() {
+    lept_value v;
+
+    TEST_UTF8(LEPT_PARSE_OK, 0, "\"\xC3\xA9\xE2\x82\xAC\xF0\x9D\x84\x9E\xF4\x8F\xBF\xBF\xEF\xBF\xBF\"");
+    TEST_UTF8(LEPT_PARSE_OK, 0, "{\"caf\xC3\xA9\":\"0123456789abcdef0123456789abcdef\xC3\xA9\\u00e9\"}");
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\x80\"");
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 3, "\"ab\xC0\xAF\"");             /* overlong '/' */
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xE0\x80\xAF\"");           /* overlong, 3 bytes */
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xED\xA0\x80\"");           /* U+D800 */
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xF4\x90\x80\x80\"");       /* U+110000 */
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xF5\x80\x80\x80\"");
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xE2\x82\"");               /* truncated by the quote */
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 1, "\"\xE2\x82x\"");
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 38, "[\"0123456789abcdef0123456789abcdef\", \"\xFF\"]");
+    TEST_UTF8(LEPT_PARSE_INVALID_UTF8, 34, "{\"0123456789abcdef0123456789abcdef\xC3\":1}");
+    TEST_UTF8(LEPT_PARSE_OK, 0, "\"\\uD834\\uDD1E\"");
+    TEST_UTF8(LEPT_PARSE_INVALID_UNICODE_SURROGATE, 6, "\"\\uDC00\"");    /* lone low surrogate */
+    TEST_UTF8(LEPT_PARSE_INVALID_UNICODE_SURROGATE, 8, "[\"a\\uDFFFb\"]");
+    TEST_UTF8(LEPT_PARSE_INVALID_UNICODE_SURROGATE, 7, "{\"\\uDC00\":1}");
+
+    /* without the flag the bytes are kept as they are */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "\"\xC0\xAF\""));
+    EXPECT_EQ_STRING("\xC0\xAF", lept_get_string(&v), lept_get_string_length(&v));
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "\"\\uDC00\""));
+    EXPECT_EQ_STRING("\xED\xB0\x80", lept_get_string(&v), lept_get_string_length(&v));
+    lept_free(&v);
+}
+
+#define TEST_PROJECT(expect, json, paths)\
+    do {\
+        lept_parse_options opt;\
+        lept_value v, e;\
+        lept_parse_options_init(&opt);\
+        opt.keep = paths;\
+        opt.nkeep = sizeof(paths) / sizeof(paths[0]);\
+        lept_init(&v);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, expect));\
+        EXPECT_TRUE(lept_is_equal(&e, &v));\
+        lept_free(&v);\
+        lept_free(&e);\
+    } while(0)
+
+#define TEST_PROJECT_ERROR(error, json, paths)\
+    do {\
+        lept_parse_options opt;\
+        lept_value v;\
+        lept_parse_options_init(&opt);\
+        opt.keep = paths;\
+        opt.nkeep = sizeof(paths) / sizeof(paths[0]);\
+        lept_init(&v);\
+        EXPECT_EQ_INT(error, lept_parse_ex(&v, json, &opt));\
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+    } while(0)
+
+static void test_parse_project() {
+    static const char* const id[] = { "/id" };
+    static const char* const some[] = { "/user/name", "/items/*/id" };
+    static const char* const item[] = { "/items/1" };
+    static const char* const all[] = { "/nothing", "" };
+    static const char* const user[] = { "/user" };
+    static const char* const below_scalar[] = { "/n/x" };
+    static const char* const escaped[] = { "/a~1b", "/m~0n" };
+    static const char* const any_key[] = { "/*/id" };
+    static const char* const skip[] = { "/keep" };
+    static const char* const empty_key[] = { "/" };
+    static const char* const after_empty[] = { "/a" };
+    const char* doc = "{\"id\":1,\"user\":{\"name\":\"x\",\"bio\":\"a \\\"}]\\\" \\\\\",\"tags\":[1,2]},"
+        "\"items\":[{\"id\":1,\"v\":[1]},{\"id\":2,\"v\":{}}],\"skip\":[{\"deep\":[[[\"}\"]]]}, -1.5e3, true],\"n\":null}";
+    lept_parse_options opt;
+    lept_parse_error err;
+    lept_value v;
+
+    TEST_PROJECT("{\"id\":1}", doc, id);
+    TEST_PROJECT("{\"user\":{\"name\":\"x\"},\"items\":[{\"id\":1},{\"id\":2}]}", doc, some);
+    TEST_PROJECT("{\"items\":[{\"id\":2,\"v\":{}}]}", doc, item);
+    TEST_PROJECT(doc, doc, all);
+    TEST_PROJECT("{\"user\":{\"name\":\"x\",\"bio\":\"a \\\"}]\\\" \\\\\",\"tags\":[1,2]}}", doc, user);
+    TEST_PROJECT("{}", doc, below_scalar);
+    TEST_PROJECT("{\"a/b\":1,\"m~n\":2}", "{\"a/b\":1,\"c\":[3],\"m~n\":2}", escaped);
+    TEST_PROJECT("{\"x\":{\"id\":1},\"z\":{\"id\":3},\"w\":{}}", "{\"x\":{\"id\":1,\"y\":2},\"z\":{\"id\":3},\"w\":{\"y\":4},\"v\":5}", any_key);
+    TEST_PROJECT("[]", "[{\"id\":1}]", id);
+    TEST_PROJECT("null", " 3 ", id);
+    TEST_PROJECT("{\"\":1}", "{\"\":1,\"a\":2}", empty_key);
+    TEST_PROJECT("{\"a\":2}", "{\"\":1,\"a\":2}", after_empty);
+
+    /* skipped text is only checked for quoting and nesting */
+    TEST_PROJECT("{\"keep\":1}", "{\"skip\":[nul, 1 2 {\"\\q\":x}],\"keep\":1}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_MISS_QUOTATION_MARK, "{\"skip\":\"abc", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_INVALID_STRING_CHAR, "{\"skip\":\"a\x01\"}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"skip\":[1}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"skip\":{\"a\":[}]}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"skip\":{\"a\":1", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_INVALID_VALUE, "{\"skip\":,\"keep\":1}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_MISS_COLON, "{\"skip\" 1}", skip);
+    TEST_PROJECT_ERROR(LEPT_PARSE_NOT_SINGLE, "{\"skip\":1} x", skip);
+
+    /* kept values are still fully checked, and errors carry their path */
+    lept_parse_options_init(&opt);
+    opt.keep = some;
+    opt.nkeep = 2;
+    opt.error = &err;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_parse_ex(&v, "{\"items\":[{\"v\":[x]},{\"id\":tru}]}", &opt));
+    EXPECT_EQ_STRING("$.items[1].id", err.path, strlen(err.path));
+}
+
+#define TEST_TAPE(json)\
+    do {\
+        lept_tape t, l;\
+        lept_cursor it;\
+        lept_value v, e;\
+        char* saved;\
+        size_t length;\
+        lept_init(&v);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_tape(&t, json, NULL));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, json));\
+        lept_tape_cursor(&t, &it);\
+        lept_cursor_get_value(&it, &v);\
+        EXPECT_TRUE(lept_is_equal(&e, &v));\
+        saved = lept_tape_save(&t, &length);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_tape_load(&l, saved, length));\
+        lept_tape_cursor(&l, &it);\
+        lept_cursor_get_value(&it, &v);\
+        EXPECT_TRUE(lept_is_equal(&e, &v));\
+        free(saved);\
+        lept_tape_free(&t);\
+        lept_tape_free(&l);\
+        lept_free(&v);\
+        lept_free(&e);\
+    } while(0)
+
+#define TEST_TAPE_ERROR(error, json)\
+    do {\
+        lept_tape t;\
+        EXPECT_EQ_INT(error, lept_parse_tape(&t, json, NULL));\
+        EXPECT_EQ_SIZE_T(0, t.nwords);\
+    } while(0)
+
+static void test_tape() {
+    const char* doc = "{\"a\":[1,\"x\",{\"b\":null}],\"c\":{\"d\":true,\"e\":[]},\"f\":\"\\u0000z\",\"g\":-2.5}";
+    lept_tape t, l;
+    lept_cursor it, c;
+    lept_parse_options opt;
+    lept_parse_error err;
+    char* saved;
+    size_t length;
+
+    TEST_TAPE("null");
+    TEST_TAPE(" 1.5e3 ");
+    TEST_TAPE("\"\"");
+    TEST_TAPE("[]");
+    TEST_TAPE("{}");
+    TEST_TAPE("[[[]],{},[{}],\"\",0]");
+    TEST_TAPE("{\"\":{\"\":[null,true,false]},\"k\":\"\\ud834\\udd1e\"}");
+    TEST_TAPE(doc);
+
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_tape(&t, doc, NULL));
+    lept_tape_cursor(&t, &it);
+    EXPECT_EQ_INT(LEPT_OBJECT, lept_cursor_get_type(&it));
+    EXPECT_EQ_SIZE_T(4, lept_cursor_get_size(&it));
+    c = it;
+    EXPECT_TRUE(lept_cursor_child(&c));
+    EXPECT_EQ_STRING("a", lept_cursor_get_key(&c), lept_cursor_get_key_length(&c));
+    EXPECT_EQ_SIZE_T(3, lept_cursor_get_size(&c));
+    EXPECT_TRUE(lept_cursor_next(&c)); /* over the whole array */
+    EXPECT_EQ_STRING("c", lept_cursor_get_key(&c), lept_cursor_get_key_length(&c));
+    EXPECT_TRUE(lept_cursor_next(&c));
+    EXPECT_EQ_STRING("f", lept_cursor_get_key(&c), lept_cursor_get_key_length(&c));
+    EXPECT_EQ_STRING("\0z", lept_cursor_get_string(&c), lept_cursor_get_string_length(&c));
+    EXPECT_TRUE(lept_cursor_next(&c));
+    EXPECT_EQ_DOUBLE(-2.5, lept_cursor_get_number(&c));
+    EXPECT_FALSE(lept_cursor_next(&c));
+    EXPECT_EQ_STRING("g", lept_cursor_get_key(&c), lept_cursor_get_key_length(&c));
+
+    c = it;
+    EXPECT_TRUE(lept_cursor_find(&c, "c", 1));
+    EXPECT_TRUE(lept_cursor_find(&c, "e", 1));
+    EXPECT_EQ_INT(LEPT_ARRAY, lept_cursor_get_type(&c));
+    EXPECT_EQ_SIZE_T(0, lept_cursor_get_size(&c));
+    EXPECT_FALSE(lept_cursor_child(&c));
+    EXPECT_FALSE(lept_cursor_find(&it, "b", 1));
+    EXPECT_EQ_SIZE_T(0, it.pos);
+    c = it;
+    EXPECT_TRUE(lept_cursor_find(&c, "a", 1));
+    EXPECT_TRUE(lept_cursor_child(&c));
+    EXPECT_EQ_DOUBLE(1.0, lept_cursor_get_number(&c));
+    EXPECT_TRUE(lept_cursor_next(&c));
+    EXPECT_EQ_STRING("x", lept_cursor_get_string(&c), lept_cursor_get_string_length(&c));
+    EXPECT_TRUE(lept_cursor_next(&c));
+    EXPECT_TRUE(lept_cursor_find(&c, "b", 1));
+    EXPECT_EQ_INT(LEPT_NULL, lept_cursor_get_type(&c));
+    EXPECT_FALSE(lept_cursor_next(&c));
+
+    /* a damaged image is refused rather than walked */
+    saved = lept_tape_save(&t, &length);
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length - 1));
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, 3));
+    saved[length - 1] = 'x'; /* the last string's NUL */
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    saved[length - 1] = '\0';
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_tape_load(&l, saved, length));
+    lept_tape_free(&l);
+    memcpy(saved + 16, &t.words[2], sizeof(lept_tape_word)); /* root starts with a key */
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    memcpy(saved + 16, &t.words[0], sizeof(lept_tape_word));
+    ((lept_tape_word*)(saved + 16))[2].w.arg = 1; /* array end before its start */
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    ((lept_tape_word*)(saved + 16))[2].w.arg = (unsigned)t.nwords;
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    ((lept_tape_word*)(saved + 16))[2].w.arg = t.words[2].w.arg;
+    ((lept_tape_word*)(saved + 16))[1].w.arg = (unsigned)t.nstrings;
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    ((lept_tape_word*)(saved + 16))[1].w.arg = t.words[1].w.arg;
+    saved[0] ^= 1;
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_tape_load(&l, saved, length));
+    EXPECT_EQ_SIZE_T(0, l.nwords);
+    free(saved);
+    lept_tape_free(&t);
+
+    TEST_TAPE_ERROR(LEPT_PARSE_ALL_BLANK, " ");
+    TEST_TAPE_ERROR(LEPT_PARSE_NOT_SINGLE, "[] 1");
+    TEST_TAPE_ERROR(LEPT_PARSE_INVALID_VALUE, "[nul]");
+    TEST_TAPE_ERROR(LEPT_PARSE_MISS_QUOTATION_MARK, "[\"a");
+    TEST_TAPE_ERROR(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[1}");
+    TEST_TAPE_ERROR(LEPT_PARSE_MISS_KEY, "{1:2}");
+    TEST_TAPE_ERROR(LEPT_PARSE_MISS_COLON, "{\"a\" 2}");
+    TEST_TAPE_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":2");
+
+    lept_parse_options_init(&opt);
+    opt.error = &err;
+    opt.flags = LEPT_PARSE_STRICT_UTF8;
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_UTF8, lept_parse_tape(&t, "{\"a\":[0,{\"b\":\"\xc0\xaf\"}]}", &opt));
+    EXPECT_EQ_STRING("$.a[1].b", err.path, strlen(err.path));
+}
+
+typedef struct {
+    double x, y;
+} test_point;
+
+typedef struct {
+    int id;
+    char* name;
+    int active;
+    double score;
+    test_point pos;
+} test_record;
+
+static const lept_field test_point_fields[] = {
+    LEPT_FIELD(test_point, x, LEPT_FIELD_NUMBER),
+    LEPT_FIELD(test_point, y, LEPT_FIELD_NUMBER)
+};
+
+static const lept_field test_record_fields[] = {
+    LEPT_FIELD(test_record, id, LEPT_FIELD_INT),
+    LEPT_FIELD(test_record, name, LEPT_FIELD_STRING),
+    LEPT_FIELD_NAMED("is_active", test_record, active, LEPT_FIELD_BOOLEAN),
+    LEPT_FIELD(test_record, score, LEPT_FIELD_NUMBER),
+    LEPT_FIELD_SUB(test_record, pos, test_point_fields)
+};
+
+#define TEST_RECORD_FIELDS test_record_fields, sizeof(test_record_fields) / sizeof(test_record_fields[0])
+
+typedef struct {
+    char** tags; size_t ntags;
+    int* ids; size_t nids;
+    test_point* path; size_t npath;
+} test_route;
+
+static const lept_field test_tag_element = LEPT_FIELD_ELEMENT(LEPT_FIELD_STRING);
+static const lept_field test_id_element = LEPT_FIELD_ELEMENT(LEPT_FIELD_INT);
+static const lept_field test_point_element = LEPT_FIELD_ELEMENT_SUB(test_point_fields);
+
+static const lept_field test_route_fields[] = {
+    LEPT_FIELD_ITEMS(test_route, tags, ntags, test_tag_element),
+    LEPT_FIELD_ITEMS(test_route, ids, nids, test_id_element),
+    LEPT_FIELD_ITEMS(test_route, path, npath, test_point_element)
+};
+
+#define TEST_ROUTE_FIELDS test_route_fields, sizeof(test_route_fields) / sizeof(test_route_fields[0])
+
+#define TEST_STRUCT_ERROR(error, json)\
+    do {\
+        test_record r;\
+        memset(&r, 0, sizeof(r));\
+        EXPECT_EQ_INT(error, lept_parse_struct(&r, TEST_RECORD_FIELDS, json));\
+        lept_free_struct(&r, TEST_RECORD_FIELDS);\
+    } while(0)
+
+static void test_parse_struct() {
+    test_record r;
+    char* json;
+    size_t length;
+
+    memset(&r, 0, sizeof(r));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_RECORD_FIELDS,
+        " { \"id\" : 7, \"name\" : \"a\\u00A2b\", \"skip\" : [ 1, { \"k\" : [ \"v\", null ] } ], \"is_active\" : true,"
+        " \"pos\" : { \"y\" : -2.5, \"z\" : {}, \"x\" : 1e3 }, \"score\" : 0.25, \"name\" : \"xiaoma\" } "));
+    EXPECT_EQ_INT(7, r.id);
+    EXPECT_EQ_STRING("xiaoma", r.name, strlen(r.name));
+    EXPECT_EQ_INT(1, r.active);
+    EXPECT_EQ_DOUBLE(0.25, r.score);
+    EXPECT_EQ_DOUBLE(1000.0, r.pos.x);
+    EXPECT_EQ_DOUBLE(-2.5, r.pos.y);
+
+    json = lept_stringify_struct(&r, TEST_RECORD_FIELDS, &length);
+    EXPECT_EQ_STRING("{\"id\":7,\"name\":\"xiaoma\",\"is_active\":true,\"score\":0.25,\"pos\":{\"x\":1000,\"y\":-2.5}}", json, length);
+    free(json);
+
+    lept_free_struct(&r, TEST_RECORD_FIELDS);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_RECORD_FIELDS, "{\"name\":\"\",\"id\":7}"));
+    EXPECT_EQ_SIZE_T(0, strlen(r.name));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_RECORD_FIELDS, "{\"name\":\"xiaoma\"}"));
+
+    /* missing keys are left alone, null clears a string */
+    r.id = 0;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_RECORD_FIELDS, "{\"name\":null}"));
+    EXPECT_TRUE(r.name == NULL);
+    EXPECT_EQ_INT(0, r.id);
+    EXPECT_EQ_DOUBLE(0.25, r.score);
+    json = lept_stringify_struct(&r, TEST_RECORD_FIELDS, &length);
+    EXPECT_EQ_STRING("{\"id\":0,\"name\":null,\"is_active\":true,\"score\":0.25,\"pos\":{\"x\":1000,\"y\":-2.5}}", json, length);
+    free(json);
+    lept_free_struct(&r, TEST_RECORD_FIELDS);
+
+    TEST_STRUCT_ERROR(LEPT_PARSE_ALL_BLANK, " ");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "[]");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"id\":1.5}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"id\":\"1\"}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"name\":\"a\",\"is_active\":1}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"pos\":[]}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"score\":{}}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_NOT_SINGLE, "{} x");
+    TEST_STRUCT_ERROR(LEPT_PARSE_MISS_KEY, "{\"skip\":{1:2}}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_MISS_COLON, "{\"name\"}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"skip\":[1 2]}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"name\":\"a\" \"id\":1}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_INVALID_VALUE, "{\"skip\":[nul]}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_INVALID_STRING_ESCAPE, "{\"skip\":\"\\v\"}");
+    TEST_STRUCT_ERROR(LEPT_PARSE_TYPE_MISMATCH, "{\"score\":[]}");
+}
+
+static void test_parse_struct_array() {
+    test_route r;
+    char* json;
+    size_t length;
+
+    memset(&r, 0, sizeof(r));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_ROUTE_FIELDS,
+        "{\"tags\":[\"a\",null,\"bc\"],\"ids\":[1,2,3,4,5,6,7],\"path\":[{\"x\":1,\"y\":2},{\"y\":-1}]}"));
+    EXPECT_EQ_SIZE_T(3, r.ntags);
+    EXPECT_EQ_STRING("a", r.tags[0], strlen(r.tags[0]));
+    EXPECT_TRUE(r.tags[1] == NULL);
+    EXPECT_EQ_STRING("bc", r.tags[2], strlen(r.tags[2]));
+    EXPECT_EQ_SIZE_T(7, r.nids);
+    EXPECT_EQ_INT(7, r.ids[6]);
+    EXPECT_EQ_SIZE_T(2, r.npath);
+    EXPECT_EQ_DOUBLE(2.0, r.path[0].y);
+    EXPECT_EQ_DOUBLE(0.0, r.path[1].x); /* elements start zeroed */
+    EXPECT_EQ_DOUBLE(-1.0, r.path[1].y);
+
+    json = lept_stringify_struct(&r, TEST_ROUTE_FIELDS, &length);
+    EXPECT_EQ_STRING("{\"tags\":[\"a\",null,\"bc\"],\"ids\":[1,2,3,4,5,6,7],\"path\":[{\"x\":1,\"y\":2},{\"x\":0,\"y\":-1}]}", json, length);
+    free(json);
+
+    /* a new array replaces the old one, a failed one leaves it alone */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"tags\":[],\"ids\":[ 9 ]}"));
+    EXPECT_EQ_SIZE_T(0, r.ntags);
+    EXPECT_TRUE(r.tags == NULL);
+    EXPECT_EQ_SIZE_T(1, r.nids);
+    EXPECT_EQ_INT(9, r.ids[0]);
+    EXPECT_EQ_INT(LEPT_PARSE_TYPE_MISMATCH, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"ids\":[1,2,3,4,5,1.5]}"));
+    EXPECT_EQ_INT(LEPT_PARSE_TYPE_MISMATCH, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"path\":[{\"x\":1},{\"x\":true}]}"));
+    EXPECT_EQ_INT(LEPT_PARSE_TYPE_MISMATCH, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"tags\":[\"a\",[]]}"));
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"tags\":[\"a\" \"b\"]}"));
+    EXPECT_EQ_INT(LEPT_PARSE_TYPE_MISMATCH, lept_parse_struct(&r, TEST_ROUTE_FIELDS, "{\"tags\":{}}"));
+    EXPECT_EQ_SIZE_T(1, r.nids);
+    EXPECT_EQ_INT(9, r.ids[0]);
+    EXPECT_EQ_SIZE_T(2, r.npath);
+    lept_free_struct(&r, TEST_ROUTE_FIELDS);
+    EXPECT_TRUE(r.ids == NULL && r.nids == 0 && r.path == NULL && r.npath == 0);
+}
+
+typedef struct {
+    size_t allocs, frees;
+} test_arena;
+
+static void* test_arena_malloc(void* ud, size_t size) {
+    ((test_arena*)ud)->allocs++;
+    return malloc(size);
+}
+
+static void* test_arena_realloc(void* ud, void* p, size_t old_size, size_t size) {
+    (void)old_size;
+    if (!p)
+        ((test_arena*)ud)->allocs++;
+    return realloc(p, size);
+}
+
+static void test_arena_free(void* ud, void* p) {
+    ((test_arena*)ud)->frees++;
+    free(p);
+}
+
+static void test_allocator() {
+    lept_alloc_stats stats;
+    test_arena arena = { 0, 0 };
+    lept_allocator a = { test_arena_malloc, test_arena_realloc, test_arena_free, NULL, NULL };
+    lept_parse_options opt;
+    lept_value v, c;
+    lept_intern keys;
+    lept_tape t;
+    lept_cursor it;
+    char long_string[1024];
+    char* json;
+
+    /* per-parse allocator */
+    a.ud = &arena;
+    memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[ \"abc\", [ 1, 2 ], \"\" ]", &opt));
+    EXPECT_EQ_SIZE_T(4, stats.allocs); /* two arrays, two strings */
+    EXPECT_EQ_SIZE_T(1, stats.reallocs); /* the parse stack */
+    EXPECT_EQ_SIZE_T(0, stats.stack_grows);
+    EXPECT_EQ_SIZE_T(2 * sizeof(lept_value) + 3 * sizeof(lept_value) + 4 + 1, stats.live);
+    EXPECT_TRUE(stats.peak > stats.live);
+    EXPECT_EQ_SIZE_T(1, arena.frees); /* only the stack is gone */
+    lept_free_with(&v, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+    EXPECT_EQ_SIZE_T(stats.allocs + 1, stats.frees);
+
+    memset(long_string, 'x', sizeof(long_string));
+    long_string[0] = '"';
+    long_string[sizeof(long_string) - 2] = '"';
+    long_string[sizeof(long_string) - 1] = '\0';
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, long_string, &opt));
+    EXPECT_TRUE(stats.stack_grows > 0);
+    lept_free_with(&v, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+
+    /* copies and updates of such a value stay with its allocator */
+    lept_intern_init_with(&keys, &a);
+    opt.keys = &keys;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[\"b\",{\"c\":1}]}", &opt));
+    opt.keys = NULL;
+    lept_init(&c);
+    lept_copy_with(&c, &v, &a);
+    EXPECT_TRUE(lept_is_equal(&c, &v));
+    lept_set_string_with(&c, "d", 1, &a);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_tape(&t, "[true,{\"e\":\"f\"}]", NULL));
+    lept_tape_cursor(&t, &it);
+    lept_cursor_get_value_with(&it, &c, &a);
+    EXPECT_EQ_SIZE_T(2, lept_get_array_size(&c));
+    lept_tape_free(&t);
+    lept_free_with(&c, &a);
+    lept_free_with(&v, &a);
+    lept_intern_free(&keys);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+
+    /* global allocator */
+    lept_set_allocator(&a);
+    EXPECT_TRUE(lept_get_allocator()->ud == &arena);
+    memset(&stats, 0, sizeof(stats));
+    lept_set_string(&v, "abc", 3);
+    EXPECT_EQ_SIZE_T(1, stats.allocs);
+    json = lept_stringify(&v, NULL);
+    EXPECT_EQ_SIZE_T(2, stats.allocs);
+    EXPECT_EQ_SIZE_T(4, stats.live); /* the output buffer is the caller's */
+    lept_get_allocator()->free(lept_get_allocator()->ud, json);
+    lept_free(&v);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    lept_set_allocator(NULL);
+    EXPECT_TRUE(lept_get_allocator()->stats == NULL);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+}
+
+static void test_free() {
+    lept_alloc_stats stats;
+    test_arena arena = { 0, 0 };
+    lept_allocator a = { test_arena_malloc, test_arena_realloc, test_arena_free, NULL, NULL };
+    lept_parse_options opt;
+    lept_value v, * e;
+    lept_member* m;
+    size_t i;
+
+    /* objects give back their members and keys */
+    a.ud = &arena;
+    memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":{\"b\":[1,\"x\",{},[]]},\"\":\"d\",\"e\":[{\"f\":null}]}", &opt));
+    lept_free_with(&v, &a);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+
+    /* far deeper than the C stack allows to recurse; built by hand since the
+     * parser itself recurses */
+    lept_init(&v);
+    for (i = 0; i < 1000000; i++) {
+        if (i % 2) {
+            e = (lept_value*)malloc(2 * sizeof(lept_value));
+            e[0] = v;
+            lept_init(&e[1]);
+            lept_set_string(&e[1], "x", 1);
+            v.type = LEPT_ARRAY;
+            v.u.a.e = e;
+            v.u.a.size = 2;
+        }
+        else {
+            m = (lept_member*)malloc(sizeof(lept_member));
+            m->k = (char*)malloc(2);
+            strcpy(m->k, "k");
+            m->klen = 1;
+            m->v = v;
+            v.type = LEPT_OBJECT;
+            v.u.o.m = m;
+            v.u.o.size = 1;
+        }
+        v.flags = 0;
+    }
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+
+    /* deferred: detached at once, freed on another thread */
+    a.stats = NULL;
+    arena.allocs = arena.frees = 0;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[{\"a\":[1,2,\"3\"]},{\"b\":{}}]", &opt));
+    lept_free_deferred_with(&v, &a);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    lept_free_wait();
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+
+    /* counters are not shared with the reclaimer: freed on the spot */
+    a.stats = &stats;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[\"b\"]}", &opt));
+    lept_free_deferred_with(&v, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+
+    lept_set_string(&v, "abc", 3);
+    lept_free_deferred(&v);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    lept_free_wait();
+}
+
+static void test_load_files() {
+    static const char* texts[] = { "{\"a\":[1,2]}", "[1", "\"\\u0041\"", "" };
+    const char* paths[] = { "lept_load_0.json", "lept_load_1.json", "lept_load_2.json", "lept_load_3.json", "lept_load_missing.json" };
+    lept_load_result results[5], many[41];
+    const char* many_paths[41];
+    char names[40][32];
+    lept_alloc_stats stats;
+    lept_allocator a = *lept_get_allocator();
+    lept_parse_options opt;
+    char big[10000];
+    size_t i;
+    unsigned threads;
+    FILE* f;
+
+    for (i = 0; i < 4; i++) {
+        f = fopen(paths[i], "wb");
+        fputs(texts[i], f);
+        if (i == 3) { /* larger than the first read buffer */
+            memset(big, ' ', sizeof(big));
+            big[sizeof(big) / 2] = '0';
+            fwrite(big, 1, sizeof(big), f);
+        }
+        fclose(f);
+    }
+    memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    for (threads = 0; threads <= 3; threads += 3) {
+        opt.threads = threads;
+        EXPECT_EQ_SIZE_T(2, lept_load_files(results, paths, 5, &opt));
+        EXPECT_EQ_INT(LEPT_PARSE_OK, results[0].error.code);
+        EXPECT_EQ_SIZE_T(2, lept_get_array_size(lept_find_object_value(&results[0].v, "a", 1)));
+        EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, results[1].error.code);
+        EXPECT_EQ_SIZE_T(2, results[1].error.offset);
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&results[1].v));
+        EXPECT_EQ_STRING("A", lept_get_string(&results[2].v), lept_get_string_length(&results[2].v));
+        EXPECT_EQ_DOUBLE(0.0, lept_get_number(&results[3].v));
+        EXPECT_EQ_INT(LEPT_PARSE_READ_ERROR, results[4].error.code);
+        EXPECT_TRUE(results[4].sys_errno != 0);
+        EXPECT_EQ_INT(0, results[0].sys_errno);
+        for (i = 0; i < 5; i++)
+            lept_free_with(&results[i].v, &a);
+        /* the workers' counts are added to the caller's */
+        EXPECT_TRUE(stats.allocs > 0);
+        EXPECT_EQ_SIZE_T(0, stats.live);
+    }
+    EXPECT_EQ_SIZE_T(0, lept_load_files(results, NULL, 0, NULL));
+    for (i = 0; i < 4; i++)
+        remove(paths[i]);
+
+    /* more files than a worker keeps in flight, and a directory */
+    for (i = 0; i < 40; i++) {
+        sprintf(names[i], "lept_load_many_%d.json", (int)i);
+        f = fopen(names[i], "wb");
+        fprintf(f, "[%d]", (int)i);
+        fclose(f);
+        many_paths[i] = names[i];
+    }
+    many_paths[40] = ".";
+    for (threads = 0; threads <= 3; threads += 3) {
+        opt.threads = threads;
+        EXPECT_EQ_SIZE_T(1, lept_load_files(many, many_paths, 41, &opt));
+        for (i = 0; i < 40; i++)
+            EXPECT_EQ_DOUBLE((double)i, lept_get_number(lept_get_array_element(&many[i].v, 0)));
+        EXPECT_EQ_INT(LEPT_PARSE_READ_ERROR, many[40].error.code);
+        EXPECT_TRUE(many[40].sys_errno != 0);
+        for (i = 0; i < 41; i++)
+            lept_free_with(&many[i].v, &a);
+        EXPECT_EQ_SIZE_T(0, stats.live);
+    }
+    for (i = 0; i < 40; i++)
+        remove(names[i]);
+}
+
+#ifdef LEPT_TRACE
+static unsigned long test_clock_ticks;
+static size_t test_events[16], test_event_count;
+
+static unsigned long test_clock(void* ud) {
+    (void)ud;
+    return ++test_clock_ticks;
+}
+
+static void test_trace_hook(void* ud, unsigned event, size_t arg) {
+    (void)ud;
+    if (test_event_count + 2 <= sizeof(test_events) / sizeof(test_events[0])) {
+        test_events[test_event_count++] = event;
+        test_events[test_event_count++] = arg;
+    }
+}
+
+static void test_trace() {
+    lept_parse_options opt;
+    lept_trace trace;
+    lept_value v;
+    char buffer[64];
+    char* json;
+    size_t length, i, ticks;
+
+    memset(&trace, 0, sizeof(trace));
+    trace.clock = test_clock;
+    lept_parse_options_init(&opt);
+    opt.trace = &trace;
+    opt.threads = 4; /* ignored while tracing */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, " {\"a\" : [1, \"x\\ny\", true, null, {}], \"bc\": -2.5} ", &opt));
+    EXPECT_EQ_SIZE_T(1, trace.nodes[LEPT_NULL]);
+    EXPECT_EQ_SIZE_T(0, trace.nodes[LEPT_FALSE]);
+    EXPECT_EQ_SIZE_T(1, trace.nodes[LEPT_TRUE]);
+    EXPECT_EQ_SIZE_T(2, trace.nodes[LEPT_NUMBER]);
+    EXPECT_EQ_SIZE_T(1, trace.nodes[LEPT_STRING]);
+    EXPECT_EQ_SIZE_T(1, trace.nodes[LEPT_ARRAY]);
+    EXPECT_EQ_SIZE_T(2, trace.nodes[LEPT_OBJECT]);
+    EXPECT_EQ_SIZE_T(6, trace.unescaped); /* a, x\ny, bc */
+    EXPECT_EQ_SIZE_T(3, trace.max_depth);
+    EXPECT_EQ_SIZE_T(5 * sizeof(lept_value), trace.stack_peak);
+    /* the clock ticks once per reading: every timed span is 1 tick */
+    EXPECT_EQ_SIZE_T(3, trace.ticks[LEPT_PHASE_STRING]);
+    EXPECT_EQ_SIZE_T(2, trace.ticks[LEPT_PHASE_NUMBER]);
+    EXPECT_EQ_SIZE_T(2, trace.ticks[LEPT_PHASE_CONTAINER]); /* {} has nothing to assemble */
+    EXPECT_TRUE(trace.ticks[LEPT_PHASE_WHITESPACE] > 0);
+    for (i = 0, ticks = 0; i < LEPT_PHASES; i++)
+        ticks += trace.ticks[i];
+    EXPECT_EQ_SIZE_T(test_clock_ticks / 2, ticks);
+
+    lept_free(&v);
+
+    /* counters add up over documents */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[[[[\"\"]]]]", &opt));
+    EXPECT_EQ_SIZE_T(2, trace.nodes[LEPT_STRING]);
+    EXPECT_EQ_SIZE_T(5, trace.nodes[LEPT_ARRAY]);
+    EXPECT_EQ_SIZE_T(4, trace.max_depth);
+    lept_free(&v);
+
+    /* entry and exit hooks */
+    lept_set_trace_hook(test_trace_hook, NULL);
+    test_event_count = 0;
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, lept_parse(&v, "[1"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "[1,2]"));
+    json = lept_stringify(&v, &length);
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, sizeof(buffer), &length, 0));
+    lept_free(&v);
+    lept_set_trace_hook(NULL, NULL);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "[]"));
+    EXPECT_EQ_SIZE_T(16, test_event_count);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_PARSE_BEGIN, test_events[0]);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_PARSE_END, test_events[2]);
+    EXPECT_EQ_SIZE_T(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, test_events[3]);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_PARSE_END, test_events[6]);
+    EXPECT_EQ_SIZE_T(LEPT_PARSE_OK, test_events[7]);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_STRINGIFY_BEGIN, test_events[8]);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_STRINGIFY_END, test_events[10]);
+    EXPECT_EQ_SIZE_T(5, test_events[11]);
+    EXPECT_EQ_SIZE_T(LEPT_TRACE_STRINGIFY_END, test_events[14]);
+    EXPECT_EQ_SIZE_T(5, test_events[15]);
+    free(json);
+    lept_free(&v);
+}
+#endif
+
+#define TEST_PACKED(json)\
+    do {\
+        lept_parse_options opt;\
+        lept_value v, e, c;\
+        char* s;\
+        size_t len;\
+        lept_parse_options_init(&opt);\
+        opt.flags = LEPT_PARSE_PACK_NUMBERS;\
+        lept_init(&v);\
+        lept_init(&e);\
+        lept_init(&c);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, json));\
+        EXPECT_TRUE(lept_is_equal(&e, &v));\
+        EXPECT_TRUE(lept_is_equal(&v, &e));\
+        EXPECT_EQ_SIZE_T(lept_hash(&e), lept_hash(&v));\
+        EXPECT_EQ_SIZE_T(0, lept_diff(&e, &v, NULL, 0));\
+        lept_copy(&c, &v);\
+        EXPECT_TRUE(lept_is_equal(&e, &c));\
+        s = lept_stringify(&v, &len);\
+        EXPECT_EQ_STRING(json, s, len);\
+        free(s);\
+        lept_free(&v);\
+        lept_free(&e);\
+        lept_free(&c);\
+    } while(0)
+
+static void test_parse_packed() {
+    static const char* const keep[] = { "/a/1", "/b" };
+    lept_alloc_stats stats;
+    lept_allocator a = *lept_get_allocator();
+    lept_parse_options opt;
+    lept_value v, p;
+    const double* n;
+    char* json;
+    size_t i, len, packed, unpacked;
+
+    TEST_PACKED("[1,2.5,-300]");
+    TEST_PACKED("[[],[0],[1,\"a\"],[[2,3],4]]");
+    TEST_PACKED("{\"x\":[1e+20,-0,0.5],\"y\":[null,1]}");
+
+    lept_parse_options_init(&opt);
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[[1,2],[3,[4]],[],[\"x\"]]", &opt));
+    EXPECT_TRUE(lept_get_array_numbers(&v) == NULL);
+    n = lept_get_array_numbers(lept_get_array_element(&v, 0));
+    EXPECT_TRUE(n != NULL);
+    EXPECT_EQ_SIZE_T(2, lept_get_array_size(lept_get_array_element(&v, 0)));
+    EXPECT_EQ_DOUBLE(1.0, n[0]);
+    EXPECT_EQ_DOUBLE(2.0, n[1]);
+    EXPECT_TRUE(lept_get_array_numbers(lept_get_array_element(&v, 1)) == NULL);
+    EXPECT_TRUE(lept_get_array_numbers(lept_get_array_element(lept_get_array_element(&v, 1), 1)) != NULL);
+    EXPECT_TRUE(lept_get_array_numbers(lept_get_array_element(&v, 2)) == NULL);
+    EXPECT_FALSE(lept_pack_array(&v));
+    lept_unpack_array((lept_value*)lept_get_array_element(&v, 0));
+    EXPECT_TRUE(lept_get_array_numbers(lept_get_array_element(&v, 0)) == NULL);
+    EXPECT_EQ_DOUBLE(2.0, lept_get_number(lept_get_array_element(lept_get_array_element(&v, 0), 1)));
+    EXPECT_TRUE(lept_pack_array((lept_value*)lept_get_array_element(&v, 0)));
+    EXPECT_EQ_DOUBLE(2.0, lept_get_array_numbers(lept_get_array_element(&v, 0))[1]);
+    lept_free(&v);
+
+    /* patching an element unpacks the array */
+    lept_init(&v);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[1,2,3],\"b\":[4,5]}", &opt));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "[{\"op\":\"replace\",\"path\":\"/a/1\",\"value\":\"x\"},"
+        "{\"op\":\"test\",\"path\":\"/b/0\",\"value\":4},{\"op\":\"add\",\"path\":\"/b/-\",\"value\":6}]"));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch(&v, &p));
+    json = lept_stringify(&v, &len);
+    EXPECT_EQ_STRING("{\"a\":[1,\"x\",3],\"b\":[4,5,6]}", json, len);
+    free(json);
+    lept_free(&v);
+    lept_free(&p);
+
+    /* projection packs the numbers it keeps */
+    opt.keep = keep;
+    opt.nkeep = 2;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[\"s\",2],\"b\":[3,4],\"c\":[5]}", &opt));
+    EXPECT_TRUE(lept_get_array_numbers(lept_find_object_value(&v, "a", 1)) != NULL);
+    EXPECT_EQ_DOUBLE(2.0, lept_get_array_numbers(lept_find_object_value(&v, "a", 1))[0]);
+    EXPECT_TRUE(lept_get_array_numbers(lept_find_object_value(&v, "b", 1)) != NULL);
+    lept_free(&v);
+
+    /* a third of the memory (a double against a lept_value), also when built
+     * on several threads */
+    json = (char*)malloc(200000 * 8 + 16);
+    for (i = 0, len = 0; i < 200000; i++)
+        len += sprintf(json + len, "%c%d", i ? ',' : '[', (int)(i % 100000));
+    strcpy(json + len, "]");
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    memset(&stats, 0, sizeof(stats));
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));
+    unpacked = stats.live;
+    lept_free_with(&v, &a);
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    opt.threads = 4;
+    memset(&stats, 0, sizeof(stats));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));
+    packed = stats.live;
+    EXPECT_EQ_SIZE_T(200000 * sizeof(double), packed);
+    EXPECT_EQ_SIZE_T(200000 * sizeof(lept_value), unpacked);
+    EXPECT_TRUE(sizeof(lept_value) <= 2 * sizeof(size_t) + 2 * sizeof(unsigned)); /* hashes are kept outside */
+    EXPECT_EQ_DOUBLE(99999.0, lept_get_array_numbers(&v)[199999]);
+    lept_free_with(&v, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    free(json);
+}
+
+/* a few hundred KB of records with strings full of quotes, backslashes and
+ * brackets, so that chunk boundaries land inside them */
+static char* test_threads_json(size_t records) {
+    static const char* texts[] = {
+        "plain", "a \\\"quoted\\\" [word]", "back\\\\slash\\\\\\\\", "{not, an: [object]}",
+        "\\\\\\\"", "\\u005b\\u005d\\\\\\\\\\\\", "", "\\\\"
+    };
+    size_t i, n = 1;
+    char* json = (char*)malloc(records * 160 + 16);
+    json[0] = '[';
+    for (i = 0; i < records; i++) {
+        n += sprintf(json + n, "%s{\"id\":%d,\"t\":\"%s\",\"u\":[\"%s\",{\"\\\"k]\":[%d,[]]}],\"v\":\"%s\"}",
+            i ? ",\n " : "", (int)i, texts[i % 8], texts[(i / 8) % 8], (int)(i % 13), texts[(i * 7) % 8]);
+    }
+    strcpy(json + n, "]\n");
+    return json;
+}
+
+#define TEST_THREADS_ERROR(json)\
+    do {\
+        lept_parse_options opt;\
+        lept_parse_error e1, e2;\
+        lept_value v;\
+        lept_parse_options_init(&opt);\
+        opt.error = &e1;\
+        lept_init(&v);\
+        lept_parse_ex(&v, json, &opt);\
+        opt.error = &e2;\
+        opt.threads = 4;\
+        EXPECT_EQ_INT(e1.code, lept_parse_ex(&v, json, &opt));\
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+        EXPECT_TRUE(e1.code != LEPT_PARSE_OK);\
+        EXPECT_EQ_INT(e1.code, e2.code);\
+        EXPECT_EQ_SIZE_T(e1.offset, e2.offset);\
+        EXPECT_TRUE(strcmp(e1.path, e2.path) == 0);\
+    } while(0)
+
+static void test_parse_threads() {
+    lept_alloc_stats stats;
+    lept_allocator a = *lept_get_allocator();
+    lept_parse_options opt;
+    lept_value v, e;
+    char* json = test_threads_json(8000);
+    size_t n = strlen(json), i;
+    unsigned threads;
+
+    lept_init(&e);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, json));
+    for (threads = 2; threads <= 9; threads += 7) {
+        lept_parse_options_init(&opt);
+        opt.threads = threads;
+        lept_init(&v);
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));
+        EXPECT_EQ_SIZE_T(8000, lept_get_array_size(&v));
+        EXPECT_TRUE(lept_is_equal(&e, &v));
+        lept_free(&v);
+    }
+    lept_free(&e);
+
+    /* errors are found again serially, with the same report */
+    json[n / 2] = '}';
+    TEST_THREADS_ERROR(json);
+    json[n / 2] = ' ';
+    json[n - 2] = ',';
+    TEST_THREADS_ERROR(json);
+    json[n - 2] = ']';
+    json[n - 1] = ']';
+    TEST_THREADS_ERROR(json);
+    json[n - 1] = '\n';
+    json[n / 3] = '\"';
+    TEST_THREADS_ERROR(json);
+    for (i = 1; json[n / 3 + i] != '\"' && json[n / 3 + i] != '\\'; i++);
+    json[n / 3] = json[n / 3 + i] = '\\';
+    TEST_THREADS_ERROR(json);
+    free(json);
+
+    /* a big array of arrays, released in full, with every thread counted */
+    json = (char*)malloc(200000 * 12 + 16);
+    for (i = 0, n = 0; i < 200000; i++)
+        n += sprintf(json + n, "%c[%d,[]]", i ? ',' : '[', (int)(i % 1000));
+    strcpy(json + n, "]");
+    memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    opt.threads = 4;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opt));
+    EXPECT_EQ_SIZE_T(200000, lept_get_array_size(&v));
+    EXPECT_EQ_DOUBLE(999.0, lept_get_number(lept_get_array_element(lept_get_array_element(&v, 199999), 0)));
+    EXPECT_TRUE(stats.allocs >= 200000);
+    EXPECT_TRUE(stats.peak >= stats.live);
+    lept_free_with(&v, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    free(json);
+}
+
 static void  test_access_null() {
 	lept_value v;
 	lept_init(&v);
@@ -320,7 +1422,47 @@ static void test_access_boolean() {
         size_t length;\
         lept_init(&v);\
         EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_validate(json, strlen(json), NULL));\
         json2 = lept_stringify(&v, &length);\
+        EXPECT_EQ_STRING(json, json2, length);\
+        lept_free(&v);\
+        free(json2);\
+    } while(0)
+
+#define TEST_STRINGIFY_EX(expect, json, flags)\
+    do {\
+        lept_value v;\
+        char* json2;\
+        size_t length;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+        json2 = lept_stringify_ex(&v, &length, flags);\
+        EXPECT_EQ_STRING(expect, json2, length);\
+        lept_free(&v);\
+        free(json2);\
+    } while(0)
+
+/* exactly as long as lept_stringify_ex() says, and one byte short fails */
+#define TEST_STRINGIFY_TO(json, flags)\
+    do {\
+        lept_value v;\
+        char* json2, * buffer;\
+        size_t length, length2;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+        json2 = lept_stringify_ex(&v, &length, flags);\
+        EXPECT_EQ_SIZE_T(length, lept_stringify_length(&v, flags));\
+        buffer = (char*)malloc(length + 1);\
+        memset(buffer, '#', length + 1);\
+        EXPECT_EQ_INT(LEPT_STRINGIFY_BUFFER_TOO_SMALL, lept_stringify_to(&v, buffer, length, &length2, flags));\
+        EXPECT_EQ_SIZE_T(length, length2);\
+        EXPECT_TRUE(buffer[length] == '#');\
+        EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, length + 1, &length2, flags));\
+        EXPECT_EQ_SIZE_T(length, length2);\
+        EXPECT_TRUE(memcmp(json2, buffer, length + 1) == 0);\
+        lept_free(&v);\
+        free(json2);\
+        free(buffer);\
     } while(0)
 
 static void test_stringify_number() {
@@ -350,11 +1492,32 @@ static void test_stringify_number() {
 }
 
 static void test_stringify_string() {
+    lept_value v, v2;
+    char bytes[256], * json;
+    int i;
     TEST_ROUNDTRIP("\"\"");
     TEST_ROUNDTRIP("\"Hello\"");
     TEST_ROUNDTRIP("\"Hello\\nWorld\"");
     TEST_ROUNDTRIP("\"\\\" \\\\ / \\b \\f \\n \\r \\t\"");
     TEST_ROUNDTRIP("\"Hello\\u0000World\"");
+    /* escapes on either side of 8- and 16-byte blocks */
+    TEST_ROUNDTRIP("\"0123456\\n89abcde\\u001F0123456789abcdef\\\"\"");
+    TEST_ROUNDTRIP("\"0123456789abcdef0123456789abcdef0123456789abcdef\\\\\"");
+    TEST_ROUNDTRIP("\"\\u000B\\u0001\\t\\u001E\\r\x7F\"");
+    TEST_ROUNDTRIP("\"caf\xC3\xA9 \xE2\x82\xAC 0123456789abcdef \xF0\x9D\x84\x9E\"");
+
+    /* every byte value survives stringify and parse */
+    for (i = 0; i < 256; i++)
+        bytes[i] = (char)(255 - i);
+    lept_init(&v);
+    lept_init(&v2);
+    lept_set_string(&v, bytes, sizeof(bytes));
+    json = lept_stringify(&v, NULL);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v2, json));
+    EXPECT_TRUE(lept_is_equal(&v, &v2));
+    free(json);
+    lept_free(&v);
+    lept_free(&v2);
 }
 
 static void test_stringify_array() {
@@ -367,6 +1530,105 @@ static void test_stringify_object() {
     TEST_ROUNDTRIP("{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3}}");
 }
 
+static void test_stringify_pretty() {
+    TEST_STRINGIFY_EX("null", "null", LEPT_STRINGIFY_INDENT(2));
+    TEST_STRINGIFY_EX("[]", "[ ]", LEPT_STRINGIFY_INDENT(2));
+    TEST_STRINGIFY_EX("{}", "{ }", LEPT_STRINGIFY_INDENT(2));
+    TEST_STRINGIFY_EX("[\n  1,\n  2\n]", "[1,2]", LEPT_STRINGIFY_INDENT(2));
+    TEST_STRINGIFY_EX("{\n    \"a\": [\n        true,\n        {}\n    ],\n    \"b\": {\n        \"c\": \"d\"\n    }\n}",
+        "{\"a\":[true,{}],\"b\":{\"c\":\"d\"}}", LEPT_STRINGIFY_INDENT(4));
+}
+
+static void test_stringify_sorted() {
+    lept_value v;
+    char* json;
+    size_t length;
+
+    TEST_STRINGIFY_EX("{\"\":0,\"a\":1,\"ab\":2,\"b\":[{\"x\":1,\"y\":2}],\"\xC3\xA9\":3}",
+        "{\"b\":[{\"y\":2,\"x\":1}],\"ab\":2,\"\\u00e9\":3,\"a\":1,\"\":0}", LEPT_STRINGIFY_SORT_KEYS);
+    TEST_STRINGIFY_EX("{\n \"a\": 1,\n \"b\": 2\n}", "{\"b\":2,\"a\":1}", LEPT_STRINGIFY_SORT_KEYS | LEPT_STRINGIFY_INDENT(1));
+
+    /* the source keeps its member order */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"b\":1,\"a\":2}"));
+    json = lept_stringify_ex(&v, &length, LEPT_STRINGIFY_SORT_KEYS);
+    EXPECT_EQ_STRING("{\"a\":2,\"b\":1}", json, length);
+    free(json);
+    EXPECT_EQ_STRING("b", lept_get_object_key(&v, 0), lept_get_object_key_length(&v, 0));
+    lept_free(&v);
+}
+
+static void test_stringify_to() {
+    lept_alloc_stats stats;
+    test_arena arena = { 0, 0 };
+    lept_allocator a = { test_arena_malloc, test_arena_realloc, test_arena_free, NULL, NULL };
+    lept_parse_options opt;
+    lept_value v;
+    char buffer[256];
+    size_t length, live;
+    int i;
+    static const char* const jsons[] = {
+        "null", "false", "true", "0", "-1.5e-300", "1.0000000000000002", "\"\"",
+        "\"\\\" \\\\ / \\b \\f \\n \\r \\t \\u0000 \\u001F caf\xC3\xA9\"",
+        "[]", "{}", "[[]]", "[{}]", "{\"\":{}}", "[1,[2,[3]],\"x\"]",
+        "{\"n\":null,\"s\":\"a\\nb\",\"a\":[1,2,{\"x\":[]}],\"o\":{\"b\":1,\"a\":2}}",
+        "{\"b\":1,\"a\":[{\"y\":0,\"x\":1}],\"b\":2,\"\":3,\"b\":0}"
+    };
+    size_t allocs;
+    for (i = 0; i < (int)(sizeof(jsons) / sizeof(jsons[0])); i++) {
+        TEST_STRINGIFY_TO(jsons[i], 0);
+        TEST_STRINGIFY_TO(jsons[i], LEPT_STRINGIFY_INDENT(3));
+        TEST_STRINGIFY_TO(jsons[i], LEPT_STRINGIFY_INDENT(1) | LEPT_STRINGIFY_SORT_KEYS);
+    }
+
+    /* packed numbers, and numbers right at the end of the buffer */
+    lept_parse_options_init(&opt);
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[0.5,-2,1e+20]", &opt));
+    EXPECT_EQ_SIZE_T(14, lept_stringify_length(&v, 0));
+    EXPECT_EQ_SIZE_T(30, lept_stringify_length(&v, LEPT_STRINGIFY_INDENT(4)));
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, 15, &length, 0));
+    EXPECT_EQ_STRING("[0.5,-2,1e+20]", buffer, length);
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_STRINGIFY_BUFFER_TOO_SMALL, lept_stringify_to(&v, NULL, 0, &length, 0));
+    EXPECT_EQ_SIZE_T(4, length);
+
+    /* a text that does not fit is finished in scratch memory, all returned */
+    a.ud = &arena;
+    memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_set_allocator(&a);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"a\":[\"0123456789abcdef0123456789\",1e+20]}"));
+    live = stats.live;
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, sizeof(buffer), &length, LEPT_STRINGIFY_SORT_KEYS));
+    EXPECT_EQ_SIZE_T(42, length);
+    EXPECT_EQ_SIZE_T(live, stats.live);
+    for (i = 0; i < 42; i += 13) {
+        EXPECT_EQ_INT(LEPT_STRINGIFY_BUFFER_TOO_SMALL, lept_stringify_to(&v, buffer, i, &length, LEPT_STRINGIFY_INDENT(2)));
+        EXPECT_EQ_SIZE_T(lept_stringify_length(&v, LEPT_STRINGIFY_INDENT(2)), length);
+        EXPECT_EQ_SIZE_T(live, stats.live);
+    }
+    lept_free(&v);
+
+    /* sorting takes no memory either, whether the buffer has room past the
+     * text for the sort or not */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"c\":{\"z\":1,\"y\":2},\"b\":[{\"q\":1,\"p\":2}],\"a\":0}"));
+    allocs = stats.allocs;
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, sizeof(buffer), &length, LEPT_STRINGIFY_SORT_KEYS));
+    EXPECT_EQ_STRING("{\"a\":0,\"b\":[{\"p\":2,\"q\":1}],\"c\":{\"y\":2,\"z\":1}}", buffer, length);
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, length + 1, &length, LEPT_STRINGIFY_SORT_KEYS));
+    EXPECT_EQ_STRING("{\"a\":0,\"b\":[{\"p\":2,\"q\":1}],\"c\":{\"y\":2,\"z\":1}}", buffer, length);
+    EXPECT_EQ_INT(LEPT_STRINGIFY_OK, lept_stringify_to(&v, buffer, sizeof(buffer), &length, 0));
+    EXPECT_EQ_INT(LEPT_STRINGIFY_BUFFER_TOO_SMALL, lept_stringify_to(&v, buffer, 10, &length, LEPT_STRINGIFY_SORT_KEYS));
+    EXPECT_EQ_SIZE_T(45, length);
+    EXPECT_EQ_SIZE_T(allocs, stats.allocs);
+    lept_free(&v);
+    lept_set_allocator(NULL);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+}
+
 static void test_stringify() {
 	TEST_ROUNDTRIP("null");
     TEST_ROUNDTRIP("false");
@@ -375,6 +1637,380 @@ static void test_stringify() {
     test_stringify_string();
     test_stringify_array();
     test_stringify_object();
+    test_stringify_pretty();
+    test_stringify_sorted();
+    test_stringify_to();
+}
+
+#define TEST_HASH_EQ(json1, json2, expect)\
+    do {\
+        lept_value v1, v2;\
+        lept_init(&v1);\
+        lept_init(&v2);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json1));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v2, json2));\
+        EXPECT_EQ_INT(expect, lept_hash(&v1) == lept_hash(&v2));\
+        EXPECT_EQ_INT(expect, lept_is_equal(&v1, &v2));\
+        lept_free(&v1);\
+        lept_free(&v2);\
+    } while(0)
+
+static void test_hash() {
+    lept_value v1, v2, p, * e;
+    size_t h;
+
+    TEST_HASH_EQ("null", "null", 1);
+    TEST_HASH_EQ("0", "-0", 1);
+    TEST_HASH_EQ("\"a\\u0000b\"", "\"a\\u0000b\"", 1);
+    TEST_HASH_EQ("{\"a\":1,\"b\":[true,{\"c\":null}]}", "{\"b\":[true,{\"c\":null}],\"a\":1}", 1);
+    TEST_HASH_EQ("null", "false", 0);
+    TEST_HASH_EQ("true", "false", 0);
+    TEST_HASH_EQ("1", "\"1\"", 0);
+    TEST_HASH_EQ("\"ab\"", "\"ba\"", 0);
+    TEST_HASH_EQ("[1,2]", "[2,1]", 0);
+    TEST_HASH_EQ("[[]]", "[[],[]]", 0);
+    TEST_HASH_EQ("[]", "{}", 0);
+    TEST_HASH_EQ("{\"a\":1,\"b\":2}", "{\"a\":2,\"b\":1}", 0);
+    TEST_HASH_EQ("{\"a\":{\"b\":1}}", "{\"a\":{\"c\":1}}", 0);
+
+    /* the cache follows copies and is dropped by updates */
+    lept_init(&v1);
+    lept_init(&v2);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, "{\"list\":[1,2,3],\"name\":\"x\"}"));
+    h = lept_hash(&v1);
+    EXPECT_TRUE(v1.flags & LEPT_FLAG_HASHED);
+    EXPECT_EQ_SIZE_T(h, lept_hash(&v1));
+    lept_copy(&v2, &v1);
+    EXPECT_TRUE(v2.flags & LEPT_FLAG_HASHED);
+    EXPECT_EQ_SIZE_T(h, lept_hash(&v2));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "[{\"op\":\"add\",\"path\":\"/list/-\",\"value\":4}]"));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch(&v2, &p));
+    EXPECT_FALSE(v2.flags & LEPT_FLAG_HASHED);
+    EXPECT_FALSE(lept_find_object_value(&v2, "list", 4)->flags & LEPT_FLAG_HASHED);
+    EXPECT_TRUE(lept_hash(&v2) != h);
+    EXPECT_FALSE(lept_is_equal(&v1, &v2));
+    lept_free(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "{\"list\":[1,2,3]}"));
+    lept_merge_patch(&v2, &p);
+    EXPECT_EQ_SIZE_T(h, lept_hash(&v2));
+    EXPECT_TRUE(lept_is_equal(&v1, &v2));
+
+    /* changes made through returned pointers need an explicit invalidation */
+    lept_set_boolean(lept_find_object_value(&v2, "name", 4), 1);
+    EXPECT_EQ_SIZE_T(h, lept_hash(&v2));
+    lept_invalidate_hash(&v2);
+    EXPECT_TRUE(lept_hash(&v2) != h);
+    EXPECT_FALSE(lept_is_equal(&v1, &v2));
+    lept_free(&v1);
+    lept_free(&v2);
+    lept_free(&p);
+
+    /* containers built by hand are hashed and freed like parsed ones */
+    e = (lept_value*)malloc(2 * sizeof(lept_value));
+    lept_init(&e[0]);
+    lept_init(&e[1]);
+    e[0].type = e[1].type = LEPT_NUMBER;
+    e[0].u.n = 1.0;
+    e[1].u.n = 2.0;
+    v1.type = LEPT_ARRAY;
+    v1.flags = 0;
+    v1.u.a.e = e;
+    v1.u.a.size = 2;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v2, "[1,2]"));
+    EXPECT_EQ_SIZE_T(lept_hash(&v2), lept_hash(&v1));
+    EXPECT_TRUE(v1.flags & LEPT_FLAG_HASHED);
+    EXPECT_TRUE(lept_pack_array(&v1));
+    EXPECT_EQ_SIZE_T(lept_hash(&v2), lept_hash(&v1));
+    lept_free(&v1);
+    lept_free(&v2);
+}
+
+#define TEST_MERGE_PATCH(expect, target, patch)\
+    do {\
+        lept_value t, p, e;\
+        lept_init(&t);\
+        lept_init(&p);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&t, target));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, patch));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, expect));\
+        lept_merge_patch(&t, &p);\
+        EXPECT_TRUE(lept_is_equal(&e, &t));\
+        lept_free(&t);\
+        lept_free(&p);\
+        lept_free(&e);\
+    } while(0)
+
+static void test_merge_patch() {
+    lept_intern keys;
+    lept_parse_options opt;
+    lept_value t, p;
+
+    /* RFC 7386, appendix A */
+    TEST_MERGE_PATCH("{\"a\":\"c\"}", "{\"a\":\"b\"}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":\"b\"}", "{\"b\":\"c\"}");
+    TEST_MERGE_PATCH("{}", "{\"a\":\"b\"}", "{\"a\":null}");
+    TEST_MERGE_PATCH("{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}");
+    TEST_MERGE_PATCH("{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":[\"b\"]}");
+    TEST_MERGE_PATCH("{\"a\":{\"b\":\"d\"}}", "{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}");
+    TEST_MERGE_PATCH("{\"a\":[1]}", "{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}");
+    TEST_MERGE_PATCH("[\"c\",\"d\"]", "[\"a\",\"b\"]", "[\"c\",\"d\"]");
+    TEST_MERGE_PATCH("[\"c\"]", "{\"a\":\"b\"}", "[\"c\"]");
+    TEST_MERGE_PATCH("null", "{\"a\":\"foo\"}", "null");
+    TEST_MERGE_PATCH("\"bar\"", "{\"a\":\"foo\"}", "\"bar\"");
+    TEST_MERGE_PATCH("{\"e\":null,\"a\":1}", "{\"e\":null}", "{\"a\":1}");
+    TEST_MERGE_PATCH("{\"a\":\"b\"}", "[1,2]", "{\"a\":\"b\",\"c\":null}");
+    TEST_MERGE_PATCH("{\"a\":{\"bb\":{}}}", "{}", "{\"a\":{\"bb\":{\"ccc\":null}}}");
+
+    /* adding to an object with interned keys gives it its own copies */
+    lept_intern_init(&keys);
+    lept_parse_options_init(&opt);
+    opt.keys = &keys;
+    lept_init(&t);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&t, "{\"id\":1,\"name\":\"a\"}", &opt));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "{\"name\":null,\"tag\":true}"));
+    lept_merge_patch(&t, &p);
+    lept_intern_free(&keys);
+    EXPECT_EQ_SIZE_T(2, lept_get_object_size(&t));
+    EXPECT_EQ_STRING("id", lept_get_object_key(&t, 0), lept_get_object_key_length(&t, 0));
+    EXPECT_EQ_STRING("tag", lept_get_object_key(&t, 1), lept_get_object_key_length(&t, 1));
+    lept_free(&t);
+    lept_free(&p);
+}
+
+#define TEST_PATCH(error, expect, doc, patch)\
+    do {\
+        lept_value d, p, e;\
+        lept_init(&d);\
+        lept_init(&p);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&d, doc));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, patch));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, expect));\
+        EXPECT_EQ_INT(error, lept_patch(&d, &p));\
+        EXPECT_TRUE(lept_is_equal(&e, &d));\
+        lept_free(&d);\
+        lept_free(&p);\
+        lept_free(&e);\
+    } while(0)
+
+static void test_patch() {
+    test_arena arena = { 0, 0 };
+    lept_alloc_stats stats;
+    lept_allocator a = { test_arena_malloc, test_arena_realloc, test_arena_free, NULL, NULL };
+    lept_parse_options opt;
+    lept_value d, p;
+    char* json;
+    size_t i, n;
+
+    /* RFC 6902, appendix A */
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"qux\",\"foo\":\"bar\"}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\",\"qux\",\"baz\"]}",
+        "{\"foo\":[\"bar\",\"baz\"]}", "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":\"bar\"}",
+        "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"remove\",\"path\":\"/baz\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\",\"baz\"]}",
+        "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"boo\",\"foo\":\"bar\"}",
+        "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"/baz\",\"value\":\"boo\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":{\"bar\":\"baz\"},\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}",
+        "{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},\"qux\":{\"corge\":\"grault\"}}",
+        "[{\"op\":\"move\",\"from\":\"/foo/waldo\",\"path\":\"/qux/thud\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}",
+        "{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}", "[{\"op\":\"move\",\"from\":\"/foo/1\",\"path\":\"/foo/3\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}", "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+        "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]");
+    TEST_PATCH(LEPT_PATCH_TEST_FAILED, "{\"baz\":\"qux\"}",
+        "{\"baz\":\"qux\"}", "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":\"bar\",\"child\":{\"grandchild\":{}}}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/child\",\"value\":{\"grandchild\":{}}}]");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"foo\":\"bar\"}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz/bat\",\"value\":\"qux\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"/\":9,\"~1\":10}",
+        "{\"/\":9,\"~1\":10}", "[{\"op\":\"test\",\"path\":\"/~01\",\"value\":10},{\"op\":\"test\",\"path\":\"/~1\",\"value\":9}]");
+    TEST_PATCH(LEPT_PATCH_TEST_FAILED, "{\"/\":9,\"~1\":10}",
+        "{\"/\":9,\"~1\":10}", "[{\"op\":\"test\",\"path\":\"/~01\",\"value\":\"10\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\",[\"abc\",\"def\"]]}",
+        "{\"foo\":[\"bar\"]}", "[{\"op\":\"add\",\"path\":\"/foo/-\",\"value\":[\"abc\",\"def\"]}]");
+
+    TEST_PATCH(LEPT_PATCH_OK, "{\"a\":{\"b\":[1]},\"c\":{\"b\":[1,2]}}",
+        "{\"a\":{\"b\":[1]}}", "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/c\"},{\"op\":\"add\",\"path\":\"/c/b/-\",\"value\":2}]");
+    TEST_PATCH(LEPT_PATCH_OK, "[]", "[1]", "[{\"op\":\"remove\",\"path\":\"/0\"}]");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"x\":1}", "[1,2]", "[{\"op\":\"replace\",\"path\":\"\",\"value\":{\"x\":1}}]");
+    TEST_PATCH(LEPT_PATCH_OK, "[{\"a\":1}]", "{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/x\",\"value\":[]},{\"op\":\"move\",\"from\":\"\",\"path\":\"\"},"
+        "{\"op\":\"remove\",\"path\":\"/x\"},{\"op\":\"copy\",\"from\":\"\",\"path\":\"/x\"},{\"op\":\"move\",\"from\":\"/x\",\"path\":\"/y\"},"
+        "{\"op\":\"remove\",\"path\":\"/y\"},{\"op\":\"replace\",\"path\":\"\",\"value\":[]},{\"op\":\"add\",\"path\":\"/0\",\"value\":{\"a\":1}}]");
+
+    /* malformed patches are rejected before anything changes */
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"a\":1}", "{\"a\":1}", "{\"op\":\"remove\",\"path\":\"/a\"}");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"a\":1}", "{\"a\":1}",
+        "[{\"op\":\"remove\",\"path\":\"/a\"},{\"op\":\"delete\",\"path\":\"/a\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"a\":1}", "{\"a\":1}",
+        "[{\"op\":\"remove\",\"path\":\"/a\"},{\"op\":\"add\",\"path\":\"/b\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"a\":1}", "{\"a\":1}",
+        "[{\"op\":\"remove\",\"path\":\"/a\"},{\"op\":\"copy\",\"path\":\"/b\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"a\":1}", "{\"a\":1}", "[{\"op\":\"remove\",\"path\":1}]");
+
+    /* errors found while applying leave earlier operations in place */
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"b\":2}", "{\"a\":1}",
+        "[{\"op\":\"add\",\"path\":\"/b\",\"value\":2},{\"op\":\"remove\",\"path\":\"/a\"},{\"op\":\"remove\",\"path\":\"/a\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_POINTER, "{\"a\":1}", "{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"a\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_POINTER, "{\"a~b\":1}", "{\"a~b\":1}", "[{\"op\":\"remove\",\"path\":\"/a~2b\"}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_POINTER, "[1,2]", "[1,2]", "[{\"op\":\"add\",\"path\":\"/01\",\"value\":0}]");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "[1,2]", "[1,2]", "[{\"op\":\"add\",\"path\":\"/3\",\"value\":0}]");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "[1,2]", "[1,2]", "[{\"op\":\"remove\",\"path\":\"/-\"}]");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "[1,2]", "[1,2]", "[{\"op\":\"replace\",\"path\":\"/2\",\"value\":0}]");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"a\":1}", "{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/a/b\",\"value\":0}]");
+    TEST_PATCH(LEPT_PATCH_INVALID_POINTER, "{\"a\":{\"b\":1}}", "{\"a\":{\"b\":1}}",
+        "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b/c\"}]");
+
+    /* the cost follows the patch, not the document */
+    json = (char*)malloc(1000 * 32 + 2);
+    for (i = 0, n = sprintf(json, "["); i < 1000; i++)
+        n += sprintf(json + n, i ? ",{\"id\":%d,\"tags\":[1,2]}" : "{\"id\":%d,\"tags\":[1,2]}", (int)i);
+    strcpy(json + n, "]");
+    memset(&stats, 0, sizeof(stats));
+    a.ud = &arena;
+    a.stats = &stats;
+    lept_set_allocator(&a);
+    lept_init(&d);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&d, json));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "[{\"op\":\"replace\",\"path\":\"/500/id\",\"value\":-1},"
+        "{\"op\":\"add\",\"path\":\"/999/tags/0\",\"value\":0},{\"op\":\"move\",\"from\":\"/0\",\"path\":\"/-\"}]"));
+    memset(&stats, 0, sizeof(stats));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch(&d, &p));
+    EXPECT_TRUE(stats.allocs + stats.reallocs < 10);
+    EXPECT_EQ_DOUBLE(-1.0, lept_get_number(lept_find_object_value(lept_get_array_element(&d, 499), "id", 2)));
+    EXPECT_EQ_DOUBLE(0.0, lept_get_number(lept_find_object_value(lept_get_array_element(&d, 999), "id", 2)));
+    lept_free(&d);
+    lept_free(&p);
+    lept_set_allocator(NULL);
+    free(json);
+
+    /* a document parsed with its own allocator is patched with that one */
+    memset(&stats, 0, sizeof(stats));
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&d, "{\"a\":{\"b\":\"c\",\"d\":[1,\"e\"]},\"f\":\"g\"}", &opt));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&p, "{\"a\":{\"b\":null,\"h\":\"i\"},\"f\":[\"j\"]}", &opt));
+    lept_merge_patch_with(&d, &p, &a);
+    lept_free_with(&p, &a);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&p, "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/k\"},"
+        "{\"op\":\"remove\",\"path\":\"/a/d/1\"},{\"op\":\"add\",\"path\":\"/a/d/0\",\"value\":\"l\"},"
+        "{\"op\":\"replace\",\"path\":\"/f\",\"value\":{\"m\":\"n\"}},{\"op\":\"move\",\"from\":\"/k\",\"path\":\"/a/k\"}]", &opt));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch_with(&d, &p, &a));
+    lept_free_with(&p, &a);
+    json = lept_stringify(&d, NULL);
+    EXPECT_EQ_STRING("{\"a\":{\"d\":[\"l\",1],\"h\":\"i\",\"k\":{\"d\":[1,\"e\"],\"h\":\"i\"}},\"f\":{\"m\":\"n\"}}", json, strlen(json));
+    free(json);
+    lept_free_with(&d, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+
+    /* and so are the packed arrays it unpacks on the way */
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&d, "{\"a\":[1,2,3],\"b\":[[4,5]]}", &opt));
+    EXPECT_TRUE(lept_get_array_numbers(lept_find_object_value(&d, "a", 1)) != NULL);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&p, "[{\"op\":\"replace\",\"path\":\"/a/1\",\"value\":\"x\"},"
+        "{\"op\":\"remove\",\"path\":\"/b/0/0\"}]", &opt));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch_with(&d, &p, &a));
+    lept_free_with(&p, &a);
+    EXPECT_TRUE(lept_get_array_numbers(lept_find_object_value(&d, "a", 1)) == NULL);
+    EXPECT_TRUE(lept_pack_array_with((lept_value*)lept_get_array_element(lept_find_object_value(&d, "b", 1), 0), &a));
+    json = lept_stringify(&d, NULL);
+    EXPECT_EQ_STRING("{\"a\":[1,\"x\",3],\"b\":[[5]]}", json, strlen(json));
+    free(json);
+    lept_free_with(&d, &a);
+    EXPECT_EQ_SIZE_T(0, stats.live);
+    EXPECT_EQ_SIZE_T(arena.allocs, arena.frees);
+}
+
+#define TEST_DIFF(expect, from, to)\
+    do {\
+        lept_value f, t, p;\
+        lept_init(&f);\
+        lept_init(&t);\
+        lept_init(&p);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&f, from));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&t, to));\
+        EXPECT_EQ_SIZE_T(expect, lept_diff(&f, &t, &p, 0));\
+        EXPECT_EQ_SIZE_T(expect, lept_get_array_size(&p));\
+        EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch(&f, &p));\
+        EXPECT_TRUE(lept_is_equal(&f, &t));\
+        lept_free(&f);\
+        lept_free(&t);\
+        lept_free(&p);\
+    } while(0)
+
+static void test_diff() {
+    lept_value f, t, p, * inner;
+    char from[1024], to[1024], * json;
+    size_t i, n, m, length;
+
+    TEST_DIFF(0, "null", "null");
+    TEST_DIFF(0, "{\"a\":[1,{\"b\":true}],\"c\":\"d\"}", "{\"c\":\"d\",\"a\":[1,{\"b\":true}]}");
+    TEST_DIFF(1, "1", "2");
+    TEST_DIFF(1, "[1]", "{\"0\":1}");
+    TEST_DIFF(3, "{\"a\":1,\"b\":2,\"c\":3}", "{\"a\":1,\"b\":{\"x\":2},\"d\":4}");
+    TEST_DIFF(2, "{\"a/b\":1,\"m~n\":2}", "{\"a/b\":0,\"m~n\":0}");
+    TEST_DIFF(1, "[1,2,3]", "[0,1,2,3]");
+    TEST_DIFF(1, "[1,2,3]", "[1,3]");
+    TEST_DIFF(2, "[1,2,3]", "[1,2,3,4,5]");
+    TEST_DIFF(3, "[1,2,3,4,5]", "[1,5]");
+    TEST_DIFF(1, "[[1,2],[3,4]]", "[[1,2],[3,5]]");
+    TEST_DIFF(3, "[1,[2],{\"a\":3}]", "[0,[2,2],{\"a\":4}]");
+    TEST_DIFF(1, "[{\"id\":1},{\"id\":2}]", "[{\"id\":1},{\"id\":2},{\"id\":3}]");
+
+    /* the operations themselves */
+    lept_init(&f);
+    lept_init(&t);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&f, "{\"a\":{\"b\":[1,2]},\"c\":0}"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&t, "{\"a\":{\"b\":[1]},\"d\":\"x\"}"));
+    EXPECT_EQ_SIZE_T(3, lept_diff(&f, &t, &p, 0));
+    json = lept_stringify(&p, &length);
+    EXPECT_EQ_STRING("[{\"op\":\"remove\",\"path\":\"/a/b/1\"},{\"op\":\"remove\",\"path\":\"/c\"},"
+        "{\"op\":\"add\",\"path\":\"/d\",\"value\":\"x\"}]", json, length);
+    free(json);
+
+    /* stopping at the first change */
+    EXPECT_EQ_SIZE_T(1, lept_diff(&f, &t, &p, LEPT_DIFF_FIRST));
+    EXPECT_EQ_SIZE_T(1, lept_get_array_size(&p));
+    EXPECT_EQ_SIZE_T(1, lept_diff(&f, &t, NULL, LEPT_DIFF_FIRST));
+    EXPECT_EQ_SIZE_T(0, lept_diff(&f, &f, NULL, LEPT_DIFF_FIRST));
+    lept_free(&f);
+    lept_free(&t);
+    lept_free(&p);
+
+    /* objects big enough to be matched through the hash index */
+    for (i = 0, n = sprintf(from, "{"), m = sprintf(to, "{"); i < 40; i++) {
+        n += sprintf(from + n, i ? ",\"k%d\":%d" : "\"k%d\":%d", (int)i, (int)i);
+        m += sprintf(to + m, i ? ",\"k%d\":%d" : "\"k%d\":%d", (int)(39 - i), (int)(i % 7 == 0 ? 0 : 39 - i));
+    }
+    strcpy(from + n, ",\"old\":1}");
+    strcpy(to + m, ",\"new\":1}");
+    TEST_DIFF(8, from, to);
+
+    /* subtrees with matching hashes are skipped, not compared: a change made
+     * behind the cache's back goes unseen until the cache is dropped */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&f, "{\"a\":[{\"b\":[1,2]}],\"c\":1}"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&t, "{\"a\":[{\"b\":[1,2]}],\"c\":2}"));
+    EXPECT_EQ_SIZE_T(1, lept_diff(&f, &t, NULL, 0));
+    inner = lept_find_object_value(lept_get_array_element(lept_find_object_value(&t, "a", 1), 0), "b", 1);
+    inner->u.a.e[1].u.n = 3.0;
+    EXPECT_EQ_SIZE_T(1, lept_diff(&f, &t, NULL, 0));
+    lept_invalidate_hash(inner);
+    lept_invalidate_hash((lept_value*)lept_get_array_element(lept_find_object_value(&t, "a", 1), 0));
+    lept_invalidate_hash(lept_find_object_value(&t, "a", 1));
+    lept_invalidate_hash(&t);
+    EXPECT_EQ_SIZE_T(2, lept_diff(&f, &t, NULL, 0));
+    lept_free(&f);
+    lept_free(&t);
 }
 
 static void test_parse() {
@@ -395,11 +2031,31 @@ static void test_parse() {
 	test_parse_string();
 	test_parse_array();
 	test_parse_object();
+	test_parse_intern();
+	test_validate();
+	test_parse_error_context();
+	test_parse_strict_utf8();
+	test_parse_project();
+	test_tape();
+	test_parse_struct();
+	test_parse_struct_array();
+	test_allocator();
+	test_free();
+	test_load_files();
+#ifdef LEPT_TRACE
+	test_trace();
+#endif
+	test_parse_threads();
+	test_parse_packed();
 
 	test_access_null();
 	test_access_boolean();
 
 	test_stringify();
+	test_hash();
+	test_merge_patch();
+	test_patch();
+	test_diff();
 }
 
 int main(void) {
@@ -0,0 +1,139 @@
+#include "leptjson.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+using namespace lept::literals;
+
+static int main_ret = 0;
+static int test_count = 0;
+static int test_pass = 0;
+
+#define EXPECT_TRUE(actual)\
+    do {\
+        test_count++;\
+        if (actual)\
+            test_pass++;\
+        else {\
+            fprintf(stderr, "%s:%d expect: true, actual: false (%s)\n", __FILE__, __LINE__, #actual);\
+            main_ret = 1;\
+        }\
+    } while(0)
+
+static_assert(!std::is_copy_constructible<lept::value>::value, "values are move-only");
+static_assert(std::is_nothrow_move_constructible<lept::value>::value, "moves cannot fail");
+static_assert(std::is_trivially_copyable<lept::view>::value, "views are plain pointers");
+static_assert(sizeof(lept::view) == sizeof(const lept_value*), "views are plain pointers");
+static_assert(("id"_key).name.size() == 2, "keys are constant");
+
+static void test_value() {
+    lept::value a, c;
+    EXPECT_TRUE(a.is_null());
+    EXPECT_TRUE(a.parse("{\"n\":1.5,\"s\":\"a\\u0000b\",\"t\":true,\"a\":[1,[2],{}]}") == LEPT_PARSE_OK);
+    EXPECT_TRUE(a.is_object() && a.size() == 4);
+
+    /* moves hand the tree over, clone() is the only copy */
+    lept::value b(std::move(a));
+    EXPECT_TRUE(a.is_null() && b.is_object());
+    c = b.clone();
+    EXPECT_TRUE(c == b && c.get() != b.get());
+    a = std::move(c);
+    EXPECT_TRUE(c.is_null() && a == b);
+    swap(a, c);
+    EXPECT_TRUE(a.is_null() && c == b);
+
+    EXPECT_TRUE(b.parse(std::string("[1")) == LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET);
+    EXPECT_TRUE(b.is_null());
+    EXPECT_TRUE(b.parse("\"x\"") == LEPT_PARSE_OK && b.string() == "x");
+}
+
+static void test_view() {
+    lept::value v;
+    lept::view s, missing;
+    std::size_t i = 0, length;
+    double sum = 0.0;
+    char buffer[64];
+    EXPECT_TRUE(v.parse("{\"n\":1.5,\"s\":\"a\\u0000b\",\"t\":true,\"a\":[1,[2],{},null],\"\":false}") == LEPT_PARSE_OK);
+
+    /* strings keep their length, NULs included */
+    s = v["s"_key];
+    EXPECT_TRUE(s && s.is_string() && s.string().size() == 3 && s.string() == std::string_view("a\0b", 3));
+    EXPECT_TRUE(v.find("n").number() == 1.5);
+    EXPECT_TRUE(v.find("t"_key).boolean() && v.find(std::string_view("", 0)).is_bool() && !v.find("").boolean());
+    missing = v.find("nope");
+    EXPECT_TRUE(!missing);
+
+    for (lept::view e : v["a"_key].elements()) {
+        if (e.is_number())
+            sum += e.number();
+        else if (e.is_array())
+            sum += e[0].number();
+        i++;
+    }
+    EXPECT_TRUE(i == 4 && sum == 3.0);
+    EXPECT_TRUE(v["a"_key].elements()[3].is_null() && v["a"_key][2].is_object());
+
+    /* members in document order */
+    i = 0;
+    for (lept::member m : v.members()) {
+        if (m.key() == "n")
+            EXPECT_TRUE(m.value().number() == 1.5);
+        else if (m.key() == "s")
+            EXPECT_TRUE(m.value().string().size() == 3);
+        else if (m.key() == "t")
+            EXPECT_TRUE(m.value().boolean());
+        else if (m.key() == "a")
+            EXPECT_TRUE(m.value().size() == 4);
+        else
+            EXPECT_TRUE(m.key().empty());
+        i++;
+    }
+    EXPECT_TRUE(i == 5);
+
+    EXPECT_TRUE(v["a"_key].stringify() == "[1,[2],{},null]");
+    EXPECT_TRUE(v["a"_key][1].stringify(LEPT_STRINGIFY_INDENT(1)) == "[\n 2\n]");
+    EXPECT_TRUE(v["a"_key].stringify_to(buffer, sizeof(buffer), &length) == LEPT_STRINGIFY_OK && length == 15);
+    EXPECT_TRUE(std::strcmp(buffer, "[1,[2],{},null]") == 0);
+    EXPECT_TRUE(v["a"_key].hash() == lept::view(v.get()).find("a").hash());
+}
+
+static void test_packed() {
+    lept_parse_options opt;
+    lept::value v;
+    lept_parse_options_init(&opt);
+    opt.flags = LEPT_PARSE_PACK_NUMBERS;
+    EXPECT_TRUE(v.parse("[0.5,2,4]", &opt) == LEPT_PARSE_OK);
+    EXPECT_TRUE(v.numbers() != nullptr && v.size() == 3 && v.numbers()[2] == 4.0);
+    EXPECT_TRUE(v.stringify() == "[0.5,2,4]");
+}
+
+static void test_allocator() {
+    lept_alloc_stats stats;
+    lept_allocator a = *lept_get_allocator();
+    lept_parse_options opt;
+    std::memset(&stats, 0, sizeof(stats));
+    a.stats = &stats;
+    lept_parse_options_init(&opt);
+    opt.alloc = &a;
+    {
+        lept::value v, w;
+        EXPECT_TRUE(v.parse("{\"a\":[\"b\",{\"c\":\"d\"}]}", &opt) == LEPT_PARSE_OK);
+        EXPECT_TRUE(stats.live > 0);
+        w = std::move(v);
+        EXPECT_TRUE(v.parse("[]") == LEPT_PARSE_OK && stats.live > 0);
+    }
+    /* freed with the allocator they were parsed with */
+    EXPECT_TRUE(stats.live == 0);
+}
+
+int main() {
+    test_value();
+    test_view();
+    test_packed();
+    test_allocator();
+    printf("%d %d (%3.2f%%) passed\n", test_pass, test_count, test_pass * 100.0 / test_count);
+    return main_ret;
+}